@@ -0,0 +1,494 @@
+// 1 つのプロセスで大量の送信者を Sora に接続する負荷試験用のツール。
+//
+// 映像は 1 つのエンコーダでエンコードした結果を全ての送信者で共有し、
+// フレームを刻むスレッドも 1 つだけにしているので、送信者を増やしても
+// 増えるのはパケット化や暗号化などの送信処理だけになる。
+// 送信処理は送信者を複数のスレッドに振り分けて行う。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// POSIX
+#include <getopt.h>
+
+// Sora C SDK
+#include <sorac/current_time.hpp>
+#include <sorac/open_h264_video_encoder.hpp>
+#include <sorac/signaling.hpp>
+#include <sorac/sorac.h>
+#include <sorac/types.hpp>
+
+#include "shared_video_encoder.hpp"
+#include "steady_frame_thread.hpp"
+
+namespace sumomo {
+
+static const int AUDIO_SAMPLE_RATE = 48000;
+static const int AUDIO_FRAME_DURATION_MS = 20;
+// 送信スレッドに溜めておけるフレームの数。
+// これを超えたら古いフレームから捨てる。映像のフレームを捨てた送信者はキーフレームを待つ。
+static const size_t MAX_PENDING_SEND_FRAMES = 10;
+
+struct LoadgenOption {
+  std::vector<std::string> signaling_urls;
+  std::string channel_id;
+  // 1 より大きい場合は、送信者を channel_id + "-" + 番号 のチャンネルに振り分ける
+  int channel_count = 1;
+  int senders = 10;
+  int video_width = 640;
+  int video_height = 480;
+  int video_fps = 30;
+  int video_bit_rate = 500;
+  bool audio = false;
+  std::string metadata;
+  std::string openh264;
+  std::string cacert = "/etc/ssl/certs/ca-certificates.crt";
+  // 送信者の接続を開始する間隔
+  int connect_interval_ms = 100;
+  // 統計情報を出力する間隔
+  int stats_interval_sec = 5;
+  // フレームを送る処理を行うスレッドの数。0 の場合は CPU のコア数にする
+  int send_threads = 0;
+};
+
+static bool ParseOption(LoadgenOption& opt, int argc, char* argv[]) {
+  static struct option long_opts[] = {
+      {"signaling-url", required_argument, 0, 0},
+      {"channel-id", required_argument, 0, 0},
+      {"channel-count", required_argument, 0, 0},
+      {"senders", required_argument, 0, 0},
+      {"video-width", required_argument, 0, 0},
+      {"video-height", required_argument, 0, 0},
+      {"video-fps", required_argument, 0, 0},
+      {"video-bit-rate", required_argument, 0, 0},
+      {"audio", required_argument, 0, 0},
+      {"metadata", required_argument, 0, 0},
+      {"openh264", required_argument, 0, 0},
+      {"cacert", required_argument, 0, 0},
+      {"connect-interval-ms", required_argument, 0, 0},
+      {"stats-interval", required_argument, 0, 0},
+      {"send-threads", required_argument, 0, 0},
+      {"help", no_argument, 0, 0},
+      {0, 0, 0, 0},
+  };
+  int index;
+  int c;
+  bool error = false;
+  bool help = false;
+  while ((c = getopt_long(argc, argv, "", long_opts, &index)) != -1) {
+    if (c != 0) {
+      error = true;
+      help = true;
+      break;
+    }
+#define OPT_IS(optname) strcmp(long_opts[index].name, optname) == 0
+    if (OPT_IS("signaling-url")) {
+      opt.signaling_urls.push_back(optarg);
+    } else if (OPT_IS("channel-id")) {
+      opt.channel_id = optarg;
+    } else if (OPT_IS("channel-count")) {
+      opt.channel_count = atoi(optarg);
+    } else if (OPT_IS("senders")) {
+      opt.senders = atoi(optarg);
+    } else if (OPT_IS("video-width")) {
+      opt.video_width = atoi(optarg);
+    } else if (OPT_IS("video-height")) {
+      opt.video_height = atoi(optarg);
+    } else if (OPT_IS("video-fps")) {
+      opt.video_fps = atoi(optarg);
+    } else if (OPT_IS("video-bit-rate")) {
+      opt.video_bit_rate = atoi(optarg);
+    } else if (OPT_IS("audio")) {
+      if (strcmp(optarg, "true") == 0) {
+        opt.audio = true;
+      } else if (strcmp(optarg, "false") == 0) {
+        opt.audio = false;
+      } else {
+        fprintf(stderr, "Invalid audio: %s\n", optarg);
+        error = true;
+      }
+    } else if (OPT_IS("metadata")) {
+      opt.metadata = optarg;
+    } else if (OPT_IS("openh264")) {
+      opt.openh264 = optarg;
+    } else if (OPT_IS("cacert")) {
+      opt.cacert = optarg;
+    } else if (OPT_IS("connect-interval-ms")) {
+      opt.connect_interval_ms = atoi(optarg);
+    } else if (OPT_IS("stats-interval")) {
+      opt.stats_interval_sec = atoi(optarg);
+    } else if (OPT_IS("send-threads")) {
+      opt.send_threads = atoi(optarg);
+    } else if (OPT_IS("help")) {
+      help = true;
+    }
+#undef OPT_IS
+  }
+  if (help) {
+    fprintf(stdout, "Usage: %s [options]\n", argv[0]);
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  --signaling-url=URL [required]\n");
+    fprintf(stdout, "  --channel-id=ID [required]\n");
+    fprintf(stdout, "  --channel-count=COUNT\n");
+    fprintf(stdout, "  --senders=COUNT\n");
+    fprintf(stdout, "  --video-width=WIDTH\n");
+    fprintf(stdout, "  --video-height=HEIGHT\n");
+    fprintf(stdout, "  --video-fps=FPS\n");
+    fprintf(stdout, "  --video-bit-rate=0-5000 [kbps]\n");
+    fprintf(stdout, "  --audio=true,false\n");
+    fprintf(stdout, "  --metadata=JSON\n");
+    fprintf(stdout, "  --openh264=PATH [required]\n");
+    fprintf(stdout, "  --cacert=PATH\n");
+    fprintf(stdout, "  --connect-interval-ms=MS\n");
+    fprintf(stdout, "  --stats-interval=SEC\n");
+    fprintf(stdout, "  --send-threads=COUNT\n");
+    fprintf(stdout, "  --help\n");
+    return false;
+  }
+  if (error) {
+    return false;
+  }
+  if (opt.signaling_urls.empty()) {
+    fprintf(stderr, "signaling-url is required\n");
+    return false;
+  }
+  if (opt.channel_id.empty()) {
+    fprintf(stderr, "channel-id is required\n");
+    return false;
+  }
+  if (opt.openh264.empty()) {
+    fprintf(stderr, "openh264 is required\n");
+    return false;
+  }
+  if (opt.senders < 1 || opt.channel_count < 1 || opt.video_fps < 1 ||
+      opt.video_width < 16 || opt.video_height < 16 ||
+      opt.stats_interval_sec < 1 || opt.send_threads < 0) {
+    fprintf(stderr, "Invalid option\n");
+    return false;
+  }
+  return true;
+}
+
+struct Sender {
+  std::shared_ptr<sorac::Signaling> signaling;
+  std::atomic<soracp::SignalingState> state{soracp::SIGNALING_STATE_IDLE};
+};
+
+// 一部の送信者にフレームを送るスレッド。
+// フレームを刻むスレッドで全ての送信者に送ると 1 コアしか使えないので、
+// 送信者を複数のスレッドに振り分けて送る。
+class SendWorker {
+ public:
+  SendWorker(std::vector<Sender*> senders) : senders_(std::move(senders)) {
+    th_ = std::thread([this]() { Run(); });
+  }
+  ~SendWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    th_.join();
+  }
+
+  // 受け持っている全ての送信者に対して send を呼ぶように積んでおく
+  void Post(std::function<void(Sender&)> send) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(send));
+      while (tasks_.size() > MAX_PENDING_SEND_FRAMES) {
+        tasks_.pop_front();
+        dropped_frames_ += 1;
+      }
+    }
+    cond_.notify_one();
+  }
+
+  uint64_t GetDroppedFrames() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_frames_;
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (stop_) {
+        return;
+      }
+      auto send = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      for (auto* sender : senders_) {
+        send(*sender);
+      }
+      lock.lock();
+    }
+  }
+
+ private:
+  std::vector<Sender*> senders_;
+  std::thread th_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  std::deque<std::function<void(Sender&)>> tasks_;
+  uint64_t dropped_frames_ = 0;
+};
+
+class Loadgen {
+ public:
+  Loadgen(const LoadgenOption& opt)
+      : opt_(opt),
+        scheduler_(CreateFrameScheduler()),
+        video_thread_(scheduler_),
+        audio_thread_(scheduler_) {}
+
+  bool Run() {
+    shared_encoder_ = std::make_shared<SharedVideoEncoder>(
+        sorac::CreateOpenH264VideoEncoder(opt_.openh264), opt_.video_width,
+        opt_.video_height, sorac::Kbps(opt_.video_bit_rate));
+    if (!shared_encoder_->Init()) {
+      return false;
+    }
+
+    for (int i = 0; i < opt_.senders; i++) {
+      senders_.push_back(CreateSender());
+    }
+    int send_threads = opt_.send_threads;
+    if (send_threads == 0) {
+      send_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    send_threads = std::min(send_threads, opt_.senders);
+    for (int i = 0; i < send_threads; i++) {
+      std::vector<Sender*> senders;
+      for (int j = i; j < opt_.senders; j += send_threads) {
+        senders.push_back(senders_[j].get());
+      }
+      workers_.push_back(std::make_unique<SendWorker>(std::move(senders)));
+    }
+
+    // 全ての送信者のフレームを 1 つのスレッドで刻んで、送るのは送信スレッドに任せる。
+    // 送信者はまだ繋がっていなくても良い (トラックが無い間は捨てられる)
+    video_thread_.Start(
+        opt_.video_fps, [this](std::chrono::microseconds timestamp,
+                               std::chrono::microseconds) {
+          // 送信者ごとのエンコーダはタイムスタンプでエンコード結果を探すので、
+          // 送信スレッドが遅れても同じフレームを送る
+          auto frame = shared_encoder_->Encode(timestamp);
+          for (auto& worker : workers_) {
+            worker->Post([frame](Sender& sender) {
+              sender.signaling->SendVideoFrame(frame);
+            });
+          }
+        });
+    if (opt_.audio) {
+      // 音声は無音のフレームを全ての送信者で共有する。
+      // Opus のエンコードは送信者ごとに行う。
+      audio_thread_.Start(
+          1000 / AUDIO_FRAME_DURATION_MS,
+          [this](std::chrono::microseconds timestamp,
+                 std::chrono::microseconds) {
+            // AudioFrame はコピーできないので共有する
+            auto frame = std::make_shared<sorac::AudioFrame>();
+            frame->sample_rate = AUDIO_SAMPLE_RATE;
+            frame->channels = 1;
+            frame->samples =
+                AUDIO_SAMPLE_RATE * AUDIO_FRAME_DURATION_MS / 1000;
+            frame->timestamp = timestamp;
+            frame->pcm.reset(new float[frame->samples * frame->channels]());
+            for (auto& worker : workers_) {
+              worker->Post([frame](Sender& sender) {
+                sender.signaling->SendAudioFrame(*frame);
+              });
+            }
+          });
+    }
+
+    // 接続は少しずつずらして開始する
+    for (int i = 0; i < opt_.senders; i++) {
+      senders_[i]->signaling->Connect(CreateConnectConfig(i));
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(opt_.connect_interval_ms));
+    }
+
+    sorac::SignalingStats prev_total;
+    auto prev_time = sorac::get_current_time();
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::seconds(opt_.stats_interval_sec));
+      PrintStats(prev_total, prev_time);
+    }
+    return true;
+  }
+
+ private:
+  std::unique_ptr<Sender> CreateSender() {
+    auto sender = std::make_unique<Sender>();
+    soracp::SignalingConfig config;
+    config.signaling_url_candidates = opt_.signaling_urls;
+    config.ca_certificate = opt_.cacert;
+    config.video_encoder_initial_bitrate_kbps = opt_.video_bit_rate;
+    config.audio_channels = 1;
+    config.audio_frame_duration_ms = AUDIO_FRAME_DURATION_MS;
+    sender->signaling = sorac::CreateSignaling(config);
+    sender->signaling->SetVideoEncoderFactory(
+        [shared = shared_encoder_](const std::string& codec)
+            -> std::shared_ptr<sorac::VideoEncoder> {
+          if (codec != "H264") {
+            fprintf(stderr, "Unsupported codec: %s\n", codec.c_str());
+            return nullptr;
+          }
+          return shared->CreateEncoder();
+        });
+    sender->signaling->SetOnTrack([](std::shared_ptr<rtc::Track>) {});
+    sender->signaling->SetOnDataChannel(
+        [](std::shared_ptr<sorac::DataChannel>) {});
+    sender->signaling->SetOnNotify([](const std::string&) {});
+    sender->signaling->SetOnPush([](const std::string&) {});
+    sender->signaling->SetOnStateChange(
+        [p = sender.get()](soracp::SignalingState state) { p->state = state; });
+    return sender;
+  }
+
+  soracp::SoraConnectConfig CreateConnectConfig(int index) {
+    soracp::SoraConnectConfig config;
+    config.role = "sendonly";
+    config.channel_id = opt_.channel_id;
+    if (opt_.channel_count > 1) {
+      config.channel_id += "-" + std::to_string(index % opt_.channel_count);
+    }
+    config.metadata = opt_.metadata;
+    config.multistream = soracp::OPTIONAL_BOOL_TRUE;
+    // 共有しているエンコーダはサイマルキャストに対応していない
+    config.simulcast = soracp::OPTIONAL_BOOL_FALSE;
+    config.video = true;
+    config.video_codec_type = "H264";
+    config.video_bit_rate = opt_.video_bit_rate;
+    config.audio = opt_.audio;
+    return config;
+  }
+
+  // 全ての送信者の統計情報を合計して出力する
+  void PrintStats(sorac::SignalingStats& prev_total,
+                  std::chrono::microseconds& prev_time) {
+    sorac::SignalingStats total;
+    int state_counts[5] = {};
+    int64_t available_bitrate_sum = 0;
+    int available_bitrate_count = 0;
+    for (const auto& sender : senders_) {
+      auto state = (int)sender->state.load();
+      if (state >= 0 && state < 5) {
+        state_counts[state] += 1;
+      }
+      auto s = sender->signaling->GetStats();
+      total.video_packets_sent += s.video_packets_sent;
+      total.video_bytes_sent += s.video_bytes_sent;
+      total.video_nack_count += s.video_nack_count;
+      total.video_pli_count += s.video_pli_count;
+      total.video_fir_count += s.video_fir_count;
+      total.video_keyframe_requests_forwarded +=
+          s.video_keyframe_requests_forwarded;
+      total.video_keyframe_requests_dropped +=
+          s.video_keyframe_requests_dropped;
+      total.video_frames_encoded += s.video_frames_encoded;
+      total.video_key_frames_encoded += s.video_key_frames_encoded;
+      total.video_frames_skipped += s.video_frames_skipped;
+      if (s.available_outgoing_bitrate_bps) {
+        available_bitrate_sum += *s.available_outgoing_bitrate_bps;
+        available_bitrate_count += 1;
+      }
+    }
+    auto now = sorac::get_current_time();
+    double elapsed_sec = (now - prev_time).count() / 1000000.0;
+    // 再接続で統計情報がリセットされて減ることがあるので、その場合は 0 にする
+    auto delta = [](uint64_t cur, uint64_t prev) {
+      return cur > prev ? cur - prev : 0;
+    };
+    double send_kbps =
+        delta(total.video_bytes_sent, prev_total.video_bytes_sent) * 8 /
+        1000.0 / elapsed_sec;
+    double send_fps =
+        delta(total.video_frames_encoded, prev_total.video_frames_encoded) /
+        elapsed_sec;
+
+    printf(
+        "senders: connected=%d connecting=%d reconnecting=%d failed=%d "
+        "idle=%d\n",
+        state_counts[soracp::SIGNALING_STATE_CONNECTED],
+        state_counts[soracp::SIGNALING_STATE_CONNECTING],
+        state_counts[soracp::SIGNALING_STATE_RECONNECTING],
+        state_counts[soracp::SIGNALING_STATE_FAILED],
+        state_counts[soracp::SIGNALING_STATE_IDLE]);
+    printf(
+        "video: send=%.0fkbps frames=%.1f/s packets=%llu bytes=%llu "
+        "nack=%llu pli=%llu fir=%llu keyframe_requests=%llu (dropped=%llu) "
+        "key_frames=%llu skipped=%llu\n",
+        send_kbps, send_fps, (unsigned long long)total.video_packets_sent,
+        (unsigned long long)total.video_bytes_sent,
+        (unsigned long long)total.video_nack_count,
+        (unsigned long long)total.video_pli_count,
+        (unsigned long long)total.video_fir_count,
+        (unsigned long long)total.video_keyframe_requests_forwarded,
+        (unsigned long long)total.video_keyframe_requests_dropped,
+        (unsigned long long)total.video_key_frames_encoded,
+        (unsigned long long)total.video_frames_skipped);
+    if (available_bitrate_count > 0) {
+      printf("available_outgoing_bitrate: avg=%lldkbps\n",
+             (long long)(available_bitrate_sum / available_bitrate_count /
+                         1000));
+    }
+    // 送信が追いつかずに捨てたフレームがあれば、送信スレッドを増やす必要がある
+    uint64_t dropped_frames = 0;
+    for (const auto& worker : workers_) {
+      dropped_frames += worker->GetDroppedFrames();
+    }
+    printf("send_threads: count=%d dropped_frames=%llu\n", (int)workers_.size(),
+           (unsigned long long)dropped_frames);
+    fflush(stdout);
+
+    prev_total = total;
+    prev_time = now;
+  }
+
+ private:
+  LoadgenOption opt_;
+  std::shared_ptr<SharedVideoEncoder> shared_encoder_;
+  std::vector<std::unique_ptr<Sender>> senders_;
+  std::vector<std::unique_ptr<SendWorker>> workers_;
+  // 映像と音声のフレームを 1 つのスレッドで刻む
+  std::shared_ptr<FrameScheduler> scheduler_;
+  SteadyFrameThread video_thread_;
+  SteadyFrameThread audio_thread_;
+};
+
+}  // namespace sumomo
+
+int main(int argc, char* argv[]) {
+  sumomo::LoadgenOption opt;
+  if (!sumomo::ParseOption(opt, argc, argv)) {
+    return 1;
+  }
+
+  sorac_plog_init();
+
+  sumomo::Loadgen loadgen(opt);
+  if (!loadgen.Run()) {
+    return 1;
+  }
+  return 0;
+}
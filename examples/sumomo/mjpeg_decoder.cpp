@@ -0,0 +1,182 @@
+#include "mjpeg_decoder.hpp"
+
+#include <stdio.h>
+#include <utility>
+
+// libyuv
+#include <libyuv.h>
+
+namespace sumomo {
+
+// デコード先の I420 バッファを使い回すためのプール。
+// 渡したバッファが破棄されたらプールに戻る。
+class I420BufferPool : public std::enable_shared_from_this<I420BufferPool> {
+ public:
+  std::shared_ptr<sorac::VideoFrameBufferI420> Get(int width, int height) {
+    std::shared_ptr<sorac::VideoFrameBufferI420> fb;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (!buffers_.empty()) {
+        fb = std::move(buffers_.back());
+        buffers_.pop_back();
+        if (fb->width == width && fb->height == height) {
+          break;
+        }
+        // サイズが変わったバッファは捨てる
+        fb.reset();
+      }
+    }
+    if (fb == nullptr) {
+      fb = sorac::VideoFrameBufferI420::Create(width, height);
+    }
+    std::weak_ptr<I420BufferPool> wpool = shared_from_this();
+    return std::shared_ptr<sorac::VideoFrameBufferI420>(
+        fb.get(), [wpool, fb](sorac::VideoFrameBufferI420*) {
+          auto pool = wpool.lock();
+          if (pool != nullptr) {
+            pool->Release(fb);
+          }
+        });
+  }
+
+ private:
+  void Release(std::shared_ptr<sorac::VideoFrameBufferI420> fb) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.push_back(std::move(fb));
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<sorac::VideoFrameBufferI420>> buffers_;
+};
+
+MjpegDecoder::MjpegDecoder(
+    int num_threads,
+    std::function<void(const sorac::VideoFrame& frame)> on_frame)
+    : on_frame_(on_frame), pool_(std::make_shared<I420BufferPool>()) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  // 各スレッドが 1 フレームずつ待てる分だけ溜める。
+  // それ以上溜めると遅延が増えるだけなので捨てる。
+  max_queue_size_ = num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads_.emplace_back([this]() { Run(); });
+  }
+}
+
+MjpegDecoder::~MjpegDecoder() {
+  Stop();
+}
+
+void MjpegDecoder::Decode(const uint8_t* buf,
+                          size_t size,
+                          int width,
+                          int height,
+                          std::chrono::microseconds timestamp) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+      return;
+    }
+    Job job;
+    job.seq = next_seq_++;
+    if (!free_jpeg_buffers_.empty()) {
+      job.jpeg = std::move(free_jpeg_buffers_.back());
+      free_jpeg_buffers_.pop_back();
+    }
+    job.jpeg.assign(buf, buf + size);
+    job.width = width;
+    job.height = height;
+    job.timestamp = timestamp;
+    queue_.push_back(std::move(job));
+
+    if (queue_.size() > max_queue_size_) {
+      // 捨てたことだけ記録しておく。
+      // このスレッドで on_frame を呼ばないように、出力はデコードスレッドに任せる。
+      // 捨てたフレームより後のフレームがキューに残っているので、
+      // それがデコードし終わった時に一緒に出力される。
+      completed_.emplace(queue_.front().seq, std::nullopt);
+      free_jpeg_buffers_.push_back(std::move(queue_.front().jpeg));
+      queue_.pop_front();
+    }
+  }
+  cond_.notify_one();
+}
+
+void MjpegDecoder::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+      return;
+    }
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for (auto& th : threads_) {
+    th.join();
+  }
+  threads_.clear();
+}
+
+void MjpegDecoder::Run() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (stop_) {
+        return;
+      }
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    auto fb = pool_->Get(job.width, job.height);
+    int r = libyuv::MJPGToI420(job.jpeg.data(), job.jpeg.size(), fb->y.get(),
+                               fb->stride_y, fb->u.get(), fb->stride_u,
+                               fb->v.get(), fb->stride_v, job.width,
+                               job.height, job.width, job.height);
+    std::optional<sorac::VideoFrame> frame;
+    if (r == 0) {
+      frame.emplace();
+      frame->timestamp = job.timestamp;
+      frame->base_width = job.width;
+      frame->base_height = job.height;
+      frame->i420_buffer = fb;
+    } else {
+      fprintf(stderr, "Failed to MJPGToI420: %d\n", r);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_jpeg_buffers_.push_back(std::move(job.jpeg));
+    }
+    Complete(job.seq, std::move(frame));
+  }
+}
+
+void MjpegDecoder::Complete(uint64_t seq,
+                            std::optional<sorac::VideoFrame> frame) {
+  // 順番が来たフレームの取り出しから on_frame の呼び出しまでを
+  // output_mutex_ で囲んで、他のスレッドに追い越されないようにする
+  std::lock_guard<std::mutex> output_lock(output_mutex_);
+  std::vector<sorac::VideoFrame> frames;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    completed_.emplace(seq, std::move(frame));
+    while (!completed_.empty() &&
+           completed_.begin()->first == next_output_seq_) {
+      if (completed_.begin()->second) {
+        frames.push_back(std::move(*completed_.begin()->second));
+      }
+      completed_.erase(completed_.begin());
+      next_output_seq_ += 1;
+    }
+  }
+  for (const auto& f : frames) {
+    on_frame_(f);
+  }
+}
+
+}  // namespace sumomo
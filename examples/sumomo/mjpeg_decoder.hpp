@@ -0,0 +1,80 @@
+#ifndef SUMOMO_MJPEG_DECODER_HPP_
+#define SUMOMO_MJPEG_DECODER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Sora C SDK
+#include <sorac/types.hpp>
+
+namespace sumomo {
+
+class I420BufferPool;
+
+// MJPEG のフレームを複数のスレッドでデコードする。
+// デコードしたフレームは Decode() を呼んだ順番に on_frame に渡す。
+// on_frame はデコードスレッドから呼ばれて、Decode() を呼んだスレッドからは呼ばれない。
+class MjpegDecoder {
+ public:
+  MjpegDecoder(int num_threads,
+               std::function<void(const sorac::VideoFrame& frame)> on_frame);
+  ~MjpegDecoder();
+
+  // buf はコピーするので、呼び出し後すぐにバッファを再利用して良い。
+  // デコードが追いついていない場合は、古いフレームから捨てる。
+  void Decode(const uint8_t* buf,
+              size_t size,
+              int width,
+              int height,
+              std::chrono::microseconds timestamp);
+  void Stop();
+
+ private:
+  struct Job {
+    uint64_t seq;
+    std::vector<uint8_t> jpeg;
+    int width;
+    int height;
+    std::chrono::microseconds timestamp;
+  };
+
+  void Run();
+  // seq のフレームが終わったので、順番が来ているフレームを全て on_frame に渡す。
+  // デコードに失敗したフレームは frame が nullopt になる。
+  // デコードスレッドからだけ呼ぶこと。
+  void Complete(uint64_t seq, std::optional<sorac::VideoFrame> frame);
+
+ private:
+  std::function<void(const sorac::VideoFrame& frame)> on_frame_;
+  size_t max_queue_size_;
+  std::shared_ptr<I420BufferPool> pool_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  uint64_t next_seq_ = 0;
+  std::deque<Job> queue_;
+  // コピー用のバッファを使い回す
+  std::vector<std::vector<uint8_t>> free_jpeg_buffers_;
+  uint64_t next_output_seq_ = 0;
+  // 終わったけどまだ出力していないフレーム。捨てたフレームは nullopt になる
+  std::map<uint64_t, std::optional<sorac::VideoFrame>> completed_;
+
+  // on_frame を順番に呼ぶためのロック
+  std::mutex output_mutex_;
+};
+
+}  // namespace sumomo
+
+#endif
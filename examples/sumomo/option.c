@@ -18,7 +18,15 @@ static struct option long_opts[] = {
     {"capture-device-name", required_argument, 0, 0},
     {"capture-device-width", required_argument, 0, 0},
     {"capture-device-height", required_argument, 0, 0},
+    {"capture-device-format", required_argument, 0, 0},
+    {"v4l2-buffer-count", required_argument, 0, 0},
+    {"v4l2-mjpeg-decode-threads", required_argument, 0, 0},
     {"audio-type", required_argument, 0, 0},
+    {"audio-bit-rate", required_argument, 0, 0},
+    {"audio-channels", required_argument, 0, 0},
+    {"audio-frame-duration", required_argument, 0, 0},
+    {"audio-complexity", required_argument, 0, 0},
+    {"audio-dtx", required_argument, 0, 0},
     {"h264-encoder-type", required_argument, 0, 0},
     {"h265-encoder-type", required_argument, 0, 0},
     {"openh264", required_argument, 0, 0},
@@ -45,7 +53,10 @@ int sumomo_option_parse(SumomoOption* option,
 #endif
   option->capture_device_width = 640;
   option->capture_device_height = 480;
+  option->capture_device_format = "auto";
+  option->v4l2_buffer_count = 4;
   option->audio_type = SUMOMO_OPTION_AUDIO_TYPE_FAKE;
+  option->audio_complexity = -1;
   option->video_codec_type = "H264";
   option->cacert = "/etc/ssl/certs/ca-certificates.crt";
 
@@ -115,6 +126,30 @@ int sumomo_option_parse(SumomoOption* option,
           option->capture_device_width = atoi(optarg);
         } else if (OPT_IS("capture-device-height")) {
           option->capture_device_height = atoi(optarg);
+        } else if (OPT_IS("capture-device-format")) {
+          if (strcmp(optarg, "auto") == 0 || strcmp(optarg, "mjpeg") == 0 ||
+              strcmp(optarg, "yuyv") == 0 || strcmp(optarg, "nv12") == 0 ||
+              strcmp(optarg, "i420") == 0) {
+            option->capture_device_format = optarg;
+          } else {
+            fprintf(stderr, "Invalid capture device format: %s\n", optarg);
+            *error = 1;
+          }
+        } else if (OPT_IS("v4l2-buffer-count")) {
+          option->v4l2_buffer_count = atoi(optarg);
+          if (option->v4l2_buffer_count < 1 || option->v4l2_buffer_count > 32) {
+            fprintf(stderr, "Invalid v4l2 buffer count: %d\n",
+                    option->v4l2_buffer_count);
+            *error = 1;
+          }
+        } else if (OPT_IS("v4l2-mjpeg-decode-threads")) {
+          option->v4l2_mjpeg_decode_threads = atoi(optarg);
+          if (option->v4l2_mjpeg_decode_threads < 0 ||
+              option->v4l2_mjpeg_decode_threads > 16) {
+            fprintf(stderr, "Invalid v4l2 mjpeg decode threads: %d\n",
+                    option->v4l2_mjpeg_decode_threads);
+            *error = 1;
+          }
         } else if (OPT_IS("audio-type")) {
           if (strcmp(optarg, "fake") == 0) {
             option->audio_type = SUMOMO_OPTION_AUDIO_TYPE_FAKE;
@@ -126,6 +161,46 @@ int sumomo_option_parse(SumomoOption* option,
             fprintf(stderr, "Invalid audio type: %s\n", optarg);
             *error = 1;
           }
+        } else if (OPT_IS("audio-bit-rate")) {
+          option->audio_bit_rate = atoi(optarg);
+          if (option->audio_bit_rate < 0 || option->audio_bit_rate > 510) {
+            fprintf(stderr, "Invalid audio bit rate: %d\n",
+                    option->audio_bit_rate);
+            *error = 1;
+          }
+        } else if (OPT_IS("audio-channels")) {
+          option->audio_channels = atoi(optarg);
+          if (option->audio_channels != 1 && option->audio_channels != 2) {
+            fprintf(stderr, "Invalid audio channels: %d\n",
+                    option->audio_channels);
+            *error = 1;
+          }
+        } else if (OPT_IS("audio-frame-duration")) {
+          option->audio_frame_duration = atoi(optarg);
+          if (option->audio_frame_duration != 10 &&
+              option->audio_frame_duration != 20 &&
+              option->audio_frame_duration != 40 &&
+              option->audio_frame_duration != 60) {
+            fprintf(stderr, "Invalid audio frame duration: %d\n",
+                    option->audio_frame_duration);
+            *error = 1;
+          }
+        } else if (OPT_IS("audio-complexity")) {
+          option->audio_complexity = atoi(optarg);
+          if (option->audio_complexity < 0 || option->audio_complexity > 10) {
+            fprintf(stderr, "Invalid audio complexity: %d\n",
+                    option->audio_complexity);
+            *error = 1;
+          }
+        } else if (OPT_IS("audio-dtx")) {
+          if (strcmp(optarg, "true") == 0) {
+            option->audio_dtx = SUMOMO_OPTIONAL_BOOL_TRUE;
+          } else if (strcmp(optarg, "false") == 0) {
+            option->audio_dtx = SUMOMO_OPTIONAL_BOOL_FALSE;
+          } else {
+            fprintf(stderr, "Invalid audio dtx: %s\n", optarg);
+            *error = 1;
+          }
         } else if (OPT_IS("h264-encoder-type")) {
           if (strcmp(optarg, "openh264") == 0) {
             option->h264_encoder_type = soracp_H264_ENCODER_TYPE_OPEN_H264;
@@ -169,7 +244,16 @@ int sumomo_option_parse(SumomoOption* option,
       fprintf(stdout, "  --capture-device-name=NAME\n");
       fprintf(stdout, "  --capture-device-width=WIDTH\n");
       fprintf(stdout, "  --capture-device-height=HEIGHT\n");
+      fprintf(stdout,
+              "  --capture-device-format=auto,mjpeg,yuyv,nv12,i420 [v4l2]\n");
+      fprintf(stdout, "  --v4l2-buffer-count=1-32\n");
+      fprintf(stdout, "  --v4l2-mjpeg-decode-threads=0-16 [0: auto]\n");
       fprintf(stdout, "  --audio-type=fake,pulse,macos\n");
+      fprintf(stdout, "  --audio-bit-rate=0-510 [kbps]\n");
+      fprintf(stdout, "  --audio-channels=1,2\n");
+      fprintf(stdout, "  --audio-frame-duration=10,20,40,60 [ms]\n");
+      fprintf(stdout, "  --audio-complexity=0-10\n");
+      fprintf(stdout, "  --audio-dtx=true,false\n");
       fprintf(stdout, "  --h264-encoder-type=openh264,videotoolbox\n");
       fprintf(stdout, "  --h265-encoder-type=videotoolbox\n");
       fprintf(stdout, "  --openh264=PATH\n");
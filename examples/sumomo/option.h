@@ -33,7 +33,15 @@ typedef struct SumomoOption {
   const char* capture_device_name;
   int capture_device_width;
   int capture_device_height;
+  const char* capture_device_format;
+  int v4l2_buffer_count;
+  int v4l2_mjpeg_decode_threads;
   SumomoOptionAudioType audio_type;
+  int audio_bit_rate;
+  int audio_channels;
+  int audio_frame_duration;
+  int audio_complexity;
+  SumomoOptionalBool audio_dtx;
   soracp_H264EncoderType h264_encoder_type;
   soracp_H265EncoderType h265_encoder_type;
   const char* openh264;
@@ -85,6 +85,9 @@ namespace sumomo {
 
 static const int RECORDING_SAMPLE_RATE = 48000;
 static const int RECORDING_CHANNELS = 1;
+// サンプル数から計算したタイムスタンプと、録音した時刻がこれ以上ずれたら合わせ直す
+static const std::chrono::microseconds MAX_TIMESTAMP_DRIFT =
+    std::chrono::milliseconds(20);
 
 class PulseRecorder : public SumomoRecorder {
  public:
@@ -269,7 +272,9 @@ class PulseRecorder : public SumomoRecorder {
       }
 
       std::vector<sorac::AudioFrame> frames;
-      std::optional<std::chrono::microseconds> last_timestamp;
+      // 次のフレームのタイムスタンプ。
+      // 基本的にはサンプル数から計算して、揺らぎが乗らないようにする。
+      std::optional<std::chrono::microseconds> next_timestamp;
       while (true) {
         {
           std::unique_lock<std::mutex> lock(rec_mutex_);
@@ -278,28 +283,35 @@ class PulseRecorder : public SumomoRecorder {
             break;
           }
           while (true) {
+            dyn::pa_threaded_mainloop_lock(pa_mainloop_);
+            std::shared_ptr<int> unlocker(nullptr, [this](int*) {
+              dyn::pa_threaded_mainloop_unlock(pa_mainloop_);
+            });
+
             sorac::AudioFrame frame;
             frame.sample_rate = rec_sample_rate_;
             frame.channels = 1;
             frame.samples = rec_size_ / sizeof(float);
-            if (last_timestamp == std::nullopt) {
-              last_timestamp = frame.timestamp;
-            } else {
-              *last_timestamp += std::chrono::microseconds(
-                  std::chrono::microseconds(std::chrono::seconds(1)).count() *
-                  frame.samples / frame.sample_rate);
+            // 録音した時刻とずれてきた場合は、録音した時刻に合わせ直す
+            auto capture_time = GetCaptureTime();
+            if (next_timestamp == std::nullopt) {
+              next_timestamp = capture_time.value_or(sorac::get_current_time());
+            } else if (capture_time) {
+              auto drift = *capture_time - *next_timestamp;
+              if (drift > MAX_TIMESTAMP_DRIFT || drift < -MAX_TIMESTAMP_DRIFT) {
+                next_timestamp = *capture_time;
+              }
             }
-            frame.timestamp = *last_timestamp;
+            frame.timestamp = *next_timestamp;
+            *next_timestamp += std::chrono::microseconds(
+                std::chrono::microseconds(std::chrono::seconds(1)).count() *
+                frame.samples / frame.sample_rate);
             frame.pcm.reset(new float[frame.samples * frame.channels]());
             memcpy(frame.pcm.get(), rec_data_, rec_size_);
             frames.push_back(std::move(frame));
             rec_size_ = 0;
             rec_data_ = nullptr;
 
-            dyn::pa_threaded_mainloop_lock(pa_mainloop_);
-            std::shared_ptr<int> unlocker(nullptr, [this](int*) {
-              dyn::pa_threaded_mainloop_unlock(pa_mainloop_);
-            });
             dyn::pa_stream_drop(rec_stream_);
             if (dyn::pa_stream_readable_size(rec_stream_) <= 0) {
               break;
@@ -338,6 +350,24 @@ class PulseRecorder : public SumomoRecorder {
   }
 
  private:
+  // pa_stream_peek で取り出しているデータの先頭を録音した時刻を返す。
+  // 録音ストリームのレイテンシは、録音してから読み出し位置に来るまでの時間なので、
+  // 現在時刻からレイテンシを引いた時刻になる。
+  // pa_mainloop_ をロックした状態で呼ぶこと。
+  std::optional<std::chrono::microseconds> GetCaptureTime() {
+    pa_usec_t latency;
+    int negative;
+    if (auto r =
+            dyn::pa_stream_get_latency(rec_stream_, &latency, &negative);
+        r != PA_OK) {
+      // タイミング情報がまだ届いていない
+      return std::nullopt;
+    }
+    auto now = sorac::get_current_time();
+    return negative != 0 ? now + std::chrono::microseconds(latency)
+                         : now - std::chrono::microseconds(latency);
+  }
+
   static void ReadCallback(pa_stream*, size_t, void* userdata) {
     auto p = (sumomo::PulseRecorder*)userdata;
     std::lock_guard<std::mutex> lock(p->rec_mutex_);
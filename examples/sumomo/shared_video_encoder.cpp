@@ -0,0 +1,164 @@
+#include "shared_video_encoder.hpp"
+
+#include <stdio.h>
+#include <functional>
+
+namespace sumomo {
+
+// 送信者からのキーフレーム要求に応える最小間隔。
+// 全ての送信者でエンコード結果を共有しているので、送信者が増えても
+// キーフレームばかりにならないようにする。
+static const std::chrono::milliseconds MIN_KEYFRAME_REQUEST_INTERVAL =
+    std::chrono::milliseconds(1000);
+// 送信者が遅れて Encode() を呼んでも結果を返せるように保持しておくフレーム数
+static const size_t MAX_ENCODED_FRAMES = 30;
+
+class CachedVideoEncoder : public sorac::VideoEncoder {
+ public:
+  CachedVideoEncoder(std::shared_ptr<SharedVideoEncoder> shared)
+      : shared_(shared) {}
+
+  void ForceIntraNextFrame() override {
+    waiting_keyframe_ = true;
+    shared_->RequestKeyFrame();
+  }
+  bool InitEncode(const Settings& settings) override {
+    // 途中から送り始めるので、キーフレームから送る
+    ForceIntraNextFrame();
+    return true;
+  }
+  void SetEncodeCallback(
+      std::function<void(const sorac::EncodedImage&)> callback) override {
+    callback_ = callback;
+  }
+  void Encode(const sorac::VideoFrame& frame) override {
+    auto encoded = shared_->GetEncodedFrame(frame.timestamp);
+    if (encoded && encoded->image) {
+      bool is_key = encoded->image->frame_type ==
+                    sorac::EncodedImage::FrameType::kKey;
+      // 送れなかったフレームがあると参照しているフレームが無くなるので、
+      // キーフレームが来るまで送らない
+      if (!is_key && !waiting_keyframe_ && last_frame_number_ &&
+          encoded->number != *last_frame_number_ + 1) {
+        ForceIntraNextFrame();
+      }
+      if (is_key || !waiting_keyframe_) {
+        waiting_keyframe_ = false;
+        last_frame_number_ = encoded->number;
+        // buf は全ての送信者で共有する
+        callback_(*encoded->image);
+        return;
+      }
+    } else if (!encoded && !waiting_keyframe_) {
+      // 遅れすぎてエンコード結果が残っていない
+      ForceIntraNextFrame();
+    }
+    sorac::EncodedImage skipped;
+    skipped.size = 0;
+    skipped.timestamp = frame.timestamp;
+    skipped.frame_type = sorac::EncodedImage::FrameType::kSkip;
+    callback_(skipped);
+  }
+  // ビットレートは全ての送信者で共有しているので変更しない
+  void SetBitrate(sorac::Bps bitrate) override {}
+  void Release() override {}
+
+ private:
+  std::shared_ptr<SharedVideoEncoder> shared_;
+  std::function<void(const sorac::EncodedImage&)> callback_;
+  bool waiting_keyframe_ = true;
+  // 最後に送ったフレームの通し番号
+  std::optional<uint64_t> last_frame_number_;
+};
+
+SharedVideoEncoder::SharedVideoEncoder(
+    std::shared_ptr<sorac::VideoEncoder> encoder,
+    int width,
+    int height,
+    sorac::Bps bitrate)
+    : encoder_(encoder),
+      width_(width),
+      height_(height),
+      bitrate_(bitrate),
+      engine_(std::random_device()()) {}
+
+bool SharedVideoEncoder::Init() {
+  sorac::VideoEncoder::Settings settings;
+  settings.width = width_;
+  settings.height = height_;
+  settings.bitrate = bitrate_;
+  if (!encoder_->InitEncode(settings)) {
+    fprintf(stderr, "Failed to InitEncode\n");
+    return false;
+  }
+  encoder_->SetEncodeCallback([this](const sorac::EncodedImage& image) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EncodedFrame frame;
+    if (image.frame_type != sorac::EncodedImage::FrameType::kSkip) {
+      frame.image = image;
+      frame.number = next_frame_number_++;
+    }
+    frames_.emplace_back(image.timestamp, std::move(frame));
+    while (frames_.size() > MAX_ENCODED_FRAMES) {
+      frames_.pop_front();
+    }
+  });
+  buffer_ = sorac::VideoFrameBufferI420::Create(width_, height_);
+  return true;
+}
+
+sorac::VideoFrame SharedVideoEncoder::Encode(
+    std::chrono::microseconds timestamp) {
+  bool force_intra = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (keyframe_requested_ &&
+        (!last_keyframe_request_time_ ||
+         timestamp - *last_keyframe_request_time_ >=
+             MIN_KEYFRAME_REQUEST_INTERVAL)) {
+      keyframe_requested_ = false;
+      last_keyframe_request_time_ = timestamp;
+      force_intra = true;
+    }
+  }
+  if (force_intra) {
+    encoder_->ForceIntraNextFrame();
+  }
+
+  // FakeCapturer と同じように適当に点を打つ。
+  // エンコーダは Encode() の中でしかバッファを読まないので、同じバッファを使い回す
+  std::uniform_int_distribution<int> dist(0, width_ * height_ - 1);
+  for (int i = 0; i < 5; i++) {
+    buffer_->y[dist(engine_)] = 0xff;
+  }
+  sorac::VideoFrame frame;
+  frame.timestamp = timestamp;
+  frame.i420_buffer = buffer_;
+  frame.base_width = width_;
+  frame.base_height = height_;
+  encoder_->Encode(frame);
+  return frame;
+}
+
+std::shared_ptr<sorac::VideoEncoder> SharedVideoEncoder::CreateEncoder() {
+  return std::make_shared<CachedVideoEncoder>(shared_from_this());
+}
+
+void SharedVideoEncoder::RequestKeyFrame() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  keyframe_requested_ = true;
+}
+
+std::optional<SharedVideoEncoder::EncodedFrame>
+SharedVideoEncoder::GetEncodedFrame(std::chrono::microseconds timestamp) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // 大抵は最新のフレームなので後ろから探す
+  for (auto it = frames_.rbegin(); it != frames_.rend(); ++it) {
+    if (it->first == timestamp) {
+      return it->second;
+    }
+  }
+  return std::nullopt;
+}
+
+}  // namespace sumomo
@@ -0,0 +1,77 @@
+#ifndef SUMOMO_SHARED_VIDEO_ENCODER_HPP_
+#define SUMOMO_SHARED_VIDEO_ENCODER_HPP_
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+
+// Sora C SDK
+#include <sorac/bitrate.hpp>
+#include <sorac/types.hpp>
+#include <sorac/video_encoder.hpp>
+
+namespace sumomo {
+
+// 1 つのエンコーダでエンコードした結果を、複数の送信者で使い回す。
+// 負荷試験で大量の送信者を動かす時に、送信者ごとにフレームを生成して
+// エンコードしなくて済むようにするため。
+//
+// Encode() で生成したフレームをエンコードして結果をしばらく保持しておき、
+// CreateEncoder() で作ったエンコーダの Encode() が呼ばれたら、同じタイムスタンプの結果を返す。
+// 送信者ごとのエンコーダは複数のスレッドから遅れて呼ばれても良い。
+// キーフレームが来るまでや、送れなかったフレームがあった場合は、結果を返さずにスキップする。
+class SharedVideoEncoder
+    : public std::enable_shared_from_this<SharedVideoEncoder> {
+ public:
+  SharedVideoEncoder(std::shared_ptr<sorac::VideoEncoder> encoder,
+                     int width,
+                     int height,
+                     sorac::Bps bitrate);
+
+  bool Init();
+  // フレームを生成してエンコードする。
+  // 戻り値は各送信者の Signaling::SendVideoFrame() に渡すためのフレーム。
+  sorac::VideoFrame Encode(std::chrono::microseconds timestamp);
+
+  // Signaling::SetVideoEncoderFactory() で返すエンコーダを作る
+  std::shared_ptr<sorac::VideoEncoder> CreateEncoder();
+
+ private:
+  friend class CachedVideoEncoder;
+  struct EncodedFrame {
+    // エンコーダがスキップした場合は nullopt
+    std::optional<sorac::EncodedImage> image;
+    // スキップしなかったフレームの通し番号。
+    // 送信者が途中のフレームを送れなかったことを検出するのに使う
+    uint64_t number = 0;
+  };
+
+  // 送信者からのキーフレーム要求は、次の Encode() でまとめて 1 回だけ要求する
+  void RequestKeyFrame();
+  // timestamp のフレームのエンコード結果。もう保持していない場合は nullopt
+  std::optional<EncodedFrame> GetEncodedFrame(
+      std::chrono::microseconds timestamp);
+
+ private:
+  std::shared_ptr<sorac::VideoEncoder> encoder_;
+  int width_;
+  int height_;
+  sorac::Bps bitrate_;
+  std::shared_ptr<sorac::VideoFrameBufferI420> buffer_;
+  std::mt19937 engine_;
+
+  std::mutex mutex_;
+  // タイムスタンプ順に並んだエンコード結果
+  std::deque<std::pair<std::chrono::microseconds, EncodedFrame>> frames_;
+  uint64_t next_frame_number_ = 0;
+  bool keyframe_requested_ = false;
+  std::optional<std::chrono::microseconds> last_keyframe_request_time_;
+};
+
+}  // namespace sumomo
+
+#endif
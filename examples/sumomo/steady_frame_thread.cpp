@@ -1,14 +1,179 @@
 #include "steady_frame_thread.hpp"
 
-// Linux
-#include <time.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
 
 // Sora C SDK
 #include <sorac/current_time.hpp>
 
 namespace sumomo {
 
-SteadyFrameThread::SteadyFrameThread() : stop_(false) {}
+// 次のフレームの時刻は、開始時刻 + フレーム数 * フレーム間隔 で計算した絶対時刻で待つので、
+// 待機や処理にかかった時間が誤差として積み重ならない。
+// 待機は condition_variable::wait_until で CLOCK_MONOTONIC の絶対時刻を指定して行い、
+// スピンロックはしない。
+class FrameSchedulerImpl : public FrameScheduler {
+ public:
+  FrameSchedulerImpl() : state_(std::make_shared<State>()) {
+    // スレッドは state_ を共有して持っておく。
+    // on_frame の中で最後の参照が外れてこのスレッドで破棄された場合、
+    // スレッドは detach されて動き続けるので、その間 State が破棄されないようにするため。
+    th_ = std::thread([state = state_]() { Run(*state); });
+    state_->thread_id = th_.get_id();
+  }
+  ~FrameSchedulerImpl() override {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->stop = true;
+    }
+    state_->cond.notify_all();
+    if (th_.get_id() == std::this_thread::get_id()) {
+      th_.detach();
+    } else {
+      th_.join();
+    }
+  }
+
+  uint64_t Add(int fps, OnFrame on_frame) override {
+    Stream s;
+    s.fps = fps;
+    s.start = std::chrono::steady_clock::now();
+    s.start_timestamp = sorac::get_current_time();
+    // 最初のフレームは開始時刻 + フレーム間隔で出す
+    s.frame = 1;
+    s.on_frame = std::move(on_frame);
+    auto deadline = GetDeadline(s, s.frame);
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      id = state_->next_id++;
+      state_->streams.emplace(id, std::move(s));
+      state_->queue.emplace(deadline, id);
+    }
+    state_->cond.notify_all();
+    return id;
+  }
+
+  void Remove(uint64_t id) override {
+    State& st = *state_;
+    std::unique_lock<std::mutex> lock(st.mutex);
+    auto it = st.streams.find(id);
+    if (it == st.streams.end()) {
+      return;
+    }
+    st.queue.erase(
+        std::make_pair(GetDeadline(it->second, it->second.frame), id));
+    st.streams.erase(it);
+    if (std::this_thread::get_id() != st.thread_id) {
+      st.cond.wait(lock, [&st, id]() { return st.running_id != id; });
+    }
+    st.cond.notify_all();
+  }
+
+ private:
+  struct Stream {
+    int fps;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::microseconds start_timestamp;
+    // 次に出すフレームの番号
+    int64_t frame;
+    std::optional<int64_t> prev_frame;
+    OnFrame on_frame;
+  };
+
+  // スレッドと FrameSchedulerImpl で共有する状態
+  struct State {
+    std::thread::id thread_id;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stop = false;
+    uint64_t next_id = 0;
+    std::map<uint64_t, Stream> streams;
+    // 次のフレームの時刻順に並べたストリーム
+    std::set<std::pair<std::chrono::steady_clock::time_point, uint64_t>>
+        queue;
+    std::optional<uint64_t> running_id;
+  };
+
+  // n 番目のフレームの時刻。
+  // フレーム間隔を先に丸めると誤差が積み重なるので、毎回開始時刻から計算する
+  static std::chrono::nanoseconds GetElapsed(const Stream& s, int64_t n) {
+    return std::chrono::nanoseconds(n * 1000 * 1000 * 1000 / s.fps);
+  }
+  static std::chrono::steady_clock::time_point GetDeadline(const Stream& s,
+                                                           int64_t n) {
+    return s.start +
+           std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               GetElapsed(s, n));
+  }
+  static std::chrono::microseconds GetTimestamp(const Stream& s, int64_t n) {
+    return s.start_timestamp +
+           std::chrono::duration_cast<std::chrono::microseconds>(
+               GetElapsed(s, n));
+  }
+
+  static void Run(State& st) {
+    std::unique_lock<std::mutex> lock(st.mutex);
+    while (!st.stop) {
+      if (st.queue.empty()) {
+        st.cond.wait(lock);
+        continue;
+      }
+      auto deadline = st.queue.begin()->first;
+      if (std::chrono::steady_clock::now() < deadline) {
+        // 待っている間にストリームが追加されたり削除されたりしたら起きて、
+        // 改めて一番早い時刻を待つ
+        st.cond.wait_until(lock, deadline);
+        continue;
+      }
+
+      uint64_t id = st.queue.begin()->second;
+      st.queue.erase(st.queue.begin());
+      Stream& s = st.streams.at(id);
+
+      // 大きく遅れてフレームを出せなかった場合は、その分を飛ばして最新の時刻にする
+      auto now = std::chrono::steady_clock::now();
+      int64_t n = s.frame;
+      while (GetDeadline(s, n + 1) <= now) {
+        n += 1;
+      }
+      auto timestamp = GetTimestamp(s, n);
+      auto prev = GetTimestamp(s, s.prev_frame.value_or(0));
+      s.prev_frame = n;
+      s.frame = n + 1;
+      st.queue.emplace(GetDeadline(s, s.frame), id);
+
+      // on_frame はロックを外して呼ぶ。
+      // その間に Remove() されても on_frame は消えないようにコピーしておく
+      OnFrame on_frame = s.on_frame;
+      st.running_id = id;
+      lock.unlock();
+      on_frame(timestamp, prev);
+      // on_frame の中で FrameSchedulerImpl が破棄されていることがあるので、
+      // ここから先は st 以外を触らないこと
+      on_frame = nullptr;
+      lock.lock();
+      st.running_id = std::nullopt;
+      st.cond.notify_all();
+    }
+  }
+
+ private:
+  std::shared_ptr<State> state_;
+  std::thread th_;
+};
+
+std::shared_ptr<FrameScheduler> CreateFrameScheduler() {
+  return std::make_shared<FrameSchedulerImpl>();
+}
+
+SteadyFrameThread::SteadyFrameThread(
+    std::shared_ptr<FrameScheduler> scheduler)
+    : shared_scheduler_(scheduler) {}
 SteadyFrameThread::~SteadyFrameThread() {
   Stop();
 }
@@ -23,61 +188,24 @@ void SteadyFrameThread::Start(
     std::function<void(std::chrono::microseconds, std::chrono::microseconds)>
         on_frame) {
   Stop();
-  th_.reset(new std::thread([this, fps, on_frame]() {
-    std::function<void()> finish;
-    if (on_prepare_) {
-      finish = on_prepare_();
-      on_prepare_ = nullptr;
-    }
-
-    auto frame_duration =
-        std::chrono::nanoseconds(std::chrono::seconds(1)) / fps;
-
-    auto prev = sorac::get_current_time();
-
-    while (!stop_) {
-      auto timestamp = sorac::get_current_time();
-      auto d = timestamp - prev;
-      // ENCODING_FRAME_DURATION_MS 秒分のデータが溜まるまで continue
-      if (d < frame_duration - std::chrono::milliseconds(1)) {
-        // d = [0, frame_duration - 1)
-
-        // まだ時間があるので sleep する
-        // 予定時間の 1 ミリ秒前に起きる
-        struct timespec ts;
-        ts.tv_sec = 0;
-        ts.tv_nsec = std::chrono::nanoseconds(frame_duration -
-                                              std::chrono::milliseconds(1) - d)
-                         .count();
-#if defined(__linux__)
-        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
-#elif defined(__APPLE__)
-        nanosleep(&ts, NULL);
-#endif
-        continue;
-      } else if (d < frame_duration) {
-        // d = [frame_duration - 1, frame_duration)
-        // もうすぐなのでスピンロック
-        continue;
-      }
-
-      on_frame(timestamp, prev);
-
-      prev = timestamp;
-    }
-
-    if (finish) {
-      finish();
-    }
-  }));
+  if (on_prepare_) {
+    finish_ = on_prepare_();
+    on_prepare_ = nullptr;
+  }
+  scheduler_ = shared_scheduler_ != nullptr ? shared_scheduler_
+                                            : CreateFrameScheduler();
+  id_ = scheduler_->Add(fps, on_frame);
 }
 
 void SteadyFrameThread::Stop() {
-  if (th_ != nullptr) {
-    stop_ = true;
-    th_->join();
-    th_ = nullptr;
-    stop_ = false;
+  if (id_) {
+    scheduler_->Remove(*id_);
+    id_ = std::nullopt;
+    scheduler_.reset();
+  }
+  if (finish_) {
+    finish_();
+    finish_ = nullptr;
   }
 }
 
@@ -1,20 +1,48 @@
 #ifndef SUMOMO_STEADY_FRAME_THREAD_HPP_
 #define SUMOMO_STEADY_FRAME_THREAD_HPP_
 
-#include <atomic>
+#include <stdint.h>
+#include <chrono>
 #include <functional>
 #include <memory>
-#include <thread>
+#include <optional>
 
 namespace sumomo {
 
+// 複数のストリームのフレームを 1 つのスレッドで刻む。
+// 同じ FrameScheduler を渡した SteadyFrameThread は、このスレッドを共有する。
+class FrameScheduler {
+ public:
+  typedef std::function<void(std::chrono::microseconds,
+                             std::chrono::microseconds)>
+      OnFrame;
+
+  virtual ~FrameScheduler() {}
+
+  virtual uint64_t Add(int fps, OnFrame on_frame) = 0;
+  // 戻った後は on_frame が呼ばれないことを保証する。
+  // on_frame の中から呼んだ場合は、その on_frame が終わるのを待たない。
+  virtual void Remove(uint64_t id) = 0;
+};
+
+std::shared_ptr<FrameScheduler> CreateFrameScheduler();
+
+// 一定の間隔で on_frame を呼ぶ。
+// scheduler を指定しなかった場合は、この SteadyFrameThread 専用のスレッドから呼ばれる。
+// 指定した場合は、同じ scheduler を使っている他の SteadyFrameThread とスレッドを共有するので、
+// on_frame の処理が重いと他のストリームのフレームが遅れることに注意。
 class SteadyFrameThread {
  public:
-  SteadyFrameThread();
+  SteadyFrameThread(std::shared_ptr<FrameScheduler> scheduler = nullptr);
   ~SteadyFrameThread();
 
+  // Start() の中で、最初のフレームの前に呼ばれる。
+  // 戻り値の関数は Stop() の中で呼ばれる。
   void SetOnPrepare(std::function<std::function<void()>()> on_prepare);
 
+  // on_frame には今回と前回のフレームの時刻を渡す。
+  // 時刻は開始した時刻からフレーム間隔ずつ進めた値なので、
+  // 実際に呼ばれた時刻の揺らぎは含まない。
   void Start(int fps,
              std::function<void(std::chrono::microseconds,
                                 std::chrono::microseconds)> on_frame);
@@ -22,10 +50,12 @@ class SteadyFrameThread {
 
  private:
   std::function<std::function<void()>()> on_prepare_;
-  std::shared_ptr<std::thread> th_;
-  std::atomic<bool> stop_;
+  std::function<void()> finish_;
+  std::shared_ptr<FrameScheduler> shared_scheduler_;
+  std::shared_ptr<FrameScheduler> scheduler_;
+  std::optional<uint64_t> id_;
 };
 
 }  // namespace sumomo
 
-#endif
\ No newline at end of file
+#endif
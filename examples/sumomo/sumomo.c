@@ -42,17 +42,10 @@ void on_capture_frame(SoracVideoFrameRef* frame, void* userdata) {
   if (!state->rtp_encoding_parameters.enable_parameters) {
     sorac_signaling_send_video_frame(state->signaling, frame);
   } else {
-    // 動的な確保が面倒なので適当に固定で持っておく
-    const char* rids[10];
-    int rids_len = state->rtp_encoding_parameters.parameters_len;
-    if (rids_len > sizeof(rids) / sizeof(rids[0])) {
-      rids_len = sizeof(rids) / sizeof(rids[0]);
-    }
-    for (int i = 0; i < rids_len; i++) {
-      rids[i] = state->rtp_encoding_parameters.parameters[i].rid;
-    }
-    sumomo_util_scale_simulcast(rids, rids_len, frame, on_capture_frame_scaled,
-                                state);
+    sumomo_util_scale_simulcast(
+        state->rtp_encoding_parameters.parameters,
+        (int)state->rtp_encoding_parameters.parameters_len, frame,
+        on_capture_frame_scaled, state);
   }
 }
 
@@ -68,13 +61,23 @@ void on_track(SoracTrack* track, void* userdata) {
   sorac_description_media_get_type(desc, buf, sizeof(buf), NULL);
   sorac_description_media_release(desc);
 
+  // 再接続した場合は新しいトラックで再度呼ばれるので、
+  // 古いトラックを解放して、キャプチャラや録音はそのまま使い続ける
   if (strcmp(buf, "video") == 0) {
+    if (state->video_track != NULL) {
+      sorac_track_release(state->video_track);
+    }
     state->video_track = sorac_track_share(track);
+    if (state->capturer != NULL) {
+      return;
+    }
     if (state->opt->capture_type == SUMOMO_OPTION_CAPTURE_TYPE_V4L2) {
 #if defined(__linux__)
       state->capturer = sumomo_v4l2_capturer_create(
           state->opt->capture_device_name, state->opt->capture_device_width,
-          state->opt->capture_device_height);
+          state->opt->capture_device_height, state->opt->capture_device_format,
+          state->opt->v4l2_buffer_count,
+          state->opt->v4l2_mjpeg_decode_threads);
 #else
       fprintf(stderr,
               "V4L2 capturer cannot be used on environments other than Linux");
@@ -97,7 +100,13 @@ void on_track(SoracTrack* track, void* userdata) {
                                        state);
     sumomo_capturer_start(state->capturer);
   } else if (strcmp(buf, "audio") == 0) {
+    if (state->audio_track != NULL) {
+      sorac_track_release(state->audio_track);
+    }
     state->audio_track = sorac_track_share(track);
+    if (state->recorder != NULL) {
+      return;
+    }
     if (state->opt->audio_type == SUMOMO_OPTION_AUDIO_TYPE_PULSE) {
 #if defined(__linux__)
       state->recorder = sumomo_pulse_recorder_create();
@@ -122,6 +131,16 @@ void on_track(SoracTrack* track, void* userdata) {
   }
 }
 
+void on_state_change(soracp_SignalingState state, void* userdata) {
+  const char* name =
+      state == soracp_SIGNALING_STATE_CONNECTING     ? "connecting"
+      : state == soracp_SIGNALING_STATE_CONNECTED    ? "connected"
+      : state == soracp_SIGNALING_STATE_RECONNECTING ? "reconnecting"
+      : state == soracp_SIGNALING_STATE_FAILED       ? "failed"
+                                                     : "idle";
+  printf("on_state_change: %s\n", name);
+}
+
 void on_data_channel_error(const char* error, int len, void* userdata) {
   printf("DataChannel error: %.*s\n", len, error);
 }
@@ -190,6 +209,14 @@ int main(int argc, char* argv[]) {
   soracp_SignalingConfig_set_h265_encoder_type(&config, opt.h265_encoder_type);
   soracp_SignalingConfig_set_video_encoder_initial_bitrate_kbps(
       &config, opt.video_bit_rate == 0 ? 500 : opt.video_bit_rate);
+  soracp_SignalingConfig_set_audio_channels(&config, opt.audio_channels);
+  soracp_SignalingConfig_set_audio_frame_duration_ms(&config,
+                                                     opt.audio_frame_duration);
+  if (opt.audio_complexity >= 0) {
+    soracp_SignalingConfig_set_audio_complexity(&config, opt.audio_complexity);
+  }
+  soracp_SignalingConfig_set_audio_dtx(
+      &config, opt.audio_dtx == SUMOMO_OPTIONAL_BOOL_TRUE);
   SoracSignaling* signaling = sorac_signaling_create(&config);
   state.signaling = signaling;
 
@@ -197,6 +224,7 @@ int main(int argc, char* argv[]) {
   sorac_signaling_set_on_data_channel(signaling, on_data_channel, &state);
   sorac_signaling_set_on_notify(signaling, on_notify, &state);
   sorac_signaling_set_on_push(signaling, on_push, &state);
+  sorac_signaling_set_on_state_change(signaling, on_state_change, &state);
 
   soracp_SoraConnectConfig_set_role(&sora_config, "sendonly");
   soracp_SoraConnectConfig_set_channel_id(&sora_config, opt.channel_id);
@@ -213,6 +241,10 @@ int main(int argc, char* argv[]) {
     soracp_SoraConnectConfig_set_metadata(&sora_config, opt.metadata);
   }
   soracp_SoraConnectConfig_set_audio(&sora_config, true);
+  if (opt.audio_bit_rate != 0) {
+    soracp_SoraConnectConfig_set_audio_bit_rate(&sora_config,
+                                                opt.audio_bit_rate);
+  }
   soracp_SoraConnectConfig_set_multistream(&sora_config,
                                            soracp_OPTIONAL_BOOL_TRUE);
   soracp_SoraConnectConfig_set_data_channel_signaling(
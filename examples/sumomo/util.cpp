@@ -7,27 +7,26 @@
 
 extern "C" {
 
-void sumomo_util_scale_simulcast(const char* rids[],
-                                 int num_rids,
+void sumomo_util_scale_simulcast(const soracp_RtpEncodingParameter* params,
+                                 int num_params,
                                  SoracVideoFrameRef* frame,
                                  void (*scaled)(SoracVideoFrameRef* frame,
                                                 void* userdata),
                                  void* userdata) {
-  for (int i = 0; i < num_rids; i++) {
+  for (int i = 0; i < num_params; i++) {
+    // 止まっているレイヤーは送ってもエンコードされないので縮小もしない
+    if (!params[i].active) {
+      continue;
+    }
     sorac::VideoFrame f = *(sorac::VideoFrame*)frame;
-    f.rid = rids[i];
-    int width;
-    int height;
-    if (*f.rid == "r0") {
-      width = f.width() / 4;
-      height = f.height() / 4;
-    } else if (*f.rid == "r1") {
-      width = f.width() / 2;
-      height = f.height() / 2;
-    } else {
-      width = f.width();
-      height = f.height();
+    f.rid = params[i].rid;
+    // scale_resolution_down_by は SDK 側で全てのレイヤーに設定されている
+    double scale = params[i].scale_resolution_down_by;
+    if (scale < 1.0) {
+      scale = 1.0;
     }
+    int width = (int)(f.width() / scale);
+    int height = (int)(f.height() / scale);
     if (f.width() != width || f.height() != height) {
       if (f.i420_buffer) {
         auto fb = sorac::VideoFrameBufferI420::Create(width, height);
@@ -7,9 +7,10 @@
 extern "C" {
 #endif
 
+// params のレイヤーごとに scale_resolution_down_by に合わせて縮小して scaled を呼ぶ
 extern void sumomo_util_scale_simulcast(
-    const char* rids[],
-    int num_rids,
+    const soracp_RtpEncodingParameter* params,
+    int num_params,
     SoracVideoFrameRef* frame,
     void (*scaled)(SoracVideoFrameRef* frame, void* userdata),
     void* userdata);
@@ -5,17 +5,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <string>
 #include <thread>
 #include <vector>
 
 // Posix
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
 #include <unistd.h>
 
 // Linux
@@ -28,14 +33,121 @@
 #include <sorac/current_time.hpp>
 #include <sorac/types.hpp>
 
+#include "mjpeg_decoder.hpp"
+
 namespace sumomo {
 
+static const int DEFAULT_V4L2_BUFFER_COUNT = 4;
+// MJPEG のデコードスレッド数を自動で決める時の上限
+static const int MAX_DEFAULT_MJPEG_DECODE_THREADS = 4;
+// ドライバのタイムスタンプがこれ以上古い場合は壊れているとみなす
+static const std::chrono::microseconds MAX_CAPTURE_DELAY =
+    std::chrono::seconds(1);
+
+// 自動で選ぶ時の優先順位。
+// 同じフレームレートが出るならデコードの必要が無いフォーマットを優先する。
+static const uint32_t V4L2_FORMAT_PRIORITY[] = {
+    V4L2_PIX_FMT_YUV420,
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_YUYV,
+    V4L2_PIX_FMT_MJPEG,
+};
+
+static std::optional<uint32_t> ParseFormat(const std::string& format) {
+  if (format == "i420") {
+    return V4L2_PIX_FMT_YUV420;
+  } else if (format == "nv12") {
+    return V4L2_PIX_FMT_NV12;
+  } else if (format == "yuyv") {
+    return V4L2_PIX_FMT_YUYV;
+  } else if (format == "mjpeg") {
+    return V4L2_PIX_FMT_MJPEG;
+  }
+  return std::nullopt;
+}
+
+static std::string FormatToString(uint32_t format) {
+  char s[5] = {(char)(format & 0xff), (char)((format >> 8) & 0xff),
+               (char)((format >> 16) & 0xff), (char)((format >> 24) & 0xff),
+               0};
+  return s;
+}
+
+static int Ioctl(int fd, unsigned long request, void* arg) {
+  int r;
+  do {
+    r = ioctl(fd, request, arg);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+// キャプチャ中のデバイスとバッファ。
+// フレームにバッファをそのまま渡している場合、フレームが全て破棄されるまで
+// munmap や close をしてはいけないので、shared_ptr で共有する。
+class V4L2Device {
+ public:
+  struct Buffer {
+    void* start = MAP_FAILED;
+    size_t length = 0;
+  };
+
+  V4L2Device(int fd) : fd_(fd) {}
+  ~V4L2Device() {
+    for (auto& b : buffers_) {
+      if (b.start != MAP_FAILED) {
+        munmap(b.start, b.length);
+      }
+    }
+    close(fd_);
+  }
+
+  int fd() const { return fd_; }
+  std::vector<Buffer>& buffers() { return buffers_; }
+
+  void SetStreaming(bool streaming) { streaming_ = streaming; }
+
+  bool Queue(int index) {
+    // キャプチャを止めた後に破棄されたフレームのバッファは戻さなくて良い
+    if (!streaming_) {
+      return true;
+    }
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (Ioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+      fprintf(stderr, "Failed to VIDIOC_QBUF: %s\n", strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  int fd_;
+  std::vector<Buffer> buffers_;
+  std::atomic<bool> streaming_{false};
+};
+
 class V4L2Capturer : public SumomoCapturer {
  public:
-  V4L2Capturer(const char* device, int width, int height) {
-    this->device_ = device;
+  V4L2Capturer(const char* device,
+               int width,
+               int height,
+               const char* format,
+               int buffer_count,
+               int mjpeg_decode_threads) {
+    this->device_name_ = device;
     this->width_ = width;
     this->height_ = height;
+    this->format_ = format != nullptr ? format : "";
+    this->buffer_count_ =
+        buffer_count > 0 ? buffer_count : DEFAULT_V4L2_BUFFER_COUNT;
+    this->mjpeg_decode_threads_ =
+        mjpeg_decode_threads > 0
+            ? mjpeg_decode_threads
+            : std::max(1, std::min((int)std::thread::hardware_concurrency(),
+                                   MAX_DEFAULT_MJPEG_DECODE_THREADS));
     this->destroy = [](SumomoCapturer* p) { delete (sumomo::V4L2Capturer*)p; };
     this->set_frame_callback = [](SumomoCapturer* p,
                                   sumomo_capturer_on_frame_func on_frame,
@@ -49,10 +161,11 @@ class V4L2Capturer : public SumomoCapturer {
     };
     this->start = [](SumomoCapturer* p) {
       auto q = (sumomo::V4L2Capturer*)p;
-      return q->Start(q->device_.c_str(), q->width_, q->height_);
+      return q->Start(q->device_name_.c_str(), q->width_, q->height_);
     };
     this->stop = [](SumomoCapturer* p) { ((sumomo::V4L2Capturer*)p)->Stop(); };
   }
+  ~V4L2Capturer() { Stop(); }
 
   void SetFrameCallback(
       std::function<void(const sorac::VideoFrame& frame)> callback) {
@@ -62,58 +175,56 @@ class V4L2Capturer : public SumomoCapturer {
   int Start(const char* device, int width, int height) {
     Stop();
 
-    device_fd_ = open(device, O_RDWR | O_NONBLOCK, 0);
-    if (device_fd_ < 0) {
+    int fd = open(device, O_RDWR | O_NONBLOCK, 0);
+    if (fd < 0) {
       fprintf(stderr, "Failed to open: %s: %s\n", device, strerror(errno));
       return -1;
     }
+    device_ = std::make_shared<V4L2Device>(fd);
 
-    // デバイスに MJPEG フォーマットがあるか確認
-    struct v4l2_fmtdesc desc;
-    memset(&desc, 0, sizeof(desc));
-    desc.index = 0;
-    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bool found = false;
-    while (ioctl(device_fd_, VIDIOC_ENUM_FMT, &desc) == 0) {
-      printf("desc: %s\n", desc.description);
-      if (desc.pixelformat == V4L2_PIX_FMT_MJPEG) {
-        found = true;
-        break;
-      }
-      desc.index++;
-    }
-    if (!found) {
-      fprintf(stderr, "Failed to find V4L2_PIX_FMT_MJPEG\n");
+    std::optional<uint32_t> pixel_format = SelectFormat(width, height);
+    if (!pixel_format) {
+      Stop();
       return -1;
     }
 
-    // MJPEG フォーマットの設定
     struct v4l2_format fmt;
     memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.sizeimage = 0;
     fmt.fmt.pix.width = width;
     fmt.fmt.pix.height = height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-    if (ioctl(device_fd_, VIDIOC_S_FMT, &fmt) < 0) {
+    fmt.fmt.pix.pixelformat = *pixel_format;
+    if (Ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
       fprintf(stderr, "Failed to VIDIOC_S_FMT: %s\n", strerror(errno));
+      Stop();
+      return -1;
+    }
+    if (fmt.fmt.pix.pixelformat != *pixel_format) {
+      fprintf(stderr, "Failed to set format: %s\n",
+              FormatToString(*pixel_format).c_str());
+      Stop();
       return -1;
     }
+    pixel_format_ = fmt.fmt.pix.pixelformat;
     width_ = fmt.fmt.pix.width;
     height_ = fmt.fmt.pix.height;
+    bytes_per_line_ = fmt.fmt.pix.bytesperline;
+    printf("V4L2 format: %s %dx%d\n", FormatToString(pixel_format_).c_str(),
+           width_, height_);
 
     // ビデオバッファの設定
-    const int V4L2_BUFFER_COUNT = 4;
     {
       struct v4l2_requestbuffers req;
       memset(&req, 0, sizeof(req));
 
       req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
       req.memory = V4L2_MEMORY_MMAP;
-      req.count = V4L2_BUFFER_COUNT;
+      req.count = buffer_count_;
 
-      if (ioctl(device_fd_, VIDIOC_REQBUFS, &req) < 0) {
+      if (Ioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
         fprintf(stderr, "Failed to VIDIOC_REQBUFS: %s\n", strerror(errno));
+        Stop();
         return -1;
       }
 
@@ -124,139 +235,332 @@ class V4L2Capturer : public SumomoCapturer {
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
 
-        if (ioctl(device_fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+        if (Ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
           fprintf(stderr, "Failed to VIDIOC_QUERYBUF: %s\n", strerror(errno));
+          Stop();
           return -1;
         }
 
-        Buffer b;
+        V4L2Device::Buffer b;
         b.start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       device_fd_, buf.m.offset);
+                       fd, buf.m.offset);
         if (b.start == MAP_FAILED) {
           fprintf(stderr, "Failed to mmap: %s\n", strerror(errno));
+          Stop();
           return -1;
         }
         b.length = buf.length;
+        device_->buffers().push_back(b);
 
-        if (ioctl(device_fd_, VIDIOC_QBUF, &buf) < 0) {
+        if (Ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
           fprintf(stderr, "Failed to VIDIOC_QBUF: %s\n", strerror(errno));
+          Stop();
           return -1;
         }
-
-        pool_.push_back(b);
       }
     }
 
     // キャプチャ開始
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(device_fd_, VIDIOC_STREAMON, &type) < 0) {
+    if (Ioctl(fd, VIDIOC_STREAMON, &type) < 0) {
       fprintf(stderr, "Failed to VIDIOC_STREAMON: %s\n", strerror(errno));
+      Stop();
       return -1;
     }
+    device_->SetStreaming(true);
 
-    quit_ = false;
-    capture_thread_.reset(new std::thread([this]() {
-      while (true) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(device_fd_, &fds);
+    if (pixel_format_ == V4L2_PIX_FMT_MJPEG) {
+      printf("MJPEG decode threads: %d\n", mjpeg_decode_threads_);
+      mjpeg_decoder_.reset(new MjpegDecoder(
+          mjpeg_decode_threads_,
+          [this](const sorac::VideoFrame& frame) { callback_(frame); }));
+    }
 
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+    // デバイスと、Stop() で待機を解除するための eventfd を epoll で待つ
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (stop_fd_ < 0 || epoll_fd_ < 0) {
+      fprintf(stderr, "Failed to create epoll: %s\n", strerror(errno));
+      Stop();
+      return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      fprintf(stderr, "Failed to epoll_ctl: %s\n", strerror(errno));
+      Stop();
+      return -1;
+    }
+    ev.data.fd = stop_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &ev) < 0) {
+      fprintf(stderr, "Failed to epoll_ctl: %s\n", strerror(errno));
+      Stop();
+      return -1;
+    }
 
-        int r = select(device_fd_ + 1, &fds, NULL, NULL, &timeout);
+    capture_thread_.reset(new std::thread([this]() { Run(); }));
 
-        if (quit_) {
-          break;
-        }
+    return 0;
+  }
 
-        if (r < 0 && errno != EINTR) {
-          fprintf(stderr, "Failed to select: %s\n", strerror(errno));
-          break;
-        } else if (r == 0) {
-          // timeout
-          continue;
-        } else if (!FD_ISSET(device_fd_, &fds)) {
-          // spurious failure
+  void Stop() {
+    if (capture_thread_) {
+      uint64_t v = 1;
+      if (write(stop_fd_, &v, sizeof(v)) < 0) {
+        fprintf(stderr, "Failed to write eventfd: %s\n", strerror(errno));
+      }
+      capture_thread_->join();
+      capture_thread_.reset();
+    }
+    if (mjpeg_decoder_) {
+      mjpeg_decoder_->Stop();
+      mjpeg_decoder_.reset();
+    }
+    if (epoll_fd_ >= 0) {
+      close(epoll_fd_);
+      epoll_fd_ = -1;
+    }
+    if (stop_fd_ >= 0) {
+      close(stop_fd_);
+      stop_fd_ = -1;
+    }
+
+    if (device_ != nullptr) {
+      device_->SetStreaming(false);
+      enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      Ioctl(device_->fd(), VIDIOC_STREAMOFF, &type);
+      // まだフレームが残っている場合は、全て破棄された時に解放される
+      device_.reset();
+    }
+  }
+
+ private:
+  // 指定されたフォーマット、または指定されたサイズで一番フレームレートが出るフォーマットを選ぶ
+  std::optional<uint32_t> SelectFormat(int width, int height) {
+    std::vector<uint32_t> formats;
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.index = 0;
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (Ioctl(device_->fd(), VIDIOC_ENUM_FMT, &desc) == 0) {
+      printf("desc: %s\n", desc.description);
+      formats.push_back(desc.pixelformat);
+      desc.index++;
+    }
+    auto supported = [&formats](uint32_t format) {
+      return std::find(formats.begin(), formats.end(), format) !=
+             formats.end();
+    };
+
+    if (!format_.empty() && format_ != "auto") {
+      auto format = ParseFormat(format_);
+      if (!format) {
+        fprintf(stderr, "Unknown format: %s\n", format_.c_str());
+        return std::nullopt;
+      }
+      if (!supported(*format)) {
+        fprintf(stderr, "Format is not supported: %s\n", format_.c_str());
+        return std::nullopt;
+      }
+      return format;
+    }
+
+    std::optional<uint32_t> selected;
+    double selected_fps = -1;
+    for (uint32_t format : V4L2_FORMAT_PRIORITY) {
+      if (!supported(format)) {
+        continue;
+      }
+      double fps = GetMaxFramerate(format, width, height);
+      if (fps > selected_fps) {
+        selected = format;
+        selected_fps = fps;
+      }
+    }
+    if (!selected) {
+      fprintf(stderr, "Failed to find supported format\n");
+    }
+    return selected;
+  }
+
+  // フレームレートが取れない場合は 0 を返す
+  double GetMaxFramerate(uint32_t format, int width, int height) {
+    double max_fps = 0;
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = format;
+    ival.width = width;
+    ival.height = height;
+    while (Ioctl(device_->fd(), VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0) {
+      const struct v4l2_fract* f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE
+                                       ? &ival.discrete
+                                       : &ival.stepwise.min;
+      if (f->numerator != 0) {
+        max_fps = std::max(max_fps, (double)f->denominator / f->numerator);
+      }
+      if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+        break;
+      }
+      ival.index++;
+    }
+    return max_fps;
+  }
+
+  void Run() {
+    int fd = device_->fd();
+    while (true) {
+      struct epoll_event events[2];
+      int n = epoll_wait(epoll_fd_, events, 2, -1);
+      if (n < 0) {
+        if (errno == EINTR) {
           continue;
         }
+        fprintf(stderr, "Failed to epoll_wait: %s\n", strerror(errno));
+        break;
+      }
+      bool readable = false;
+      bool quit = false;
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == stop_fd_) {
+          quit = true;
+        } else if (events[i].data.fd == fd) {
+          readable = true;
+        }
+      }
+      if (quit) {
+        break;
+      }
+      if (!readable) {
+        continue;
+      }
 
+      // 溜まっているバッファは全て取り出して、最新のフレームだけを渡す。
+      // 古いフレームを順番に処理すると、その分だけ遅延が増えるため。
+      std::optional<struct v4l2_buffer> latest;
+      while (true) {
         struct v4l2_buffer buf;
         memset(&buf, 0, sizeof(buf));
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
-        bool dequeued = true;
-        while (ioctl(device_fd_, VIDIOC_DQBUF, &buf) < 0) {
-          if (errno != EINTR) {
-            dequeued = false;
-            break;
+        if (Ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+          if (errno != EAGAIN) {
+            fprintf(stderr, "Failed to VIDIOC_DQBUF: %s\n", strerror(errno));
           }
+          break;
         }
-        if (!dequeued) {
-          continue;
+        if (latest) {
+          device_->Queue(latest->index);
         }
-
-        auto fb = sorac::VideoFrameBufferI420::Create(width_, height_);
-        auto p = (uint8_t*)pool_[buf.index].start;
-        auto chroma_height = (fb->height + 1) / 2;
-        libyuv::ConvertToI420(p, buf.bytesused, fb->y.get(), fb->stride_y,
-                              fb->u.get(), fb->stride_u, fb->v.get(),
-                              fb->stride_v, 0, 0, width_, height_, width_,
-                              height_, libyuv::kRotate0, libyuv::FOURCC_MJPG);
-
-        sorac::VideoFrame frame;
-        frame.i420_buffer = fb;
-        frame.timestamp = sorac::get_current_time();
-        frame.base_width = width_;
-        frame.base_height = height_;
-        callback_(frame);
-
-        if (ioctl(device_fd_, VIDIOC_QBUF, &buf) < 0) {
-          fprintf(stderr, "Failed to VIDIOC_QBUF: %s\n", strerror(errno));
-        }
-
-        std::this_thread::yield();
+        latest = buf;
+      }
+      if (!latest) {
+        continue;
       }
-    }));
 
-    return 0;
+      OnFrame(*latest);
+    }
   }
 
-  void Stop() {
-    if (capture_thread_) {
-      quit_ = true;
-      capture_thread_->join();
-      capture_thread_.reset();
-      quit_ = false;
+  // ドライバがバッファに付けた時刻を使う。
+  // DQBUF した時刻やデコード後の時刻を使うと、スケジューリングやデコードの揺らぎが
+  // そのまま RTP のタイムスタンプに乗ってしまうため。
+  std::chrono::microseconds GetCaptureTime(const struct v4l2_buffer& buf) {
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+            V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ||
+        (buf.timestamp.tv_sec == 0 && buf.timestamp.tv_usec == 0)) {
+      return sorac::get_current_time();
     }
+    auto t = std::chrono::microseconds(uint64_t(buf.timestamp.tv_sec) * 1000 *
+                                           1000 +
+                                       buf.timestamp.tv_usec);
+    auto timestamp = sorac::monotonic_to_current_time(t);
+    // 時刻がおかしい場合は使わない
+    auto now = sorac::get_current_time();
+    if (timestamp > now || now - timestamp > MAX_CAPTURE_DELAY) {
+      return now;
+    }
+    return timestamp;
+  }
 
-    for (auto& b : pool_) {
-      munmap(b.start, b.length);
+  void OnFrame(const struct v4l2_buffer& buf) {
+    auto p = (uint8_t*)device_->buffers()[buf.index].start;
+
+    sorac::VideoFrame frame;
+    frame.timestamp = GetCaptureTime(buf);
+    frame.base_width = width_;
+    frame.base_height = height_;
+
+    if (pixel_format_ == V4L2_PIX_FMT_YUV420) {
+      // I420 はそのままエンコーダに渡せるので、コピーせずにバッファを渡す。
+      // フレームが全て破棄されたらバッファをデバイスに戻す。
+      std::shared_ptr<void> owner(
+          nullptr, [device = device_, index = (int)buf.index](void*) {
+            device->Queue(index);
+          });
+      int stride_y = bytes_per_line_ > 0 ? bytes_per_line_ : width_;
+      int stride_uv = (stride_y + 1) / 2;
+      int chroma_height = (height_ + 1) / 2;
+      auto fb = std::make_shared<sorac::VideoFrameBufferI420>();
+      fb->width = width_;
+      fb->height = height_;
+      fb->stride_y = stride_y;
+      fb->stride_u = stride_uv;
+      fb->stride_v = stride_uv;
+      fb->y = std::shared_ptr<uint8_t[]>(owner, p);
+      fb->u = std::shared_ptr<uint8_t[]>(owner, p + stride_y * height_);
+      fb->v = std::shared_ptr<uint8_t[]>(
+          owner, p + stride_y * height_ + stride_uv * chroma_height);
+      frame.i420_buffer = fb;
+      callback_(frame);
+      return;
     }
-    pool_.clear();
 
-    if (device_fd_ >= 0) {
-      close(device_fd_);
-      device_fd_ = -1;
+    // MJPEG はデコードに時間がかかるので、コピーしてすぐにバッファをデバイスに戻して、
+    // デコードは別スレッドで行う
+    if (pixel_format_ == V4L2_PIX_FMT_MJPEG) {
+      mjpeg_decoder_->Decode(p, buf.bytesused, width_, height_,
+                             frame.timestamp);
+      device_->Queue(buf.index);
+      return;
     }
+
+    // それ以外のフォーマットは、バッファから直接 I420 に変換してすぐにデバイスに戻す
+    auto fb = sorac::VideoFrameBufferI420::Create(width_, height_);
+    if (pixel_format_ == V4L2_PIX_FMT_NV12) {
+      int stride_y = bytes_per_line_ > 0 ? bytes_per_line_ : width_;
+      libyuv::NV12ToI420(p, stride_y, p + stride_y * height_, stride_y,
+                         fb->y.get(), fb->stride_y, fb->u.get(), fb->stride_u,
+                         fb->v.get(), fb->stride_v, width_, height_);
+    } else {
+      int stride = bytes_per_line_ > 0 ? bytes_per_line_ : width_ * 2;
+      libyuv::YUY2ToI420(p, stride, fb->y.get(), fb->stride_y, fb->u.get(),
+                         fb->stride_u, fb->v.get(), fb->stride_v, width_,
+                         height_);
+    }
+    device_->Queue(buf.index);
+
+    frame.i420_buffer = fb;
+    callback_(frame);
   }
 
  private:
-  std::string device_;
+  std::string device_name_;
   std::function<void(const sorac::VideoFrame& frame)> callback_;
   int width_;
   int height_;
-
-  int device_fd_ = -1;
-  std::atomic<bool> quit_;
+  std::string format_;
+  int buffer_count_;
+  int mjpeg_decode_threads_;
+
+  std::shared_ptr<V4L2Device> device_;
+  uint32_t pixel_format_ = 0;
+  int bytes_per_line_ = 0;
+  int epoll_fd_ = -1;
+  int stop_fd_ = -1;
   std::unique_ptr<std::thread> capture_thread_;
-
-  struct Buffer {
-    void* start;
-    size_t length;
-  };
-  std::vector<Buffer> pool_;
+  std::unique_ptr<MjpegDecoder> mjpeg_decoder_;
 };
 
 }  // namespace sumomo
@@ -265,7 +569,11 @@ extern "C" {
 
 SumomoCapturer* sumomo_v4l2_capturer_create(const char* device,
                                             int width,
-                                            int height) {
-  return new sumomo::V4L2Capturer(device, width, height);
+                                            int height,
+                                            const char* format,
+                                            int buffer_count,
+                                            int mjpeg_decode_threads) {
+  return new sumomo::V4L2Capturer(device, width, height, format, buffer_count,
+                                  mjpeg_decode_threads);
 }
 }
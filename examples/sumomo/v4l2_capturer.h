@@ -11,7 +11,10 @@ extern "C" {
 
 extern SumomoCapturer* sumomo_v4l2_capturer_create(const char* device,
                                                    int width,
-                                                   int height);
+                                                   int height,
+                                                   const char* format,
+                                                   int buffer_count,
+                                                   int mjpeg_decode_threads);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,48 @@
+#ifndef SORAC_AUDIO_RESAMPLER_HPP_
+#define SORAC_AUDIO_RESAMPLER_HPP_
+
+#include <memory>
+
+namespace sorac {
+
+// 品質とレイテンシのトレードオフ。
+// 品質を上げるほどフィルタのタップ数が増えて、遅延と CPU 負荷が増える。
+enum class AudioResamplerQuality {
+  kLow,
+  kMedium,
+  kHigh,
+};
+
+// インターリーブされた float の PCM をリサンプリングする。
+// 呼び出し間で状態を保持しているので、連続したデータを分割して渡しても境界にノイズが乗らない。
+class AudioResampler {
+ public:
+  virtual ~AudioResampler() {}
+
+  virtual int GetInputSampleRate() const = 0;
+  virtual int GetOutputSampleRate() const = 0;
+  virtual int GetChannels() const = 0;
+
+  // input_samples 個のサンプルを渡した時に出力される最大のサンプル数を返す
+  virtual int GetMaxOutputSamples(int input_samples) const = 0;
+
+  // input には input_samples * channels 個の float を渡す。
+  // output には GetMaxOutputSamples(input_samples) * channels 個の float を書き込める領域が必要。
+  // 戻り値は output に書き込んだチャンネルあたりのサンプル数。
+  virtual int Resample(const float* input,
+                       int input_samples,
+                       float* output) = 0;
+
+  // 内部状態を初期化する
+  virtual void Reset() = 0;
+};
+
+std::shared_ptr<AudioResampler> CreateAudioResampler(
+    int input_sample_rate,
+    int output_sample_rate,
+    int channels,
+    AudioResamplerQuality quality);
+
+}  // namespace sorac
+
+#endif
@@ -90,6 +90,40 @@ Bitrate<Period1> operator*(Bitrate<Period1> lhs, int64_t rhs) {
   return Bitrate<Period1>(lhs.count() * rhs);
 }
 
+template <class Period1, class Period2>
+bool operator==(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  typedef
+      typename std::common_type<Bitrate<Period1>, Bitrate<Period2>>::type ct;
+  return ct(lhs).count() == ct(rhs).count();
+}
+
+template <class Period1, class Period2>
+bool operator!=(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  return !(lhs == rhs);
+}
+
+template <class Period1, class Period2>
+bool operator<(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  typedef
+      typename std::common_type<Bitrate<Period1>, Bitrate<Period2>>::type ct;
+  return ct(lhs).count() < ct(rhs).count();
+}
+
+template <class Period1, class Period2>
+bool operator>(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  return rhs < lhs;
+}
+
+template <class Period1, class Period2>
+bool operator<=(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  return !(rhs < lhs);
+}
+
+template <class Period1, class Period2>
+bool operator>=(Bitrate<Period1> lhs, Bitrate<Period2> rhs) {
+  return !(lhs < rhs);
+}
+
 typedef Bitrate<std::ratio<1>> Bps;
 typedef Bitrate<std::kilo> Kbps;
 
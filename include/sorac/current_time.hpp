@@ -7,6 +7,15 @@ namespace sorac {
 
 std::chrono::microseconds get_current_time();
 
-}
+// CLOCK_MONOTONIC の現在時刻
+std::chrono::microseconds get_monotonic_time();
+
+// CLOCK_MONOTONIC の時刻を get_current_time() と同じ基準の時刻に変換する。
+// V4L2 のバッファのタイムスタンプなど、デバイスやドライバが付けた時刻を
+// フレームのタイムスタンプとして使うため。
+std::chrono::microseconds monotonic_to_current_time(
+    std::chrono::microseconds monotonic_time);
+
+}  // namespace sorac
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef SORAC_DELAY_BASED_BWE_HPP_
+#define SORAC_DELAY_BASED_BWE_HPP_
+
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <vector>
+
+#include "bitrate.hpp"
+#include "transport_cc_handler.hpp"
+
+namespace sorac {
+
+// transport-cc フィードバックの遅延の傾きから帯域を推定する。
+// GCC (draft-ietf-rmcat-gcc-02) の trendline filter と AIMD を簡略化したもの。
+class DelayBasedBwe {
+ public:
+  enum class Usage {
+    kNormal,
+    kUnderusing,
+    kOverusing,
+  };
+
+  DelayBasedBwe(Bps initial_bitrate, Bps min_bitrate, Bps max_bitrate);
+
+  // フィードバックを渡して、推定したビットレートを返す
+  Bps OnFeedback(const std::vector<TransportCcPacketResult>& results);
+
+  Bps GetEstimate() const { return estimate_; }
+  Usage GetUsage() const { return usage_; }
+
+ private:
+  struct PacketGroup {
+    std::chrono::microseconds first_send_time;
+    std::chrono::microseconds last_send_time;
+    std::chrono::microseconds last_arrival_time;
+    size_t size = 0;
+  };
+  void OnPacketGroup(const PacketGroup& group, std::chrono::microseconds now);
+  void UpdateThreshold(double trend, std::chrono::microseconds now);
+  void UpdateEstimate(std::chrono::microseconds now);
+
+ private:
+  Bps min_bitrate_;
+  Bps max_bitrate_;
+  Bps estimate_;
+  Usage usage_ = Usage::kNormal;
+
+  std::optional<PacketGroup> current_group_;
+  std::optional<PacketGroup> prev_group_;
+
+  // trendline filter
+  double accumulated_delay_ms_ = 0.0;
+  double smoothed_delay_ms_ = 0.0;
+  int num_deltas_ = 0;
+  std::optional<std::chrono::microseconds> first_arrival_time_;
+  // (到着時刻 [ms], 平滑化した遅延 [ms])
+  std::deque<std::pair<double, double>> delay_history_;
+  double threshold_ = 12.5;
+  std::optional<std::chrono::microseconds> last_threshold_update_;
+  std::optional<std::chrono::microseconds> overuse_start_;
+  double prev_trend_ = 0.0;
+
+  // 受信されたことが分かったビットレートの計測
+  std::deque<std::pair<std::chrono::microseconds, size_t>> acked_;
+  std::optional<std::chrono::microseconds> last_update_;
+};
+
+}  // namespace sorac
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SORAC_FLEXFEC_MEDIA_HANDLER_HPP_
+#define SORAC_FLEXFEC_MEDIA_HANDLER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+#include "transport_cc_handler.hpp"
+
+namespace sorac {
+
+struct FlexfecMediaHandlerConfig {
+  // 保護する RTP パケットの SSRC
+  uint32_t ssrc;
+  // FEC パケットを送る SSRC と payload type
+  uint32_t fec_ssrc;
+  int payload_type;
+  // パケットロスが無い時の FEC パケットの割合 [%]
+  int protection_percent = 10;
+  // パケットロスに応じて増やす時の上限 [%]
+  int max_protection_percent = 50;
+  // transport-cc を使う場合、生成した FEC パケットに transport-wide sequence number を振る
+  std::shared_ptr<TransportCcSender> transport_cc;
+};
+
+// 送信する RTP パケットから FlexFEC (draft-ietf-payload-flexible-fec-scheme-03) の
+// FEC パケットを生成して、RTP パケットの後ろに追加する。
+// FEC は実際に送信するバイト列に対して計算する必要があるので、
+// PacingMediaHandler や TransportCcMediaHandler より後ろにつなぐ。
+class FlexfecMediaHandler : public rtc::MediaHandler {
+ public:
+  FlexfecMediaHandler(const FlexfecMediaHandlerConfig& config);
+
+  void outgoing(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+  // 受信側から通知されたパケットロス率 [0, 1] に応じて FEC パケットの割合を変える。
+  // 任意のスレッドから呼び出して良い。
+  void SetPacketLossRate(float loss_rate);
+
+ private:
+  void GenerateFec(rtc::message_vector& messages);
+
+ private:
+  FlexfecMediaHandlerConfig config_;
+  std::atomic<int> protection_percent_;
+  // FEC パケットを生成する前のメディアパケットのコピー。シーケンス番号は連続している
+  std::vector<rtc::message_ptr> group_;
+  std::chrono::microseconds group_start_time_;
+  // まだ送っていない FEC パケットの数 (端数を含む)
+  double fec_credit_ = 0.0;
+  uint16_t sequence_number_;
+};
+
+}  // namespace sorac
+
+#endif
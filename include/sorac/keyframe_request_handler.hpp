@@ -0,0 +1,71 @@
+#ifndef SORAC_KEYFRAME_REQUEST_HANDLER_HPP_
+#define SORAC_KEYFRAME_REQUEST_HANDLER_HPP_
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+namespace sorac {
+
+struct KeyframeRequestHandlerConfig {
+  // 送信している RTP パケットの SSRC。この SSRC 宛ての PLI と FIR だけを扱う
+  uint32_t ssrc;
+  // 最初の要求からこの時間内に届いた要求は 1 回のキーフレーム要求にまとめる。
+  // 0 の場合はすぐにキーフレームを要求する。
+  std::chrono::milliseconds coalesce_window = std::chrono::milliseconds(0);
+  // キーフレームを要求してから、次に要求するまでの最小間隔。
+  // この間に届いた要求は、間隔が空いた時に 1 回だけ要求する。
+  std::chrono::milliseconds min_interval = std::chrono::milliseconds(500);
+  // キーフレームを要求する時に呼ばれる
+  std::function<void()> on_keyframe_request;
+};
+
+struct KeyframeRequestHandlerStats {
+  // 受信した PLI と FIR の数
+  uint64_t pli_count = 0;
+  uint64_t fir_count = 0;
+  // 実際にエンコーダにキーフレームを要求した回数
+  uint64_t keyframe_request_count = 0;
+  // まとめたり間引いたりして、エンコーダに要求しなかった PLI と FIR の数
+  uint64_t keyframe_request_dropped_count = 0;
+};
+
+// 受信した RTCP から、指定した SSRC 宛ての PLI (RFC 4585) と FIR (RFC 5104) を取り出して、
+// まとめたり間引いたりしてからキーフレームを要求する。
+// 多くの受信者から一斉に PLI が届いても、キーフレームを連続で生成しないようにするため。
+// rtc::PliHandler の代わりにパケタイザの後ろにつなぐ。
+class KeyframeRequestHandler : public rtc::MediaHandler {
+ public:
+  KeyframeRequestHandler(const KeyframeRequestHandlerConfig& config);
+
+  void incoming(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+  // 保留している要求は、パケットを送る時に送れるようになっていれば要求する
+  void outgoing(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+  KeyframeRequestHandlerStats GetStats();
+
+ private:
+  // 要求できる状態なら保留を解除して true を返す
+  bool TakePendingRequest(std::chrono::microseconds now);
+
+ private:
+  KeyframeRequestHandlerConfig config_;
+
+  std::mutex mutex_;
+  // 保留している要求のうち、最初に届いた時刻
+  std::optional<std::chrono::microseconds> pending_since_;
+  // 保留している要求の数
+  uint64_t pending_count_ = 0;
+  std::optional<std::chrono::microseconds> last_request_time_;
+  KeyframeRequestHandlerStats stats_;
+};
+
+}  // namespace sorac
+
+#endif
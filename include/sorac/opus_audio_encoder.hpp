@@ -3,6 +3,7 @@
 
 #include <functional>
 
+#include "audio_resampler.hpp"
 #include "types.hpp"
 
 namespace sorac {
@@ -11,13 +12,45 @@ class OpusAudioEncoder {
  public:
   virtual ~OpusAudioEncoder() {}
 
-  virtual bool InitEncode(int sample_rate,
-                          int channels,
-                          int frame_duration_ms,
-                          int bitrate_kbps) = 0;
+  enum class Application {
+    kVoip,
+    kAudio,
+    kRestrictedLowDelay,
+  };
+
+  struct Settings {
+    int sample_rate;
+    // 1 か 2
+    int channels;
+    // 10, 20, 40, 60 のいずれか
+    int frame_duration_ms;
+    int bitrate_kbps;
+    // パケットロスが多い時にビットレートを下げる場合の下限
+    int min_bitrate_kbps = 16;
+    // 0 から 10 で、大きいほど CPU 負荷が高くなる代わりに品質が上がる
+    int complexity = 10;
+    // 無音時にパケットをほとんど送らないようにする
+    bool dtx = false;
+    Application application = Application::kVoip;
+    // 入力のサンプリングレートが sample_rate と異なる場合に使うリサンプラの品質
+    AudioResamplerQuality resampler_quality = AudioResamplerQuality::kMedium;
+    // エンコードしたデータをコールバックに渡すまでに保持しておく時間。
+    // 0 の場合はエンコードしたらすぐに、Encode() を呼んだスレッドからコールバックに渡す。
+    // 0 より大きい場合は、内部のスレッドが RTP タイムスタンプから計算した時刻に合わせて
+    // コールバックに渡すので、入力が途切れても保持しているデータは送られる。
+    int holdback_ms = 0;
+  };
+
+  virtual bool InitEncode(const Settings& settings) = 0;
+  // 保持していてまだコールバックに渡していないデータは捨てる。
+  // エンコーダを止める時は送信先も無くなっていることが多く、古い音声を送っても意味が無いため。
   virtual void Release() = 0;
 
   virtual void Encode(const AudioFrame& frame) = 0;
+  // 受信側から通知されたパケットロス率 [0, 1] を設定する。
+  // 任意のスレッドから呼び出して良く、ロックを取らずに値を置くだけなのでブロックしない。
+  // 次の Encode() 時にエンコーダに反映される。
+  virtual void SetPacketLossRate(float loss_rate) = 0;
   virtual void SetEncodeCallback(
       std::function<void(const EncodedAudio&)> callback) = 0;
 };
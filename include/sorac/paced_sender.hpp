@@ -0,0 +1,88 @@
+#ifndef SORAC_PACED_SENDER_HPP_
+#define SORAC_PACED_SENDER_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+#include "bitrate.hpp"
+
+namespace sorac {
+
+// 送信する RTP パケットを一定間隔で少しずつ送り出す。
+// キーフレームのような大きなフレームのパケットを一度に送ると、経路上のキューが溢れてパケットロスになるため。
+//
+// 1 つのコネクション内の全てのトラックで共有して、音声は映像より優先して送る。
+class PacedSender {
+ public:
+  enum class Priority {
+    kAudio,
+    // 再送は失ったパケットを早く届けるために、キューに溜まった映像より先に送る
+    kRetransmission,
+    kVideo,
+  };
+
+  // pacing_factor: 目標ビットレートの何倍の速度で送り出すか
+  PacedSender(double pacing_factor);
+  ~PacedSender();
+
+  // 種類ごとの目標ビットレートを設定する。
+  // 全ての種類の合計に pacing_factor を掛けた値が送信レートになる。
+  void SetBitrate(Priority priority, Bps bitrate);
+
+  // 音声はすぐに送って、再送と映像はキューに積んで送信レートに合わせて送る。
+  // send はパケットを送り出す時に呼ばれる。
+  void Enqueue(Priority priority,
+               rtc::message_ptr message,
+               const rtc::message_callback& send);
+
+ private:
+  void Run();
+
+ private:
+  struct Packet {
+    rtc::message_ptr message;
+    rtc::message_callback send;
+  };
+
+  double pacing_factor_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  Bps audio_bitrate_;
+  Bps video_bitrate_;
+  std::deque<Packet> retransmission_queue_;
+  std::deque<Packet> video_queue_;
+  // retransmission_queue_ と video_queue_ に溜まっているバイト数
+  size_t video_queue_bytes_ = 0;
+  // 送信して良いバイト数。送りすぎた場合は負になる
+  double budget_ = 0.0;
+  std::thread thread_;
+};
+
+// 送信する RTP パケットを PacedSender に渡す MediaHandler。
+// パケタイザの後ろにつなぐ。
+// このハンドラより後ろにつないだ MediaHandler は、PacedSender が実際に送り出す時に呼ばれる。
+class PacingMediaHandler : public rtc::MediaHandler {
+ public:
+  PacingMediaHandler(std::weak_ptr<PacedSender> pacer,
+                     PacedSender::Priority priority);
+
+  void outgoing(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+ private:
+  std::weak_ptr<PacedSender> pacer_;
+  PacedSender::Priority priority_;
+};
+
+}  // namespace sorac
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SORAC_RTCP_RECEIVER_REPORT_HANDLER_HPP_
+#define SORAC_RTCP_RECEIVER_REPORT_HANDLER_HPP_
+
+#include <functional>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+namespace sorac {
+
+// RTCP SR/RR に含まれる report block (RFC 3550 6.4.1)
+struct RtcpReportBlock {
+  uint32_t ssrc;
+  // 前回のレポートからのパケットロス率を 256 倍した値
+  uint8_t fraction_lost;
+  int32_t cumulative_lost;
+  uint32_t highest_sequence;
+  uint32_t jitter;
+  uint32_t last_sr;
+  uint32_t delay_since_last_sr;
+};
+
+// 受信した RTCP から、指定した SSRC 宛ての report block を取り出して通知する。
+// RTCP のパケット自体はそのまま次の MediaHandler に流す。
+class RtcpReceiverReportHandler : public rtc::MediaHandler {
+ public:
+  RtcpReceiverReportHandler(
+      rtc::SSRC ssrc,
+      std::function<void(const RtcpReportBlock&)> on_report);
+
+  void incoming(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+ private:
+  void Parse(const uint8_t* buf, size_t size);
+
+ private:
+  rtc::SSRC ssrc_;
+  std::function<void(const RtcpReportBlock&)> on_report_;
+};
+
+}  // namespace sorac
+
+#endif
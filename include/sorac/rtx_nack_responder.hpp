@@ -0,0 +1,86 @@
+#ifndef SORAC_RTX_NACK_RESPONDER_HPP_
+#define SORAC_RTX_NACK_RESPONDER_HPP_
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+#include "bitrate.hpp"
+#include "paced_sender.hpp"
+#include "transport_cc_handler.hpp"
+
+namespace sorac {
+
+struct RtxNackResponderConfig {
+  // 送信している RTP パケットの SSRC
+  uint32_t ssrc;
+  // RTX の SSRC と payload type。
+  // RTX がネゴシエーションされていない場合は nullopt で、元の SSRC のまま再送する。
+  std::optional<uint32_t> rtx_ssrc;
+  int rtx_payload_type = 0;
+  // 再送用に送信済みのパケットを保持しておく時間
+  std::chrono::milliseconds history_time = std::chrono::milliseconds(1000);
+  // 保持するパケット数の上限を決めるためのビットレート
+  Bps max_bitrate;
+  // 再送するパケットを送り出すペーサー。無い場合はすぐに送る
+  std::weak_ptr<PacedSender> pacer;
+  // transport-cc を使う場合、再送するパケットにも transport-wide sequence number を振る
+  std::shared_ptr<TransportCcSender> transport_cc;
+  // 保持期間を過ぎて再送できないパケットの NACK を受け取った時に呼ばれる。
+  // 受信側はそのままではデコードできないので、エンコーダに回復を要求するのに使う。
+  // 1 回の要求より前に送ったパケットの NACK では、再度呼ばれることは無い。
+  std::function<void()> on_unrecoverable_loss;
+};
+
+struct RtxNackResponderStats {
+  uint64_t packets_sent = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t nack_count = 0;
+  uint64_t retransmitted_packets_sent = 0;
+  uint64_t retransmitted_bytes_sent = 0;
+};
+
+// NACK を受け取ったら、該当するパケットを RTX (RFC 4588) で再送する。
+// rtc::RtcpNackResponder の代わりにパケタイザの後ろにつなぐ。
+class RtxNackResponder : public rtc::MediaHandler {
+ public:
+  RtxNackResponder(const RtxNackResponderConfig& config);
+
+  void incoming(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+  void outgoing(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+  RtxNackResponderStats GetStats();
+
+ private:
+  void OnNack(uint16_t seq, const rtc::message_callback& send);
+  rtc::message_ptr CreateRtxPacket(const rtc::Message& packet);
+
+ private:
+  struct Entry {
+    rtc::message_ptr packet;
+    std::chrono::microseconds timestamp;
+  };
+
+  RtxNackResponderConfig config_;
+  size_t max_packets_;
+
+  std::mutex mutex_;
+  // シーケンス番号順に並んだ送信済みパケット
+  std::deque<Entry> history_;
+  uint16_t rtx_sequence_number_;
+  RtxNackResponderStats stats_;
+  // 最後に on_unrecoverable_loss を呼んだ時点で、最後に送っていたパケットのシーケンス番号
+  std::optional<uint16_t> recovery_sequence_number_;
+};
+
+}  // namespace sorac
+
+#endif
@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include <optional>
+#include <string>
 
 // libdatachannel
 #include <rtc/rtc.hpp>
@@ -12,9 +13,30 @@
 #include "soracp.json.c.hpp"
 #include "soracp.json.h"
 #include "types.hpp"
+#include "video_encoder.hpp"
 
 namespace sorac {
 
+// 送信している映像の統計情報。サイマルキャストの場合は全てのレイヤーの合計
+struct SignalingStats {
+  uint64_t video_packets_sent = 0;
+  uint64_t video_bytes_sent = 0;
+  uint64_t video_nack_count = 0;
+  uint64_t video_pli_count = 0;
+  uint64_t video_fir_count = 0;
+  // PLI と FIR のうち、エンコーダにキーフレームを要求した回数と、
+  // まとめたり間引いたりして要求しなかった数
+  uint64_t video_keyframe_requests_forwarded = 0;
+  uint64_t video_keyframe_requests_dropped = 0;
+  uint64_t video_frames_encoded = 0;
+  uint64_t video_key_frames_encoded = 0;
+  // エンコーダがレート制御などでスキップして、送信しなかったフレームの数
+  uint64_t video_frames_skipped = 0;
+  // transport-cc のフィードバックから推定した送信可能なビットレート。
+  // 推定していない場合は nullopt
+  std::optional<int64_t> available_outgoing_bitrate_bps;
+};
+
 class Signaling {
  public:
   virtual ~Signaling() {}
@@ -22,6 +44,9 @@ class Signaling {
   virtual void SendVideoFrame(const VideoFrame& frame) = 0;
   virtual void SendAudioFrame(const AudioFrame& frame) = 0;
 
+  // SetOnTrack, SetOnDataChannel, SetOnNotify, SetOnPush のコールバックは
+  // libdatachannel のスレッドから呼ばれる。
+  // これらのコールバックの中で Signaling を破棄してはいけない。
   virtual void SetOnTrack(
       std::function<void(std::shared_ptr<rtc::Track>)> on_track) = 0;
   virtual void SetOnDataChannel(
@@ -31,8 +56,28 @@ class Signaling {
   virtual void SetOnNotify(
       std::function<void(const std::string&)> on_notify) = 0;
   virtual void SetOnPush(std::function<void(const std::string&)> on_push) = 0;
+  // 接続状態が変わった時に呼ばれる。
+  // 切断された場合は自動で再接続して、繋がり直したら再度 SetOnTrack のコールバックが呼ばれる。
+  // コールバックは状態を通知するための専用のスレッドから、状態が変わった順に呼ばれる。
+  // このコールバックの中で Signaling を破棄しても良い（それ以降の通知は呼ばれない）。
+  virtual void SetOnStateChange(
+      std::function<void(soracp::SignalingState)> on_state_change) = 0;
 
   virtual soracp::RtpEncodingParameters GetRtpEncodingParameters() const = 0;
+  // サイマルキャストのレイヤーを止めたり再開したりする。
+  // 止めたレイヤーのエンコードは行わず、再開したレイヤーはキーフレームから送る。
+  // サイマルキャストでない場合や rid が存在しない場合は何もしない。
+  virtual void SetRtpEncodingActive(const std::string& rid, bool active) = 0;
+
+  // 映像エンコーダを作る関数を指定する。
+  // 指定した場合は SignalingConfig の h264_encoder_type などは使わずに、
+  // ネゴシエーションされたコーデック名 ("H264" など) を渡してエンコーダを作る。
+  // Connect() の前に呼ぶこと。
+  virtual void SetVideoEncoderFactory(
+      std::function<std::shared_ptr<VideoEncoder>(const std::string& codec)>
+          factory) = 0;
+
+  virtual SignalingStats GetStats() const = 0;
 };
 
 std::shared_ptr<Signaling> CreateSignaling(
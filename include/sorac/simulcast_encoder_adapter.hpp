@@ -12,7 +12,27 @@
 
 namespace sorac {
 
-std::shared_ptr<VideoEncoder> CreateSimulcastEncoderAdapter(
+class SimulcastEncoderAdapter : public VideoEncoder {
+ public:
+  using VideoEncoder::ForceIntraNextFrame;
+  using VideoEncoder::RequestLossRecovery;
+  // 指定した rid のレイヤーだけ次のフレームをキーフレームにする。
+  // サイマルキャストでない場合は rid に関係なくキーフレームにする。
+  // ForceIntraNextFrame() も含めて、任意のスレッドから呼び出して良く、ロックを取らずに
+  // 次の Encode() 時に反映される。
+  virtual void ForceIntraNextFrame(const std::string& rid) = 0;
+  // 指定した rid のレイヤーだけ、パケットロスから回復するように要求する。
+  // ForceIntraNextFrame(rid) と同じく、任意のスレッドから呼び出して良い。
+  virtual void RequestLossRecovery(const std::string& rid) = 0;
+  // 再ネゴシエーションなどで encodings が変わった時に呼ぶ。
+  // rid が一致するレイヤーの active と max_bitrate_bps だけを反映して、
+  // エンコーダは作り直さずに、止めたレイヤーの解放と再開したレイヤーの作成だけを行う。
+  // 任意のスレッドから呼び出して良く、次の Encode() 時に反映される。
+  virtual void SetRtpEncodingParameters(
+      const soracp::RtpEncodingParameters& params) = 0;
+};
+
+std::shared_ptr<SimulcastEncoderAdapter> CreateSimulcastEncoderAdapter(
     const soracp::RtpEncodingParameters& params,
     std::function<std::shared_ptr<VideoEncoder>()> create_encoder);
 
@@ -201,6 +201,9 @@ typedef void (*sorac_signaling_on_notify_func)(const char* message,
 typedef void (*sorac_signaling_on_push_func)(const char* message,
                                              int len,
                                              void* userdata);
+typedef void (*sorac_signaling_on_state_change_func)(
+    soracp_SignalingState state,
+    void* userdata);
 extern SoracSignaling* sorac_signaling_create(
     const soracp_SignalingConfig* config);
 extern void sorac_signaling_release(SoracSignaling* p);
@@ -225,9 +228,16 @@ extern void sorac_signaling_set_on_notify(
 extern void sorac_signaling_set_on_push(SoracSignaling* p,
                                         sorac_signaling_on_push_func on_push,
                                         void* userdata);
+extern void sorac_signaling_set_on_state_change(
+    SoracSignaling* p,
+    sorac_signaling_on_state_change_func on_state_change,
+    void* userdata);
 extern void sorac_signaling_get_rtp_encoding_parameters(
     SoracSignaling* p,
     soracp_RtpEncodingParameters* params);
+extern void sorac_signaling_set_rtp_encoding_active(SoracSignaling* p,
+                                                   const char* rid,
+                                                   bool active);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,83 @@
+#ifndef SORAC_TRANSPORT_CC_HANDLER_HPP_
+#define SORAC_TRANSPORT_CC_HANDLER_HPP_
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// libdatachannel
+#include <rtc/rtc.hpp>
+
+namespace sorac {
+
+static const char TRANSPORT_CC_EXTENSION_URI[] =
+    "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01";
+
+// transport-cc フィードバックから分かったパケットごとの結果
+struct TransportCcPacketResult {
+  // transport-wide sequence number (ラップアラウンドしないように 64 bit に拡張したもの)
+  int64_t sequence_number;
+  std::chrono::microseconds send_time;
+  // 受信側の時計での到着時刻。受信されなかった場合は nullopt
+  std::optional<std::chrono::microseconds> arrival_time;
+  size_t size;
+};
+
+// コネクション内の全ての RTP パケットに transport-wide sequence number を振って、
+// 受信側からのフィードバックと送信時刻を突き合わせる。
+class TransportCcSender {
+ public:
+  TransportCcSender(int extension_id);
+
+  // RTP パケットのヘッダ拡張に transport-wide sequence number を書き込んで、送信時刻を記録する
+  void Stamp(rtc::Message& packet);
+  // 受信した RTCP から transport-cc フィードバックを探して処理する
+  void OnRtcp(const uint8_t* buf, size_t size);
+
+  // フィードバックを受け取った時に、送信順に並んだ結果を渡す
+  void SetOnFeedback(
+      std::function<void(const std::vector<TransportCcPacketResult>&)>
+          on_feedback);
+
+ private:
+  void OnFeedback(const uint8_t* p, size_t size);
+
+ private:
+  struct SentPacket {
+    std::chrono::microseconds send_time;
+    size_t size;
+  };
+
+  int extension_id_;
+
+  std::mutex mutex_;
+  int64_t next_sequence_number_ = 0;
+  // first_sequence_number_ から順に並んだ送信済みパケット
+  std::deque<SentPacket> history_;
+  int64_t first_sequence_number_ = 0;
+  std::optional<uint8_t> last_feedback_count_;
+  std::function<void(const std::vector<TransportCcPacketResult>&)>
+      on_feedback_;
+};
+
+// TransportCcSender を使ってパケットに transport-wide sequence number を振る MediaHandler。
+// 実際に送信される直前の順番で振る必要があるので、PacingMediaHandler より後ろにつなぐ。
+class TransportCcMediaHandler : public rtc::MediaHandler {
+ public:
+  TransportCcMediaHandler(std::shared_ptr<TransportCcSender> sender);
+
+  void incoming(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+  void outgoing(rtc::message_vector& messages,
+                const rtc::message_callback& send) override;
+
+ private:
+  std::shared_ptr<TransportCcSender> sender_;
+};
+
+}  // namespace sorac
+
+#endif
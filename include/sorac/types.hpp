@@ -5,17 +5,18 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace sorac {
 
 struct VideoFrameBufferI420 {
   int width;
   int height;
-  std::unique_ptr<uint8_t[]> y;
+  std::shared_ptr<uint8_t[]> y;
   int stride_y;
-  std::unique_ptr<uint8_t[]> u;
+  std::shared_ptr<uint8_t[]> u;
   int stride_u;
-  std::unique_ptr<uint8_t[]> v;
+  std::shared_ptr<uint8_t[]> v;
   int stride_v;
 
   static std::shared_ptr<VideoFrameBufferI420> Create(int width, int height);
@@ -24,9 +25,9 @@ struct VideoFrameBufferI420 {
 struct VideoFrameBufferNV12 {
   int width;
   int height;
-  std::unique_ptr<uint8_t[]> y;
+  std::shared_ptr<uint8_t[]> y;
   int stride_y;
-  std::unique_ptr<uint8_t[]> uv;
+  std::shared_ptr<uint8_t[]> uv;
   int stride_uv;
 
   static std::shared_ptr<VideoFrameBufferNV12> Create(int width, int height);
@@ -48,10 +49,38 @@ struct VideoFrame {
 };
 
 struct EncodedImage {
+  enum class FrameType {
+    // IDR などの、他のフレームを参照せずにデコードできるフレーム
+    kKey,
+    kDelta,
+    // レート制御などでエンコーダがフレームを出力しなかった
+    kSkip,
+  };
+  // buf 内の NAL ユニットの区切り方
+  enum class NalSeparator {
+    // Annex B のスタートコード (00 00 00 01 または 00 00 01)
+    kStartCode,
+    // 4 バイトのビッグエンディアンで NAL ユニットの長さを書く (AVCC 形式)
+    kLength,
+  };
+  // buf 内の NAL ユニットの位置。offset と size に区切りのバイトは含まない
+  struct NalUnitPosition {
+    int offset;
+    int size;
+  };
+
   std::shared_ptr<uint8_t[]> buf;
   int size;
   std::chrono::microseconds timestamp;
   std::optional<std::string> rid;
+  NalSeparator nal_separator = NalSeparator::kStartCode;
+  FrameType frame_type = FrameType::kDelta;
+  // フレームの平均 QP。エンコーダが返さない場合は nullopt
+  std::optional<int> qp;
+  // エンコーダが NAL ユニットの位置を返さない場合は空
+  std::vector<NalUnitPosition> nal_units;
+  int temporal_id = 0;
+  int spatial_id = 0;
 };
 
 struct AudioFrame {
@@ -63,10 +92,12 @@ struct AudioFrame {
 };
 
 struct EncodedAudio {
-  std::unique_ptr<uint8_t> buf;
+  std::unique_ptr<uint8_t[]> buf;
   int size = 0;
   int cap = 0;
   std::chrono::microseconds timestamp;
+  // 最初のフレームからの経過時間を RTP のクロックレート (48000 Hz) で表した値
+  uint32_t rtp_timestamp = 0;
 };
 
 }  // namespace sorac
@@ -12,17 +12,38 @@ namespace sorac {
 class VideoEncoder {
  public:
   struct Settings {
+    // パケットロスで受信側がデコードできなくなった時の回復方法
+    enum class LossRecovery {
+      // RequestLossRecovery() に対して IDR を送る
+      kIdr,
+      // RequestLossRecovery() に対して、受信側に届いている LTR (Long Term Reference) を
+      // 参照した P フレームを送って、IDR によるビットレートの急増を避ける。
+      // LTR で回復できなかった場合は IDR を送る。
+      // ForceIntraNextFrame() には常に IDR を送る。
+      // 対応していないエンコーダでは kIdr と同じ動作になる。
+      kLongTermReference,
+    };
+
     int width;
     int height;
     Bps bitrate;
+    LossRecovery loss_recovery = LossRecovery::kIdr;
   };
 
   virtual ~VideoEncoder() {}
+  // 次のフレームを IDR にする
   virtual void ForceIntraNextFrame() = 0;
+  // 再送できないパケットロスがあった時に呼ぶ。
+  // Settings::loss_recovery に従って、次のフレームで受信側がデコードできる状態に戻す。
+  // 任意のスレッドから呼び出して良い。
+  virtual void RequestLossRecovery() { ForceIntraNextFrame(); }
   virtual bool InitEncode(const Settings& settings) = 0;
   virtual void SetEncodeCallback(
       std::function<void(const EncodedImage&)> callback) = 0;
   virtual void Encode(const VideoFrame& frame) = 0;
+  // エンコーダを作り直さずにビットレートを変更する。
+  // 任意のスレッドから呼び出して良く、次の Encode() 時にエンコーダに反映される。
+  virtual void SetBitrate(Bps bitrate) = 0;
   virtual void Release() = 0;
 };
 
@@ -0,0 +1,200 @@
+#include "sorac/audio_resampler.hpp"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+// SIMD
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace sorac {
+
+// 位相の数の上限。
+// 入出力のサンプリングレートの比が複雑な場合（47999 Hz -> 48000 Hz など）、
+// 全ての位相のフィルタを持つとテーブルが大きくなりすぎるので、最も近い位相で近似する。
+static const int MAX_PHASES = 1024;
+
+// taps は 4 の倍数であること
+static float Dot(const float* a, const float* b, int taps) {
+#if defined(__ARM_NEON)
+  float32x4_t acc = vdupq_n_f32(0.0f);
+  for (int i = 0; i < taps; i += 4) {
+    acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+  }
+  float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#elif defined(__SSE__)
+  __m128 acc = _mm_setzero_ps();
+  for (int i = 0; i < taps; i += 4) {
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+  float r[4];
+  _mm_storeu_ps(r, acc);
+  return (r[0] + r[1]) + (r[2] + r[3]);
+#else
+  float r[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < taps; i += 4) {
+    r[0] += a[i + 0] * b[i + 0];
+    r[1] += a[i + 1] * b[i + 1];
+    r[2] += a[i + 2] * b[i + 2];
+    r[3] += a[i + 3] * b[i + 3];
+  }
+  return (r[0] + r[1]) + (r[2] + r[3]);
+#endif
+}
+
+// ポリフェーズフィルタによるリサンプラ。
+//
+// 出力の k 番目のサンプルは、入力のサンプル位置 k * down / up にあたる。
+// 窓関数付きの sinc フィルタを up 個の位相に分けて事前に計算しておき、
+// 出力サンプルごとに対応する位相のフィルタと入力の内積を取る。
+class PolyphaseAudioResampler : public AudioResampler {
+ public:
+  PolyphaseAudioResampler(int input_sample_rate,
+                          int output_sample_rate,
+                          int channels,
+                          AudioResamplerQuality quality)
+      : input_sample_rate_(input_sample_rate),
+        output_sample_rate_(output_sample_rate),
+        channels_(channels) {
+    int g = std::gcd(input_sample_rate, output_sample_rate);
+    up_ = output_sample_rate / g;
+    down_ = input_sample_rate / g;
+    num_phases_ = std::min(up_, MAX_PHASES);
+
+    int taps = quality == AudioResamplerQuality::kLow      ? 16
+               : quality == AudioResamplerQuality::kMedium ? 32
+                                                           : 64;
+    // ダウンサンプリングの場合はカットオフ周波数が下がるので、その分タップ数を増やして遷移帯域の幅を保つ
+    double cutoff = 1.0;
+    if (output_sample_rate < input_sample_rate) {
+      cutoff = (double)output_sample_rate / input_sample_rate;
+      taps = (int)ceil(taps / cutoff);
+    }
+    taps_ = (taps + 3) / 4 * 4;
+    // 通過帯域の端で少し減衰させて、エイリアシングを抑える
+    cutoff *= quality == AudioResamplerQuality::kLow ? 0.85 : 0.92;
+
+    // 位相が num_phases_ に丸められた場合に備えて 1 つ多く作っておく
+    coefs_.resize((num_phases_ + 1) * taps_);
+    for (int p = 0; p <= num_phases_; p++) {
+      double frac = (double)p / num_phases_;
+      float* coef = coefs_.data() + p * taps_;
+      double sum = 0.0;
+      for (int j = 0; j < taps_; j++) {
+        // フィルタの中心からの距離
+        double x = j - (taps_ / 2 - 1) - frac;
+        double s = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+        // Blackman 窓
+        double w = 0.42 + 0.5 * cos(2 * M_PI * x / taps_) +
+                   0.08 * cos(4 * M_PI * x / taps_);
+        coef[j] = (float)(s * w);
+        sum += coef[j];
+      }
+      // DC ゲインを 1 にする
+      for (int j = 0; j < taps_; j++) {
+        coef[j] = (float)(coef[j] / sum);
+      }
+    }
+
+    history_.resize(channels_);
+    Reset();
+  }
+
+  int GetInputSampleRate() const override { return input_sample_rate_; }
+  int GetOutputSampleRate() const override { return output_sample_rate_; }
+  int GetChannels() const override { return channels_; }
+
+  int GetMaxOutputSamples(int input_samples) const override {
+    return (int)((int64_t)(input_samples + taps_) * up_ / down_) + 1;
+  }
+
+  int Resample(const float* input, int input_samples, float* output) override {
+    // 入力をチャンネルごとに分けて、前回の残りの後ろに追加する
+    int base = (int)history_[0].size();
+    for (int c = 0; c < channels_; c++) {
+      auto& h = history_[c];
+      h.resize(base + input_samples);
+      float* dst = h.data() + base;
+      if (channels_ == 1) {
+        memcpy(dst, input, input_samples * sizeof(float));
+      } else {
+        for (int i = 0; i < input_samples; i++) {
+          dst[i] = input[i * channels_ + c];
+        }
+      }
+    }
+
+    int available = base + input_samples;
+    int n = 0;
+    while (pos_ + taps_ <= available) {
+      int phase_index =
+          num_phases_ == up_
+              ? phase_
+              : (int)(((int64_t)phase_ * num_phases_ + up_ / 2) / up_);
+      const float* coef = coefs_.data() + phase_index * taps_;
+      for (int c = 0; c < channels_; c++) {
+        output[n * channels_ + c] =
+            Dot(history_[c].data() + pos_, coef, taps_);
+      }
+      n++;
+
+      phase_ += down_;
+      pos_ += phase_ / up_;
+      phase_ %= up_;
+    }
+
+    // 使い終わったサンプルを捨てる
+    int consumed = std::min(pos_, available);
+    for (auto& h : history_) {
+      h.erase(h.begin(), h.begin() + consumed);
+    }
+    pos_ -= consumed;
+
+    return n;
+  }
+
+  void Reset() override {
+    // 最初の出力からフィルタ全体を使えるように無音で埋めておく
+    for (auto& h : history_) {
+      h.assign(taps_ - 1, 0.0f);
+    }
+    pos_ = 0;
+    phase_ = 0;
+  }
+
+ private:
+  int input_sample_rate_;
+  int output_sample_rate_;
+  int channels_;
+
+  int up_;
+  int down_;
+  int num_phases_;
+  int taps_;
+  std::vector<float> coefs_;
+
+  // チャンネルごとの未処理の入力サンプル
+  std::vector<std::vector<float>> history_;
+  // 次の出力サンプルで使う history_ 上の位置
+  int pos_;
+  // 次の出力サンプルの位相 [0, up_)
+  int phase_;
+};
+
+std::shared_ptr<AudioResampler> CreateAudioResampler(
+    int input_sample_rate,
+    int output_sample_rate,
+    int channels,
+    AudioResamplerQuality quality) {
+  return std::make_shared<PolyphaseAudioResampler>(
+      input_sample_rate, output_sample_rate, channels, quality);
+}
+
+}  // namespace sorac
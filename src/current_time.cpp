@@ -2,6 +2,7 @@
 
 // Linux
 #include <sys/time.h>
+#include <time.h>
 
 namespace sorac {
 
@@ -12,4 +13,23 @@ std::chrono::microseconds get_current_time() {
                                    time.tv_usec);
 }
 
+std::chrono::microseconds get_monotonic_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return std::chrono::microseconds(uint64_t(ts.tv_sec) * 1000 * 1000 +
+                                   ts.tv_nsec / 1000);
+}
+
+std::chrono::microseconds monotonic_to_current_time(
+    std::chrono::microseconds monotonic_time) {
+  // 2 つの時計の差を毎回測る。
+  // 時刻合わせで get_current_time() が変わっても追従できるようにするため。
+  // 間に割り込まれると差がずれるので、前後で CLOCK_MONOTONIC を読んで中間を使う。
+  auto m1 = get_monotonic_time();
+  auto now = get_current_time();
+  auto m2 = get_monotonic_time();
+  auto offset = now - (m1 + (m2 - m1) / 2);
+  return monotonic_time + offset;
+}
+
 }  // namespace sorac
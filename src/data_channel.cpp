@@ -21,7 +21,12 @@ class DataChannelImpl : public DataChannel {
     } else {
       data.assign((const std::byte*)buf, (const std::byte*)buf + size);
     }
-    return dc_->send(data);
+    try {
+      return dc_->send(data);
+    } catch (const std::exception& e) {
+      // 再接続などで既に閉じている DataChannel に送った場合は例外になる
+      return false;
+    }
   }
 
   void SetOnOpen(std::function<void()> on_open) override {
@@ -0,0 +1,200 @@
+#include "sorac/delay_based_bwe.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+// plog
+#include <plog/Log.h>
+
+#include "sorac/current_time.hpp"
+
+namespace sorac {
+
+// この時間内に送信されたパケットは 1 つのグループとして扱う
+static const std::chrono::milliseconds BURST_INTERVAL(5);
+// trendline filter のパラメータ
+static const size_t TRENDLINE_WINDOW_SIZE = 20;
+static const double TRENDLINE_SMOOTHING = 0.9;
+static const double TRENDLINE_GAIN = 4.0;
+static const int MAX_NUM_DELTAS = 60;
+// 閾値の適応のパラメータ
+static const double THRESHOLD_K_UP = 0.0087;
+static const double THRESHOLD_K_DOWN = 0.039;
+static const double MIN_THRESHOLD = 6.0;
+static const double MAX_THRESHOLD = 600.0;
+// この時間以上閾値を超え続けたら overuse とみなす
+static const std::chrono::milliseconds OVERUSE_TIME(10);
+// overuse 時は受信レートのこの割合まで下げる
+static const double DECREASE_FACTOR = 0.85;
+// normal 時は 1 秒あたりこの割合で上げる
+static const double INCREASE_FACTOR_PER_SECOND = 1.08;
+// 受信レートを計測する期間
+static const std::chrono::milliseconds ACKED_WINDOW(500);
+
+DelayBasedBwe::DelayBasedBwe(Bps initial_bitrate,
+                             Bps min_bitrate,
+                             Bps max_bitrate)
+    : min_bitrate_(min_bitrate),
+      max_bitrate_(max_bitrate),
+      estimate_(initial_bitrate) {}
+
+Bps DelayBasedBwe::OnFeedback(
+    const std::vector<TransportCcPacketResult>& results) {
+  auto now = get_current_time();
+  for (const auto& r : results) {
+    if (!r.arrival_time) {
+      continue;
+    }
+    acked_.push_back(std::make_pair(*r.arrival_time, r.size));
+
+    // 送信時刻が近いパケットをまとめる
+    if (current_group_ &&
+        r.send_time - current_group_->first_send_time <= BURST_INTERVAL) {
+      current_group_->last_send_time =
+          std::max(current_group_->last_send_time, r.send_time);
+      current_group_->last_arrival_time =
+          std::max(current_group_->last_arrival_time, *r.arrival_time);
+      current_group_->size += r.size;
+      continue;
+    }
+    if (current_group_) {
+      OnPacketGroup(*current_group_, now);
+    }
+    current_group_ =
+        PacketGroup{r.send_time, r.send_time, *r.arrival_time, r.size};
+  }
+  while (!acked_.empty() &&
+         acked_.back().first - acked_.front().first > ACKED_WINDOW) {
+    acked_.pop_front();
+  }
+  UpdateEstimate(now);
+  return estimate_;
+}
+
+void DelayBasedBwe::OnPacketGroup(const PacketGroup& group,
+                                  std::chrono::microseconds now) {
+  if (!prev_group_) {
+    prev_group_ = group;
+    return;
+  }
+  // グループ間の、到着間隔と送信間隔の差が遅延の変化量になる
+  double send_delta_ms =
+      (group.last_send_time - prev_group_->last_send_time).count() / 1000.0;
+  double arrival_delta_ms =
+      (group.last_arrival_time - prev_group_->last_arrival_time).count() /
+      1000.0;
+  prev_group_ = group;
+  if (send_delta_ms < 0) {
+    // 送信順が入れ替わっている
+    return;
+  }
+
+  if (!first_arrival_time_) {
+    first_arrival_time_ = group.last_arrival_time;
+  }
+  num_deltas_ = std::min(num_deltas_ + 1, MAX_NUM_DELTAS);
+  accumulated_delay_ms_ += arrival_delta_ms - send_delta_ms;
+  smoothed_delay_ms_ = TRENDLINE_SMOOTHING * smoothed_delay_ms_ +
+                       (1 - TRENDLINE_SMOOTHING) * accumulated_delay_ms_;
+  double x = (group.last_arrival_time - *first_arrival_time_).count() / 1000.0;
+  delay_history_.push_back(std::make_pair(x, smoothed_delay_ms_));
+  if (delay_history_.size() > TRENDLINE_WINDOW_SIZE) {
+    delay_history_.pop_front();
+  }
+  if (delay_history_.size() < TRENDLINE_WINDOW_SIZE) {
+    return;
+  }
+
+  // 遅延の傾きを最小二乗法で求める
+  double sum_x = 0, sum_y = 0;
+  for (const auto& [x, y] : delay_history_) {
+    sum_x += x;
+    sum_y += y;
+  }
+  double avg_x = sum_x / delay_history_.size();
+  double avg_y = sum_y / delay_history_.size();
+  double num = 0, den = 0;
+  for (const auto& [x, y] : delay_history_) {
+    num += (x - avg_x) * (y - avg_y);
+    den += (x - avg_x) * (x - avg_x);
+  }
+  if (den == 0) {
+    return;
+  }
+  double trend = num / den * num_deltas_ * TRENDLINE_GAIN;
+
+  if (trend > threshold_) {
+    if (!overuse_start_) {
+      overuse_start_ = now;
+    }
+    if (now - *overuse_start_ >= OVERUSE_TIME && trend >= prev_trend_) {
+      usage_ = Usage::kOverusing;
+    }
+  } else if (trend < -threshold_) {
+    overuse_start_ = std::nullopt;
+    usage_ = Usage::kUnderusing;
+  } else {
+    overuse_start_ = std::nullopt;
+    usage_ = Usage::kNormal;
+  }
+  prev_trend_ = trend;
+  UpdateThreshold(trend, now);
+}
+
+void DelayBasedBwe::UpdateThreshold(double trend,
+                                    std::chrono::microseconds now) {
+  if (!last_threshold_update_) {
+    last_threshold_update_ = now;
+  }
+  // 急激な変化には追従しない
+  if (fabs(trend) > threshold_ + 15.0) {
+    last_threshold_update_ = now;
+    return;
+  }
+  double k = fabs(trend) < threshold_ ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+  double dt_ms = std::min<double>(
+      (now - *last_threshold_update_).count() / 1000.0, 100.0);
+  threshold_ += k * (fabs(trend) - threshold_) * dt_ms;
+  threshold_ = std::clamp(threshold_, MIN_THRESHOLD, MAX_THRESHOLD);
+  last_threshold_update_ = now;
+}
+
+void DelayBasedBwe::UpdateEstimate(std::chrono::microseconds now) {
+  double elapsed = last_update_ ? (now - *last_update_).count() / 1e6 : 0.0;
+  last_update_ = now;
+
+  std::optional<Bps> acked_bitrate;
+  if (acked_.size() >= 2) {
+    auto duration = acked_.back().first - acked_.front().first;
+    if (duration.count() > 0) {
+      size_t bytes = 0;
+      for (const auto& a : acked_) {
+        bytes += a.second;
+      }
+      acked_bitrate = Bps(bytes * 8 * 1000 * 1000 / duration.count());
+    }
+  }
+
+  auto prev = estimate_;
+  if (usage_ == Usage::kOverusing) {
+    if (acked_bitrate) {
+      estimate_ = std::min(
+          estimate_, Bps((int64_t)(acked_bitrate->count() * DECREASE_FACTOR)));
+    }
+  } else if (usage_ == Usage::kNormal) {
+    estimate_ = Bps((int64_t)(estimate_.count() *
+                              pow(INCREASE_FACTOR_PER_SECOND, elapsed)));
+    // 実際に送れている量から大きく離れないようにする
+    if (acked_bitrate) {
+      estimate_ = std::min(
+          estimate_, Bps((int64_t)(acked_bitrate->count() * 1.5 + 10000)));
+    }
+  }
+  estimate_ = std::clamp(estimate_, min_bitrate_, max_bitrate_);
+  if (estimate_ != prev) {
+    PLOG_VERBOSE << "Bandwidth estimate: " << prev.count() << " -> "
+                 << estimate_.count() << " bps";
+  }
+}
+
+}  // namespace sorac
@@ -0,0 +1,177 @@
+#include "sorac/flexfec_media_handler.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+// SIMD
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// plog
+#include <plog/Log.h>
+
+#include "rtp_util.hpp"
+#include "sorac/current_time.hpp"
+#include "util.hpp"
+
+namespace sorac {
+
+// 1 つの FEC パケットで保護できるパケットの最大数。
+// 15 を超えるとマスクが長くなってヘッダが大きくなるので、ここで打ち切る。
+static const size_t MAX_GROUP_SIZE = 15;
+// SSRC が 1 つで、マスクが 15 bit の場合の FlexFEC ヘッダのサイズ
+static const size_t FLEXFEC_HEADER_SIZE = 20;
+// フレームの途中でパケットが途切れた場合に、グループを古いとみなして FEC を生成するまでの時間
+static const std::chrono::milliseconds MAX_GROUP_DURATION(20);
+
+// dst ^= src
+static void XorBlock(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+#if defined(__ARM_NEON)
+  for (; i + 16 <= size; i += 16) {
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+  }
+#elif defined(__SSE2__)
+  for (; i + 16 <= size; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(a, b));
+  }
+#endif
+  for (; i < size; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+FlexfecMediaHandler::FlexfecMediaHandler(
+    const FlexfecMediaHandlerConfig& config)
+    : config_(config),
+      protection_percent_(config.protection_percent),
+      sequence_number_((uint16_t)generate_random_number(UINT16_MAX)) {
+  group_.reserve(MAX_GROUP_SIZE);
+}
+
+void FlexfecMediaHandler::SetPacketLossRate(float loss_rate) {
+  // 失ったパケットを十分復元できるように、パケットロス率の倍くらいの FEC パケットを送る
+  int percent = config_.protection_percent + (int)(loss_rate * 200.0f);
+  protection_percent_ = std::clamp(percent, config_.protection_percent,
+                                   config_.max_protection_percent);
+}
+
+void FlexfecMediaHandler::outgoing(rtc::message_vector& messages,
+                                   const rtc::message_callback& send) {
+  auto now = get_current_time();
+  rtc::message_vector result;
+  result.reserve(messages.size() + MAX_GROUP_SIZE);
+  // 前回の呼び出しから持ち越したグループが古くなっていたら、後続のパケットを待たずに FEC を生成する
+  if (!group_.empty() && now - group_start_time_ >= MAX_GROUP_DURATION) {
+    GenerateFec(result);
+  }
+  for (auto& message : messages) {
+    result.push_back(message);
+    if (message->type == rtc::Message::Control) {
+      continue;
+    }
+    const uint8_t* buf = (const uint8_t*)message->data();
+    if (get_rtp_header_size(buf, message->size()) == 0 ||
+        get_rtp_ssrc(buf) != config_.ssrc) {
+      continue;
+    }
+    // シーケンス番号が連続していない場合は、そこまでで一旦 FEC を生成する
+    if (!group_.empty() &&
+        get_rtp_sequence_number(buf) !=
+            (uint16_t)(get_rtp_sequence_number(
+                           (const uint8_t*)group_.back()->data()) +
+                       1)) {
+      GenerateFec(result);
+    }
+    if (group_.empty()) {
+      group_start_time_ = now;
+    }
+    // 送信したパケットは後続の MediaHandler やトランスポートで書き換えられる可能性があるので、
+    // 次の呼び出しまで持ち越せるようにコピーしておく
+    group_.push_back(rtc::make_message(message->begin(), message->end()));
+    // グループが一杯になったか、フレームの最後のパケットなら FEC を生成する。
+    // 次のフレームを待つと、レイヤーが止まったりフレームがスキップされた時に
+    // 最後のフレームが保護されないままになるので、フレームごとに区切る。
+    // 小さいフレームでも FEC の割合は fec_credit_ で平均されるので大きくなりすぎない。
+    bool marker = (buf[1] & 0x80) != 0;
+    if (group_.size() >= MAX_GROUP_SIZE || marker) {
+      GenerateFec(result);
+    }
+  }
+  messages.swap(result);
+}
+
+void FlexfecMediaHandler::GenerateFec(rtc::message_vector& messages) {
+  size_t k = group_.size();
+  // 切り上げると小さいグループで割合が大きくなりすぎるので、
+  // 端数は次のグループに持ち越して、平均して protection_percent_ になるようにする
+  fec_credit_ += k * protection_percent_ / 100.0;
+  size_t m = std::min((size_t)fec_credit_, k);
+  fec_credit_ = std::min(fec_credit_ - m, 1.0);
+  if (m == 0) {
+    group_.clear();
+    return;
+  }
+
+  const uint8_t* first = (const uint8_t*)group_.front()->data();
+  const uint8_t* last = (const uint8_t*)group_.back()->data();
+  uint16_t base_seq = get_rtp_sequence_number(first);
+
+  // j 番目の FEC パケットは、i % m == j となる i 番目のメディアパケットを保護する
+  for (size_t j = 0; j < m; j++) {
+    size_t max_size = 0;
+    for (size_t i = j; i < k; i += m) {
+      max_size = std::max(max_size, group_[i]->size() - RTP_FIXED_HEADER_SIZE);
+    }
+
+    auto fec = rtc::make_message(RTP_FIXED_HEADER_SIZE + FLEXFEC_HEADER_SIZE +
+                                 max_size);
+    uint8_t* p = (uint8_t*)fec->data();
+    memset(p, 0, fec->size());
+
+    // RTP ヘッダ
+    p[0] = 0x80;
+    p[1] = (uint8_t)(config_.payload_type & 0x7f);
+    write_u16(p + 2, sequence_number_++);
+    memcpy(p + 4, last + 4, 4);
+    write_u32(p + 8, config_.fec_ssrc);
+
+    // 保護するパケットのヘッダとペイロードを XOR する
+    uint8_t* h = p + RTP_FIXED_HEADER_SIZE;
+    uint8_t* payload = h + FLEXFEC_HEADER_SIZE;
+    uint16_t mask = 0;
+    for (size_t i = j; i < k; i += m) {
+      const uint8_t* src = (const uint8_t*)group_[i]->data();
+      size_t size = group_[i]->size() - RTP_FIXED_HEADER_SIZE;
+      h[0] ^= src[0];
+      h[1] ^= src[1];
+      write_u16(h + 2, read_u16(h + 2) ^ (uint16_t)size);
+      write_u32(h + 4, read_u32(h + 4) ^ read_u32(src + 4));
+      XorBlock(payload, src + RTP_FIXED_HEADER_SIZE, size);
+      mask |= 1 << (14 - i);
+    }
+
+    // FlexFEC ヘッダ
+    // R, F ビットは 0
+    h[0] &= 0x3f;
+    // SSRCCount
+    h[8] = 1;
+    write_u32(h + 12, config_.ssrc);
+    write_u16(h + 16, base_seq);
+    // k ビットを立てて、マスクが 15 bit で終わることを示す
+    write_u16(h + 18, 0x8000 | mask);
+
+    if (config_.transport_cc != nullptr) {
+      config_.transport_cc->Stamp(*fec);
+    }
+    messages.push_back(fec);
+  }
+  group_.clear();
+}
+
+}  // namespace sorac
@@ -0,0 +1,176 @@
+#include "h264_util.hpp"
+
+#include <vector>
+
+namespace sorac {
+
+// ヘッダの解析に必要な分だけ RBSP に変換する
+static const size_t MAX_HEADER_RBSP_SIZE = 64;
+
+namespace {
+
+// エミュレーション防止バイトを取り除いた RBSP を読むためのビットリーダー
+class BitReader {
+ public:
+  BitReader(const uint8_t* nal, size_t size) {
+    // 先頭の NAL ヘッダ (1 バイト) は読み飛ばす
+    int zeros = 0;
+    for (size_t i = 1; i < size && rbsp_.size() < MAX_HEADER_RBSP_SIZE; i++) {
+      if (zeros >= 2 && nal[i] == 0x03) {
+        zeros = 0;
+        continue;
+      }
+      zeros = nal[i] == 0 ? zeros + 1 : 0;
+      rbsp_.push_back(nal[i]);
+    }
+  }
+
+  bool ReadBits(int n, uint32_t& v) {
+    v = 0;
+    for (int i = 0; i < n; i++) {
+      if (pos_ >= rbsp_.size() * 8) {
+        return false;
+      }
+      v = (v << 1) | ((rbsp_[pos_ / 8] >> (7 - pos_ % 8)) & 1);
+      pos_ += 1;
+    }
+    return true;
+  }
+
+  // 指数ゴロム符号 ue(v)
+  bool ReadUe(uint32_t& v) {
+    int leading_zeros = 0;
+    uint32_t bit;
+    while (true) {
+      if (!ReadBits(1, bit)) {
+        return false;
+      }
+      if (bit == 1) {
+        break;
+      }
+      leading_zeros += 1;
+      if (leading_zeros > 31) {
+        return false;
+      }
+    }
+    uint32_t rest;
+    if (!ReadBits(leading_zeros, rest)) {
+      return false;
+    }
+    v = (1u << leading_zeros) - 1 + rest;
+    return true;
+  }
+
+ private:
+  std::vector<uint8_t> rbsp_;
+  size_t pos_ = 0;
+};
+
+}  // namespace
+
+int get_h264_nal_type(const uint8_t* nal) {
+  return nal[0] & 0x1f;
+}
+
+void for_each_h264_nal(
+    const uint8_t* buf,
+    size_t size,
+    const std::function<void(const uint8_t* nal, size_t size)>& f) {
+  // スタートコード (00 00 01 または 00 00 00 01) の直後の位置を探す
+  auto find_nal_start = [buf, size](size_t pos) -> size_t {
+    for (size_t i = pos; i + 3 <= size; i++) {
+      if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1) {
+        return i + 3;
+      }
+    }
+    return size;
+  };
+  size_t start = find_nal_start(0);
+  while (start < size) {
+    size_t next = find_nal_start(start);
+    size_t end = next;
+    if (next < size) {
+      // 次のスタートコードの分を戻す
+      end = next - 3;
+      if (end > start && buf[end - 1] == 0) {
+        end -= 1;
+      }
+    }
+    if (end > start) {
+      f(buf + start, end - start);
+    }
+    start = next;
+  }
+}
+
+std::optional<int> parse_h264_sps_log2_max_frame_num(const uint8_t* nal,
+                                                     size_t size) {
+  if (size < 1 || get_h264_nal_type(nal) != H264_NAL_TYPE_SPS) {
+    return std::nullopt;
+  }
+  BitReader r(nal, size);
+  uint32_t profile_idc, constraint_flags, level_idc, sps_id;
+  if (!r.ReadBits(8, profile_idc) || !r.ReadBits(8, constraint_flags) ||
+      !r.ReadBits(8, level_idc) || !r.ReadUe(sps_id)) {
+    return std::nullopt;
+  }
+  // High プロファイル以上の場合は chroma_format_idc などが入っている
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+      profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+      profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
+      profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+      profile_idc == 135) {
+    uint32_t chroma_format_idc, v;
+    if (!r.ReadUe(chroma_format_idc)) {
+      return std::nullopt;
+    }
+    if (chroma_format_idc == 3 && !r.ReadBits(1, v)) {
+      return std::nullopt;
+    }
+    uint32_t bit_depth_luma, bit_depth_chroma, qpprime, scaling_matrix;
+    if (!r.ReadUe(bit_depth_luma) || !r.ReadUe(bit_depth_chroma) ||
+        !r.ReadBits(1, qpprime) || !r.ReadBits(1, scaling_matrix)) {
+      return std::nullopt;
+    }
+    if (scaling_matrix != 0) {
+      return std::nullopt;
+    }
+  }
+  uint32_t log2_max_frame_num_minus4;
+  if (!r.ReadUe(log2_max_frame_num_minus4) || log2_max_frame_num_minus4 > 12) {
+    return std::nullopt;
+  }
+  return (int)log2_max_frame_num_minus4 + 4;
+}
+
+std::optional<H264SliceHeader> parse_h264_slice_header(const uint8_t* nal,
+                                                       size_t size,
+                                                       int log2_max_frame_num) {
+  if (size < 1) {
+    return std::nullopt;
+  }
+  int nal_type = get_h264_nal_type(nal);
+  if (nal_type != H264_NAL_TYPE_SLICE && nal_type != H264_NAL_TYPE_IDR) {
+    return std::nullopt;
+  }
+  BitReader r(nal, size);
+  uint32_t first_mb_in_slice, slice_type, pps_id, frame_num;
+  if (!r.ReadUe(first_mb_in_slice) || !r.ReadUe(slice_type) ||
+      !r.ReadUe(pps_id) || !r.ReadBits(log2_max_frame_num, frame_num)) {
+    return std::nullopt;
+  }
+  H264SliceHeader header;
+  header.idr = nal_type == H264_NAL_TYPE_IDR;
+  header.frame_num = (int)frame_num;
+  header.idr_pic_id = 0;
+  if (header.idr) {
+    uint32_t idr_pic_id;
+    if (!r.ReadUe(idr_pic_id)) {
+      return std::nullopt;
+    }
+    header.idr_pic_id = (int)idr_pic_id;
+  }
+  return header;
+}
+
+}  // namespace sorac
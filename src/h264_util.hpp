@@ -0,0 +1,45 @@
+#ifndef SORAC_H264_UTIL_HPP_
+#define SORAC_H264_UTIL_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <optional>
+
+namespace sorac {
+
+static const int H264_NAL_TYPE_SLICE = 1;
+static const int H264_NAL_TYPE_IDR = 5;
+static const int H264_NAL_TYPE_SPS = 7;
+static const int H264_NAL_TYPE_PPS = 8;
+
+int get_h264_nal_type(const uint8_t* nal);
+
+// Annex B 形式のバッファを NAL ユニットごとに分けて f を呼ぶ。
+// f に渡す NAL ユニットにスタートコードは含まない。
+// スタートコードの形式は同じなので H.265 でも使える。
+void for_each_h264_nal(
+    const uint8_t* buf,
+    size_t size,
+    const std::function<void(const uint8_t* nal, size_t size)>& f);
+
+// SPS の log2_max_frame_num を返す。
+// スケーリングリストを含む SPS など、扱えない場合は nullopt を返す。
+std::optional<int> parse_h264_sps_log2_max_frame_num(const uint8_t* nal,
+                                                     size_t size);
+
+struct H264SliceHeader {
+  bool idr;
+  int frame_num;
+  // IDR の場合だけ有効
+  int idr_pic_id;
+};
+// スライスヘッダの先頭から frame_num と idr_pic_id までを読む。
+// frame_mbs_only_flag = 1 かつ separate_colour_plane_flag = 0 の SPS を前提にしている。
+std::optional<H264SliceHeader> parse_h264_slice_header(const uint8_t* nal,
+                                                       size_t size,
+                                                       int log2_max_frame_num);
+
+}  // namespace sorac
+
+#endif
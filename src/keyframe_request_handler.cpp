@@ -0,0 +1,114 @@
+#include "sorac/keyframe_request_handler.hpp"
+
+// plog
+#include <plog/Log.h>
+
+#include "rtp_util.hpp"
+#include "sorac/current_time.hpp"
+
+namespace sorac {
+
+// Payload-specific feedback の FMT
+static const int RTCP_PSFB_FMT_PLI = 1;
+static const int RTCP_PSFB_FMT_FIR = 4;
+// FIR の FCI は SSRC (32bit), Seq nr. (8bit), Reserved (24bit)
+static const size_t RTCP_FIR_FCI_SIZE = 8;
+
+KeyframeRequestHandler::KeyframeRequestHandler(
+    const KeyframeRequestHandlerConfig& config)
+    : config_(config) {}
+
+void KeyframeRequestHandler::incoming(rtc::message_vector& messages,
+                                      const rtc::message_callback& send) {
+  bool requested = false;
+  for (const auto& message : messages) {
+    if (message->type != rtc::Message::Control) {
+      continue;
+    }
+    for_each_rtcp_packet(
+        (const uint8_t*)message->data(), message->size(),
+        [this, &requested](const uint8_t* p, size_t size) {
+          int fmt = p[0] & 0x1f;
+          if (p[1] != RTCP_PT_PSFB || size < RTCP_HEADER_SIZE + 8) {
+            return;
+          }
+          if (fmt == RTCP_PSFB_FMT_PLI) {
+            uint32_t media_ssrc = read_u32(p + 8);
+            if (media_ssrc != config_.ssrc) {
+              return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.pli_count += 1;
+            pending_count_ += 1;
+            requested = true;
+          } else if (fmt == RTCP_PSFB_FMT_FIR) {
+            // FIR はヘッダの media source SSRC を使わず、FCI に対象の SSRC が並んでいる
+            for (size_t offset = RTCP_HEADER_SIZE + 8;
+                 offset + RTCP_FIR_FCI_SIZE <= size;
+                 offset += RTCP_FIR_FCI_SIZE) {
+              if (read_u32(p + offset) != config_.ssrc) {
+                continue;
+              }
+              std::lock_guard<std::mutex> lock(mutex_);
+              stats_.fir_count += 1;
+              pending_count_ += 1;
+              requested = true;
+            }
+          }
+        });
+  }
+  if (!requested) {
+    return;
+  }
+
+  auto now = get_current_time();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pending_since_) {
+      pending_since_ = now;
+    }
+  }
+  if (TakePendingRequest(now)) {
+    config_.on_keyframe_request();
+  }
+}
+
+void KeyframeRequestHandler::outgoing(rtc::message_vector& messages,
+                                      const rtc::message_callback& send) {
+  if (TakePendingRequest(get_current_time())) {
+    config_.on_keyframe_request();
+  }
+}
+
+KeyframeRequestHandlerStats KeyframeRequestHandler::GetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+bool KeyframeRequestHandler::TakePendingRequest(std::chrono::microseconds now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pending_since_) {
+    return false;
+  }
+  if (now - *pending_since_ < config_.coalesce_window) {
+    return false;
+  }
+  if (last_request_time_ && now - *last_request_time_ < config_.min_interval) {
+    return false;
+  }
+  pending_since_ = std::nullopt;
+  last_request_time_ = now;
+  stats_.keyframe_request_count += 1;
+  // 保留していた要求は 1 回の要求にまとめたので、残りは要求しなかった分として数える
+  stats_.keyframe_request_dropped_count += pending_count_ - 1;
+  pending_count_ = 0;
+  PLOG_DEBUG << "Request keyframe: ssrc=" << config_.ssrc
+             << " pli_count=" << stats_.pli_count
+             << " fir_count=" << stats_.fir_count
+             << " keyframe_request_count=" << stats_.keyframe_request_count
+             << " keyframe_request_dropped_count="
+             << stats_.keyframe_request_dropped_count;
+  return true;
+}
+
+}  // namespace sorac
@@ -2,7 +2,9 @@
 
 #include <string.h>
 #include <atomic>
+#include <deque>
 #include <exception>
+#include <optional>
 
 // Linux
 #include <dlfcn.h>
@@ -16,8 +18,23 @@
 #include <wels/codec_def.h>
 #include <wels/codec_ver.h>
 
+#include "h264_util.hpp"
+#include "sorac/current_time.hpp"
+
 namespace sorac {
 
+// EncodedImage::NalSeparator::kLength の長さのバイト数
+static const int NAL_LENGTH_SIZE = 4;
+// LTR を使う場合に、何フレームごとに LTR としてマークするか
+static const int LTR_MARK_PERIOD = 30;
+// エンコードしてからこの時間内に回復の要求 (RequestLossRecovery) が来なければ、受信側に届いたとみなす
+static const std::chrono::milliseconds LTR_CONFIRM_DELAY =
+    std::chrono::milliseconds(500);
+// LTR で回復しようとしてからこの時間内に再度回復の要求が来たら、
+// 回復できなかったとみなして IDR を送る
+static const std::chrono::milliseconds LTR_RECOVERY_TIMEOUT =
+    std::chrono::milliseconds(1000);
+
 class OpenH264VideoEncoder : public VideoEncoder {
  public:
   OpenH264VideoEncoder(const std::string& openh264) {
@@ -32,6 +49,7 @@ class OpenH264VideoEncoder : public VideoEncoder {
   }
 
   void ForceIntraNextFrame() override { next_iframe_ = true; }
+  void RequestLossRecovery() override { next_loss_recovery_ = true; }
 
   bool InitEncode(const Settings& settings) override {
     Release();
@@ -96,6 +114,16 @@ class OpenH264VideoEncoder : public VideoEncoder {
     encoder_params.sSpatialLayers[0].sSliceArgument.uiSliceMode =
         SM_FIXEDSLCNUM_SLICE;
 
+    loss_recovery_ = settings.loss_recovery;
+    ResetLtrState();
+    if (loss_recovery_ == Settings::LossRecovery::kLongTermReference) {
+      // パケットロスからの回復時に IDR を送る代わりに、受信側に届いている LTR を参照した
+      // P フレームを送れるようにする
+      encoder_params.bEnableLongTermReference = true;
+      encoder_params.iLTRRefNum = 1;
+      encoder_params.iLtrMarkPeriod = LTR_MARK_PERIOD;
+    }
+
     // Initialize.
     if (encoder_->InitializeExt(&encoder_params) != 0) {
       //RTC_LOG(LS_ERROR) << "Failed to initialize OpenH264 encoder";
@@ -133,8 +161,30 @@ class OpenH264VideoEncoder : public VideoEncoder {
     pic.pData[1] = frame.i420_buffer->u.get();
     pic.pData[2] = frame.i420_buffer->v.get();
 
+    int64_t bitrate = next_bitrate_bps_.exchange(0);
+    if (bitrate > 0) {
+      SBitrateInfo info = {};
+      info.iLayer = SPATIAL_LAYER_ALL;
+      info.iBitrate = (int)bitrate;
+      if (encoder_->SetOption(ENCODER_OPTION_BITRATE, &info) != 0) {
+        PLOG_WARNING << "Failed to set bitrate: bitrate=" << bitrate;
+      }
+    }
+
+    auto now = get_current_time();
+    // キーフレーム要求 (PLI/FIR) は、新しく参加した受信者のように LTR を持っていない
+    // 受信側からも来るので、常に IDR にする。
+    // LTR で回復するのは RequestLossRecovery() で要求された場合だけ。
     bool send_key_frame = next_iframe_.exchange(false);
-    if (send_key_frame) {
+    bool loss_recovery = next_loss_recovery_.exchange(false);
+    bool ltr_recovery = false;
+    // LTR での回復がスキップされた場合に、失敗したとみなさないように戻すための値
+    auto prev_recovery_time = last_recovery_time_;
+    int prev_recovery_frame_num = last_recovery_frame_num_;
+    if (!send_key_frame && loss_recovery) {
+      ltr_recovery = RequestLtrRecovery(now);
+    }
+    if (send_key_frame || (loss_recovery && !ltr_recovery)) {
       PLOG_DEBUG << "KeyFrame generated";
       encoder_->ForceIntraFrame(true);
     }
@@ -149,32 +199,96 @@ class OpenH264VideoEncoder : public VideoEncoder {
       return;
     }
 
-    // SFrameBSInfo から EncodedImage にコピーする
+    // レート制御でフレームがスキップされた場合は、バッファを確保せずに通知だけする
+    if (info.eFrameType == videoFrameTypeSkip) {
+      PLOG_DEBUG << "OpenH264 skipped frame: timestamp="
+                 << frame.timestamp.count();
+      // キーフレームや回復の要求を次のフレームに持ち越す
+      if (send_key_frame) {
+        next_iframe_ = true;
+      }
+      if (loss_recovery) {
+        next_loss_recovery_ = true;
+      }
+      if (ltr_recovery) {
+        // 回復用のフレームは送っていないので、次のフレームで改めて LTR での回復を要求する。
+        // そのままだと LTR_RECOVERY_TIMEOUT 内の再要求として IDR になってしまう。
+        last_recovery_time_ = prev_recovery_time;
+        last_recovery_frame_num_ = prev_recovery_frame_num;
+      }
+      EncodedImage skipped;
+      skipped.buf = nullptr;
+      skipped.size = 0;
+      skipped.timestamp = frame.timestamp;
+      skipped.frame_type = EncodedImage::FrameType::kSkip;
+      callback_(skipped);
+      return;
+    }
+
+    // SFrameBSInfo から EncodedImage にコピーする。
+    // NAL ユニットの長さは分かっているので、コピーする時にスタートコードを長さに置き換えて、
+    // パケタイザがスタートコードを探さなくて済むようにする。
     EncodedImage encoded;
     int size = 0;
+    int nal_count = 0;
     for (int i = 0; i < info.iLayerNum; ++i) {
       const SLayerBSInfo& layer = info.sLayerInfo[i];
+      const uint8_t* p = layer.pBsBuf;
       for (int j = 0; j < layer.iNalCount; ++j) {
-        size += layer.pNalLengthInByte[j];
+        // pNalLengthInByte はスタートコードを含んだ長さ
+        int nal_size = layer.pNalLengthInByte[j];
+        size += NAL_LENGTH_SIZE + nal_size - get_start_code_size(p, nal_size);
+        p += nal_size;
       }
+      nal_count += layer.iNalCount;
     }
     encoded.buf.reset(new uint8_t[size]);
     encoded.size = size;
-    int offset = 0;
+    encoded.nal_separator = EncodedImage::NalSeparator::kLength;
+    encoded.nal_units.reserve(nal_count);
+    uint8_t* dst = encoded.buf.get();
     for (int i = 0; i < info.iLayerNum; ++i) {
       const SLayerBSInfo& layer = info.sLayerInfo[i];
-      int n = 0;
+      const uint8_t* p = layer.pBsBuf;
       for (int j = 0; j < layer.iNalCount; ++j) {
-        n += layer.pNalLengthInByte[j];
+        int start_code_size =
+            get_start_code_size(p, layer.pNalLengthInByte[j]);
+        int nal_size = layer.pNalLengthInByte[j] - start_code_size;
+        dst[0] = (uint8_t)(nal_size >> 24);
+        dst[1] = (uint8_t)(nal_size >> 16);
+        dst[2] = (uint8_t)(nal_size >> 8);
+        dst[3] = (uint8_t)nal_size;
+        dst += NAL_LENGTH_SIZE;
+        memcpy(dst, p + start_code_size, nal_size);
+        encoded.nal_units.push_back(
+            {(int)(dst - encoded.buf.get()), nal_size});
+        dst += nal_size;
+        p += layer.pNalLengthInByte[j];
       }
-      memcpy(encoded.buf.get() + offset, layer.pBsBuf, n);
-      offset += n;
+      // 空間レイヤーは 1 つしか使っていないので、最後のレイヤーの値を使う
+      encoded.temporal_id = layer.uiTemporalId;
+      encoded.spatial_id = layer.uiSpatialId;
     }
     encoded.timestamp = frame.timestamp;
+    encoded.frame_type = info.eFrameType == videoFrameTypeIDR
+                             ? EncodedImage::FrameType::kKey
+                             : EncodedImage::FrameType::kDelta;
+    SEncoderStatistics stats = {};
+    if (encoder_->GetOption(ENCODER_OPTION_GET_STATISTICS, &stats) == 0) {
+      encoded.qp = (int)stats.uiAverageFrameQP;
+    }
+
+    if (loss_recovery_ == Settings::LossRecovery::kLongTermReference) {
+      UpdateLtrState(encoded, now);
+    }
 
     callback_(encoded);
   }
 
+  void SetBitrate(Bps bitrate) override {
+    next_bitrate_bps_ = bitrate.count();
+  }
+
   void Release() override {
     if (encoder_) {
       destroy_encoder_(encoder_);
@@ -204,6 +318,111 @@ class OpenH264VideoEncoder : public VideoEncoder {
     openh264_handle_ = handle;
     return true;
   }
+  static int get_start_code_size(const uint8_t* p, int size) {
+    if (size >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1) {
+      return 4;
+    }
+    if (size >= 3 && p[0] == 0 && p[1] == 0 && p[2] == 1) {
+      return 3;
+    }
+    return 0;
+  }
+
+  void ResetLtrState() {
+    log2_max_frame_num_ = std::nullopt;
+    idr_pic_id_ = 0;
+    last_frame_num_ = -1;
+    confirmed_frame_num_ = -1;
+    unconfirmed_frames_.clear();
+    last_recovery_time_ = std::nullopt;
+    last_recovery_frame_num_ = -1;
+  }
+
+  // 回復の要求に対して、LTR を参照したフレームで回復するように要求する。
+  // LTR で回復できない場合は false を返すので、IDR を送ること。
+  bool RequestLtrRecovery(std::chrono::microseconds now) {
+    if (loss_recovery_ != Settings::LossRecovery::kLongTermReference) {
+      return false;
+    }
+    // 要求が来る前にエンコードしたフレームは届いていない可能性がある
+    unconfirmed_frames_.clear();
+    if (confirmed_frame_num_ < 0 || last_frame_num_ < 0) {
+      return false;
+    }
+    // 直前に LTR で回復しようとしたのに再度要求が来た場合や、
+    // 前回と同じ LTR しか無い場合は、LTR での回復に失敗しているので IDR にする
+    if (last_recovery_time_ && now - *last_recovery_time_ < LTR_RECOVERY_TIMEOUT) {
+      PLOG_INFO << "LTR recovery failed, fallback to IDR";
+      return false;
+    }
+    if (confirmed_frame_num_ == last_recovery_frame_num_) {
+      return false;
+    }
+    SLTRRecoverRequest request = {};
+    request.uiFeedbackType = LTR_RECOVERY_REQUEST;
+    request.uiIDRPicId = idr_pic_id_;
+    request.iLastCorrectFrameNum = confirmed_frame_num_;
+    request.iCurrentFrameNum = last_frame_num_;
+    request.iLayerId = 0;
+    if (encoder_->SetOption(ENCODER_LTR_RECOVERY_REQUEST, &request) != 0) {
+      PLOG_WARNING << "Failed to request LTR recovery";
+      return false;
+    }
+    PLOG_DEBUG << "LTR recovery requested: idr_pic_id=" << idr_pic_id_
+               << " last_correct_frame_num=" << confirmed_frame_num_
+               << " current_frame_num=" << last_frame_num_;
+    last_recovery_time_ = now;
+    last_recovery_frame_num_ = confirmed_frame_num_;
+    return true;
+  }
+
+  // エンコードしたフレームの frame_num を覚えておいて、
+  // 一定時間回復の要求が来なかったフレームを受信側に届いたものとしてエンコーダに通知する。
+  // 受信側から LTR の受信を通知する手段が無いので、その代わり。
+  void UpdateLtrState(const EncodedImage& encoded,
+                      std::chrono::microseconds now) {
+    std::optional<H264SliceHeader> header;
+    for (const auto& n : encoded.nal_units) {
+      const uint8_t* nal = encoded.buf.get() + n.offset;
+      if (n.size < 1) {
+        continue;
+      }
+      int type = get_h264_nal_type(nal);
+      if (type == H264_NAL_TYPE_SPS) {
+        log2_max_frame_num_ = parse_h264_sps_log2_max_frame_num(nal, n.size);
+      } else if (!header && log2_max_frame_num_ &&
+                 (type == H264_NAL_TYPE_SLICE || type == H264_NAL_TYPE_IDR)) {
+        header = parse_h264_slice_header(nal, n.size, *log2_max_frame_num_);
+      }
+    }
+    if (!header) {
+      // フレームスキップされた場合など
+      return;
+    }
+    if (header->idr) {
+      idr_pic_id_ = header->idr_pic_id;
+      confirmed_frame_num_ = -1;
+      last_recovery_frame_num_ = -1;
+      unconfirmed_frames_.clear();
+    }
+    last_frame_num_ = header->frame_num;
+    unconfirmed_frames_.push_back({header->frame_num, now});
+
+    // エンコーダは次のエンコード時にフィードバックを処理するので、1 回に 1 フレームだけ通知する
+    if (now - unconfirmed_frames_.front().timestamp < LTR_CONFIRM_DELAY) {
+      return;
+    }
+    int frame_num = unconfirmed_frames_.front().frame_num;
+    unconfirmed_frames_.pop_front();
+    SLTRMarkingFeedback feedback = {};
+    feedback.uiFeedbackType = LTR_MARKING_SUCCESS;
+    feedback.uiIDRPicId = idr_pic_id_;
+    feedback.iLTRFrameNum = frame_num;
+    feedback.iLayerId = 0;
+    encoder_->SetOption(ENCODER_LTR_MARKING_FEEDBACK, &feedback);
+    confirmed_frame_num_ = frame_num;
+  }
+
   void ReleaseOpenH264() {
     if (openh264_handle_ != nullptr) {
       ::dlclose(openh264_handle_);
@@ -217,6 +436,24 @@ class OpenH264VideoEncoder : public VideoEncoder {
   std::function<void(const EncodedImage&)> callback_;
 
   std::atomic<bool> next_iframe_;
+  std::atomic<bool> next_loss_recovery_;
+
+  Settings::LossRecovery loss_recovery_ = Settings::LossRecovery::kIdr;
+  // 以下は LTR を使う場合の状態
+  struct UnconfirmedFrame {
+    int frame_num;
+    std::chrono::microseconds timestamp;
+  };
+  std::optional<int> log2_max_frame_num_;
+  int idr_pic_id_;
+  int last_frame_num_;
+  // 受信側に届いたとみなした最後のフレームの frame_num。無ければ -1
+  int confirmed_frame_num_;
+  std::deque<UnconfirmedFrame> unconfirmed_frames_;
+  std::optional<std::chrono::microseconds> last_recovery_time_;
+  int last_recovery_frame_num_;
+  // 0 の場合は変更なし
+  std::atomic<int64_t> next_bitrate_bps_{0};
 
   void* openh264_handle_ = nullptr;
   using CreateEncoderFunc = int (*)(ISVCEncoder**);
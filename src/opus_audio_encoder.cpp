@@ -1,9 +1,23 @@
 #include "sorac/opus_audio_encoder.hpp"
 
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+// SIMD
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 // opus
 #include <opus.h>
 
@@ -14,25 +28,115 @@
 
 namespace sorac {
 
+// opus_encode_float に渡す出力バッファのサイズ。
+// Opus のドキュメントで推奨されている値で、60ms までのフレームなら必ず収まる。
+static const int MAX_ENCODED_SIZE = 4000;
+
+// RTP のクロックレート。Opus は入力のサンプリングレートに関わらず 48000 Hz
+static const int RTP_CLOCK_RATE = 48000;
+
+// キャプチャのタイムスタンプがサンプル数から計算した時刻とこれ以上ずれたら、入力が途切れたとみなして合わせ直す
+static const std::chrono::milliseconds RESYNC_THRESHOLD(100);
+
+// パケットロス率の指数移動平均の係数
+static const float LOSS_EWMA_ALPHA = 0.3f;
+// OPUS_SET_PACKET_LOSS_PERC に設定する値の上限
+static const int MAX_LOSS_PERC = 50;
+// OPUS_SET_PACKET_LOSS_PERC はこれ以上変化した時だけ更新する
+static const int LOSS_PERC_HYSTERESIS = 2;
+// パケットロス率がこれを超えたらビットレートを下げて、これを下回ったら上げる。
+// 間の場合は何もしない。
+static const float LOSS_RATE_HIGH = 0.10f;
+static const float LOSS_RATE_LOW = 0.02f;
+
+// モノラルの PCM を、同じデータを左右に詰めたステレオの PCM に変換する
+static void UpmixMonoToStereo(const float* src, float* dst, int samples) {
+  int i = 0;
+#if defined(__ARM_NEON)
+  for (; i + 4 <= samples; i += 4) {
+    float32x4_t x = vld1q_f32(src + i);
+    float32x4x2_t y = {x, x};
+    vst2q_f32(dst + i * 2, y);
+  }
+#elif defined(__SSE__)
+  for (; i + 4 <= samples; i += 4) {
+    __m128 x = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(x, x));
+    _mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(x, x));
+  }
+#endif
+  for (; i < samples; i++) {
+    dst[i * 2 + 0] = src[i];
+    dst[i * 2 + 1] = src[i];
+  }
+}
+
+// ステレオの PCM を、左右の平均を取ったモノラルの PCM に変換する
+static void DownmixStereoToMono(const float* src, float* dst, int samples) {
+  int i = 0;
+#if defined(__ARM_NEON)
+  float32x4_t half = vdupq_n_f32(0.5f);
+  for (; i + 4 <= samples; i += 4) {
+    float32x4x2_t x = vld2q_f32(src + i * 2);
+    vst1q_f32(dst + i, vmulq_f32(vaddq_f32(x.val[0], x.val[1]), half));
+  }
+#elif defined(__SSE__)
+  __m128 half = _mm_set1_ps(0.5f);
+  for (; i + 4 <= samples; i += 4) {
+    __m128 a = _mm_loadu_ps(src + i * 2);
+    __m128 b = _mm_loadu_ps(src + i * 2 + 4);
+    __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+  }
+#endif
+  for (; i < samples; i++) {
+    dst[i] = (src[i * 2 + 0] + src[i * 2 + 1]) * 0.5f;
+  }
+}
+
 class OpusAudioEncoderImpl : public OpusAudioEncoder {
  public:
   OpusAudioEncoderImpl() {}
   ~OpusAudioEncoderImpl() override { Release(); }
 
-  bool InitEncode(int sample_rate,
-                  int channels,
-                  int frame_duration_ms,
-                  int bitrate_kbps) override {
+  bool InitEncode(const Settings& settings) override {
     Release();
-    sample_rate_ = sample_rate;
-    channels_ = channels;
-    frame_duration_ms_ = frame_duration_ms;
-    bitrate_kbps_ = bitrate_kbps;
+    sample_rate_ = settings.sample_rate;
+    channels_ = settings.channels;
+    frame_duration_ms_ = settings.frame_duration_ms;
+    bitrate_kbps_ = settings.bitrate_kbps;
+    resampler_quality_ = settings.resampler_quality;
+    holdback_ = std::chrono::milliseconds(settings.holdback_ms);
+
+    dtx_ = settings.dtx;
+    min_bitrate_kbps_ = std::min(settings.min_bitrate_kbps, bitrate_kbps_);
+    loss_rate_ = -1.0f;
+    target_loss_perc_ = 0;
+    target_bitrate_kbps_ = bitrate_kbps_;
+    applied_loss_perc_ = 0;
+    applied_bitrate_kbps_ = bitrate_kbps_;
+
+    if (channels_ != 1 && channels_ != 2) {
+      PLOG_ERROR << "Unsupported channels: " << channels_;
+      return false;
+    }
+    if (frame_duration_ms_ != 10 && frame_duration_ms_ != 20 &&
+        frame_duration_ms_ != 40 && frame_duration_ms_ != 60) {
+      PLOG_ERROR << "Unsupported frame duration: " << frame_duration_ms_
+                 << "ms";
+      return false;
+    }
+
+    int application =
+        settings.application == Application::kAudio ? OPUS_APPLICATION_AUDIO
+        : settings.application == Application::kRestrictedLowDelay
+            ? OPUS_APPLICATION_RESTRICTED_LOWDELAY
+            : OPUS_APPLICATION_VOIP;
 
     int error = 0;
-    // maxplaybackrate=48000;stereo=1;sprop-stereo=1;minptime=10;ptime=20;useinbandfec=1;usedtx=0
-    encoder_ = opus_encoder_create(sample_rate_, channels_,
-                                   OPUS_APPLICATION_VOIP, &error);
+    encoder_ =
+        opus_encoder_create(sample_rate_, channels_, application, &error);
     if (error != OPUS_OK) {
       PLOG_ERROR << "Failed to create opus encoder";
       return false;
@@ -47,101 +151,351 @@ class OpusAudioEncoderImpl : public OpusAudioEncoder {
       PLOG_ERROR << "Failed to OPUS_SET_BITRATE";
       return false;
     }
+    r = opus_encoder_ctl(encoder_, OPUS_SET_PACKET_LOSS_PERC(0));
+    if (r != OPUS_OK) {
+      PLOG_ERROR << "Failed to OPUS_SET_PACKET_LOSS_PERC";
+      return false;
+    }
+    r = opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(settings.complexity));
+    if (r != OPUS_OK) {
+      PLOG_ERROR << "Failed to OPUS_SET_COMPLEXITY";
+      return false;
+    }
+    r = opus_encoder_ctl(encoder_, OPUS_SET_DTX(dtx_ ? 1 : 0));
+    if (r != OPUS_OK) {
+      PLOG_ERROR << "Failed to OPUS_SET_DTX";
+      return false;
+    }
+
+    // 1 フレーム分の PCM バッファはここで確保して、以降は使い回す
+    frame_samples_ = sample_rate_ * frame_duration_ms_ / 1000;
+    pcm_buf_.reset(new float[frame_samples_ * channels_]);
+    pcm_len_ = 0;
+
+    if (holdback_.count() > 0) {
+      send_stopped_ = false;
+      send_thread_ = std::thread([this]() { RunSend(); });
+    }
     return true;
   }
   void Release() override {
+    if (send_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        send_stopped_ = true;
+      }
+      send_cv_.notify_all();
+      send_thread_.join();
+    }
     if (encoder_ != nullptr) {
       opus_encoder_destroy(encoder_);
       encoder_ = nullptr;
     }
+    pcm_buf_.reset();
+    pcm_len_ = 0;
+    resampler_.reset();
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      for (auto& encoded : encoded_buf_) {
+        pool_.push_back(std::move(encoded));
+      }
+      encoded_buf_.clear();
+    }
+    started_ = false;
   }
 
   void Encode(const AudioFrame& frame) override {
-    EncodedAudio encoded;
-    encoded.size = 0;
-    encoded.cap = 1024;
-    encoded.buf.reset(new uint8_t[encoded.cap]);
-    //if (timestamp_.count() == 0) {
-    //  timestamp_ = frame.timestamp;
-    //}
-    timestamp_ = frame.timestamp;
-    encoded.timestamp = frame.timestamp;
+    if (encoder_ == nullptr) {
+      return;
+    }
 
-    if (frame.sample_rate != sample_rate_) {
-      // TODO(melpon): リサンプリングが必要
-      PLOG_WARNING << "Needs resampling: " << frame.sample_rate << " Hz to "
-                   << sample_rate_ << " Hz";
+    if (frame.channels != 1 && frame.channels != 2) {
+      PLOG_ERROR << "Unsupported channels: " << frame.channels;
       return;
     }
 
-    for (int i = 0; i < frame.samples; i++) {
-      pcm_buf_.push_back(frame.pcm[i]);
-      if (frame.channels == 1 && channels_ == 2) {
+    ApplyAdaptation();
+
+    const float* src = frame.pcm.get();
+    int samples = frame.samples;
+    if (frame.sample_rate != sample_rate_) {
+      // 入力のフォーマットが変わった時だけリサンプラを作り直す
+      if (resampler_ == nullptr ||
+          resampler_->GetInputSampleRate() != frame.sample_rate ||
+          resampler_->GetChannels() != frame.channels) {
+        PLOG_INFO << "Create resampler: " << frame.sample_rate << " Hz to "
+                  << sample_rate_ << " Hz, channels=" << frame.channels;
+        resampler_ = CreateAudioResampler(frame.sample_rate, sample_rate_,
+                                          frame.channels, resampler_quality_);
+      }
+      size_t size = (size_t)resampler_->GetMaxOutputSamples(frame.samples) *
+                    frame.channels;
+      if (resample_buf_.size() < size) {
+        resample_buf_.resize(size);
+      }
+      samples = resampler_->Resample(src, frame.samples, resample_buf_.data());
+      src = resample_buf_.data();
+    } else {
+      resampler_.reset();
+    }
+
+    // 1 フレーム分のデータが溜まるまでまとめてコピーして、溜まったらエンコードする
+    int offset = 0;
+    while (offset < samples) {
+      if (pcm_len_ == 0) {
+        // このフレームの先頭サンプルのタイムスタンプ
+        timestamp_ = frame.timestamp +
+                     std::chrono::microseconds(int64_t(offset) * 1000 * 1000 /
+                                               sample_rate_);
+      }
+      int n = std::min(samples - offset, frame_samples_ - pcm_len_);
+      float* dst = pcm_buf_.get() + pcm_len_ * channels_;
+      if (frame.channels == channels_) {
+        memcpy(dst, src + offset * channels_, n * channels_ * sizeof(float));
+      } else if (frame.channels == 1) {
         // 入力はモノラルだけど、エンコーダに渡すのはステレオなので同じデータを詰めておく
-        pcm_buf_.push_back(frame.pcm[i]);
+        UpmixMonoToStereo(src + offset, dst, n);
+      } else {
+        DownmixStereoToMono(src + offset * 2, dst, n);
       }
+      offset += n;
+      pcm_len_ += n;
 
-      // 20ms ごとにエンコードする
-      // 16000 [Hz] * 2 [channels] * (20 [ms] / 1000 [ms])
-      if (pcm_buf_.size() ==
-          sample_rate_ * channels_ * frame_duration_ms_ / 1000) {
-        while (true) {
-          int n = opus_encode_float(
-              encoder_, pcm_buf_.data(), pcm_buf_.size() / channels_,
-              encoded.buf.get() + encoded.size, encoded.cap - encoded.size);
-          if (n >= 0) {
-            // 無事エンコードできた
-            encoded.size += n;
-            encoded.timestamp = timestamp_;
-            encoded_buf_.push_back(std::move(encoded));
-            encoded.size = 0;
-            encoded.cap = 1024;
-            encoded.buf.reset(new uint8_t[encoded.cap]);
-            break;
-          }
-          // バッファが足りないので増やす
-          if (n == OPUS_BUFFER_TOO_SMALL) {
-            encoded.cap *= 2;
-            encoded.buf.reset(new uint8_t[encoded.cap]);
-          }
-          // 何かエラーが起きた
-          PLOG_ERROR << "Failed to opus_encode_float: result=" << n;
-          return;
-        }
-        // PLOG_DEBUG << "encode frame: samples=" << pcm_buf_.size() << " encoded=" << encoded.size << " [0]=" << pcm_buf_[0] << " [1]=" << pcm_buf_[1];
-        pcm_buf_.clear();
-        timestamp_ += std::chrono::milliseconds(frame_duration_ms_);
+      if (pcm_len_ == frame_samples_) {
+        EncodeFrame();
+        pcm_len_ = 0;
       }
     }
+  }
 
-    auto now = get_current_time();
-    // 100ミリ秒以上経過したやつから送っていく
-    auto end = std::find_if(
-        encoded_buf_.begin(), encoded_buf_.end(), [now](const EncodedAudio& a) {
-          return (now - a.timestamp) < std::chrono::milliseconds(100);
-        });
-    for (auto it = encoded_buf_.begin(); it != end; ++it) {
-      callback_(*it);
-    }
-    encoded_buf_.erase(encoded_buf_.begin(), end);
+  void SetPacketLossRate(float loss_rate) override {
+    // RTCP を受信したスレッドをエンコードで待たせないように、値を置くだけにする
+    pending_loss_rate_ = loss_rate;
   }
 
   void SetEncodeCallback(
       std::function<void(const EncodedAudio&)> callback) override {
+    std::lock_guard<std::mutex> lock(send_mutex_);
     callback_ = callback;
   }
 
+ private:
+  // 受信したパケットロス率から、エンコーダに設定する値を計算する
+  void UpdateAdaptation(float loss_rate) {
+    loss_rate_ = loss_rate_ < 0.0f ? loss_rate
+                                   : loss_rate_ * (1.0f - LOSS_EWMA_ALPHA) +
+                                         loss_rate * LOSS_EWMA_ALPHA;
+
+    int perc = std::clamp((int)(loss_rate_ * 100.0f + 0.5f), 0, MAX_LOSS_PERC);
+    if (std::abs(perc - target_loss_perc_) >= LOSS_PERC_HYSTERESIS ||
+        (perc == 0 && target_loss_perc_ != 0)) {
+      target_loss_perc_ = perc;
+    }
+
+    if (loss_rate_ > LOSS_RATE_HIGH) {
+      target_bitrate_kbps_ =
+          std::max(min_bitrate_kbps_, target_bitrate_kbps_ * 85 / 100);
+    } else if (loss_rate_ < LOSS_RATE_LOW) {
+      target_bitrate_kbps_ = std::min(
+          bitrate_kbps_,
+          std::max(target_bitrate_kbps_ + 1, target_bitrate_kbps_ * 110 / 100));
+    }
+  }
+
+  // SetPacketLossRate() で受け取った値をエンコーダに反映する。
+  // opus_encoder_ctl はエンコードと同じスレッドで呼ぶ必要があるので Encode() から呼ぶ。
+  // RR は 1 秒程度の間隔なので、Encode() の間に複数届いた場合は最後の値だけ使う。
+  void ApplyAdaptation() {
+    float loss_rate = pending_loss_rate_.exchange(-1.0f);
+    if (loss_rate >= 0.0f) {
+      UpdateAdaptation(loss_rate);
+    }
+    int loss_perc = target_loss_perc_;
+    int bitrate_kbps = target_bitrate_kbps_;
+    if (loss_perc != applied_loss_perc_) {
+      PLOG_INFO << "Opus expected packet loss: " << applied_loss_perc_
+                << "% -> " << loss_perc << "%";
+      int r = opus_encoder_ctl(encoder_, OPUS_SET_PACKET_LOSS_PERC(loss_perc));
+      if (r != OPUS_OK) {
+        PLOG_ERROR << "Failed to OPUS_SET_PACKET_LOSS_PERC";
+      }
+      applied_loss_perc_ = loss_perc;
+    }
+    if (bitrate_kbps != applied_bitrate_kbps_) {
+      PLOG_INFO << "Opus bitrate: " << applied_bitrate_kbps_ << "kbps -> "
+                << bitrate_kbps << "kbps";
+      int r = opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate_kbps * 1000));
+      if (r != OPUS_OK) {
+        PLOG_ERROR << "Failed to OPUS_SET_BITRATE";
+      }
+      applied_bitrate_kbps_ = bitrate_kbps;
+    }
+  }
+
+  void EncodeFrame() {
+    EncodedAudio encoded;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      if (!pool_.empty()) {
+        encoded = std::move(pool_.back());
+        pool_.pop_back();
+      }
+    }
+    if (encoded.buf == nullptr) {
+      encoded.cap = MAX_ENCODED_SIZE;
+      encoded.buf.reset(new uint8_t[encoded.cap]);
+    }
+
+    int n = opus_encode_float(encoder_, pcm_buf_.get(), frame_samples_,
+                              encoded.buf.get(), encoded.cap);
+    if (n < 0) {
+      PLOG_ERROR << "Failed to opus_encode_float: result=" << n;
+      ReturnToPool(std::move(encoded));
+      return;
+    }
+    encoded.size = n;
+    AdvanceClock();
+    // DTX が有効な場合、無音区間では 1, 2 バイトのパケットが出力される。
+    // これは送る必要が無いので捨てる（RTP タイムスタンプは進めておく）
+    if (dtx_ && n <= 2) {
+      ReturnToPool(std::move(encoded));
+      return;
+    }
+    encoded.timestamp =
+        base_timestamp_ + std::chrono::microseconds(rtp_elapsed_ * 1000 *
+                                                    1000 / RTP_CLOCK_RATE);
+    encoded.rtp_timestamp = (uint32_t)rtp_elapsed_;
+
+    if (!send_thread_.joinable()) {
+      // 保持しない場合はこのスレッドからすぐに渡す
+      std::function<void(const EncodedAudio&)> callback;
+      {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        callback = callback_;
+      }
+      if (callback) {
+        callback(encoded);
+      }
+      ReturnToPool(std::move(encoded));
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      encoded_buf_.push_back(std::move(encoded));
+    }
+    send_cv_.notify_all();
+  }
+
+  void ReturnToPool(EncodedAudio encoded) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    pool_.push_back(std::move(encoded));
+  }
+
+  // 保持しているデータを、RTP タイムスタンプから計算した時刻 + 保持時間 になったら送る。
+  // Encode() の呼び出しを契機にすると、入力のジッタで送る間隔が揺らいだり、
+  // 入力が止まった時に送られずに残ったりするので、専用のスレッドで送る。
+  void RunSend() {
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    while (!send_stopped_) {
+      if (encoded_buf_.empty()) {
+        send_cv_.wait(lock);
+        continue;
+      }
+      // タイムスタンプは単調増加なので、先頭から順に送る
+      auto wait =
+          encoded_buf_.front().timestamp + holdback_ - get_current_time();
+      if (wait.count() > 0) {
+        send_cv_.wait_for(lock, wait);
+        continue;
+      }
+      EncodedAudio encoded = std::move(encoded_buf_.front());
+      encoded_buf_.pop_front();
+      auto callback = callback_;
+      // コールバックの中で Encode() を呼んでいるスレッドのロックを取ることがあるので、
+      // ロックを外してから呼ぶ
+      lock.unlock();
+      if (callback) {
+        callback(encoded);
+      }
+      lock.lock();
+      pool_.push_back(std::move(encoded));
+    }
+  }
+
+  // エンコードしたサンプル数から RTP のクロックを進める。
+  // キャプチャのタイムスタンプのジッタには影響されないが、大きくずれた場合は合わせ直す。
+  void AdvanceClock() {
+    if (!started_) {
+      started_ = true;
+      base_timestamp_ = timestamp_;
+      rtp_elapsed_ = 0;
+      return;
+    }
+    rtp_elapsed_ += (int64_t)frame_samples_ * RTP_CLOCK_RATE / sample_rate_;
+    auto expected =
+        base_timestamp_ +
+        std::chrono::microseconds(rtp_elapsed_ * 1000 * 1000 / RTP_CLOCK_RATE);
+    auto drift = timestamp_ - expected;
+    if (drift > RESYNC_THRESHOLD) {
+      // 入力が途切れていたので、その分だけ RTP タイムスタンプを進める
+      PLOG_INFO << "Resync audio clock: drift=" << drift.count() << "us";
+      rtp_elapsed_ += drift.count() * RTP_CLOCK_RATE / (1000 * 1000);
+    } else if (drift < -RESYNC_THRESHOLD) {
+      // RTP タイムスタンプは戻せないので、基準の時刻の方をずらす
+      PLOG_INFO << "Resync audio clock: drift=" << drift.count() << "us";
+      base_timestamp_ += drift;
+    }
+  }
+
  private:
   int sample_rate_;
   int channels_;
   int frame_duration_ms_;
   int bitrate_kbps_;
+  AudioResamplerQuality resampler_quality_;
+  std::chrono::milliseconds holdback_;
+  bool dtx_ = false;
+
+  // SetPacketLossRate() で受け取ったまま、まだ反映していない値。無い場合は負の値
+  std::atomic<float> pending_loss_rate_{-1.0f};
+  // パケットロスに応じた調整。エンコードするスレッドだけで触る
+  int min_bitrate_kbps_ = 0;
+  // パケットロス率の指数移動平均。まだレポートを受け取ってない場合は負の値
+  float loss_rate_ = -1.0f;
+  int target_loss_perc_ = 0;
+  int target_bitrate_kbps_ = 0;
+  // エンコーダに設定済みの値
+  int applied_loss_perc_ = 0;
+  int applied_bitrate_kbps_ = 0;
 
   OpusEncoder* encoder_ = nullptr;
+  // send_mutex_ で保護する
   std::function<void(const EncodedAudio&)> callback_;
-  std::vector<float> pcm_buf_;
+  // 1 フレーム分の PCM バッファ。frame_samples_ * channels_ 個の float が入る
+  std::unique_ptr<float[]> pcm_buf_;
+  // pcm_buf_ に溜まっているチャンネルあたりのサンプル数
+  int pcm_len_ = 0;
+  // 1 フレームあたりのチャンネルあたりのサンプル数
+  int frame_samples_ = 0;
   std::chrono::microseconds timestamp_;
-  std::vector<EncodedAudio> encoded_buf_;
+  // 入力のサンプリングレートが sample_rate_ と異なる場合のリサンプラ
+  std::shared_ptr<AudioResampler> resampler_;
+  // リサンプリング後の PCM。入力のチャンネル数のままインターリーブされている
+  std::vector<float> resample_buf_;
+  // 最初にエンコードしたフレームのキャプチャ時刻と、そこからの経過時間 (RTP_CLOCK_RATE 単位)
+  bool started_ = false;
+  std::chrono::microseconds base_timestamp_;
+  int64_t rtp_elapsed_ = 0;
+  // 以下は send_mutex_ で保護する
+  std::mutex send_mutex_;
+  std::condition_variable send_cv_;
+  bool send_stopped_ = false;
+  // 送信待ちのエンコード済みデータ
+  std::deque<EncodedAudio> encoded_buf_;
+  // 送信済みの EncodedAudio のバッファを使い回すためのプール
+  std::vector<EncodedAudio> pool_;
+  // holdback_ が 0 より大きい場合に、保持しているデータを送るスレッド
+  std::thread send_thread_;
 };
 
 std::shared_ptr<OpusAudioEncoder> CreateOpusAudioEncoder() {
@@ -0,0 +1,165 @@
+#include "sorac/paced_sender.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// plog
+#include <plog/Log.h>
+
+namespace sorac {
+
+// 送り出す間隔
+static const std::chrono::milliseconds TICK_INTERVAL(5);
+// 送信しなかった分を貯めておける時間
+static const std::chrono::milliseconds MAX_BUDGET_TIME(10);
+// キューに溜まった映像がこの時間以内に送り切れない場合は送信レートを上げる
+static const std::chrono::milliseconds MAX_QUEUE_TIME(1000);
+
+PacedSender::PacedSender(double pacing_factor)
+    : pacing_factor_(pacing_factor) {
+  thread_ = std::thread([this]() { Run(); });
+}
+
+PacedSender::~PacedSender() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void PacedSender::SetBitrate(Priority priority, Bps bitrate) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (priority == Priority::kAudio) {
+    audio_bitrate_ = bitrate;
+  } else if (priority == Priority::kVideo) {
+    video_bitrate_ = bitrate;
+  }
+}
+
+void PacedSender::Enqueue(Priority priority,
+                          rtc::message_ptr message,
+                          const rtc::message_callback& send) {
+  if (priority == Priority::kAudio) {
+    // 音声は小さいのでそのまま送るが、送った分は映像の送信量から差し引く
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      budget_ -= message->size();
+    }
+    send(message);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  video_queue_bytes_ += message->size();
+  auto& queue = priority == Priority::kRetransmission ? retransmission_queue_
+                                                      : video_queue_;
+  queue.push_back(Packet{std::move(message), send});
+}
+
+void PacedSender::Run() {
+  std::vector<Packet> packets;
+  auto next = std::chrono::steady_clock::now();
+  auto last = next;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    next += TICK_INTERVAL;
+    cv_.wait_until(lock, next, [this]() { return stop_; });
+    if (stop_) {
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    // 大きく遅れた場合は追いつこうとせずに、今の時刻から数え直す
+    if (now - next > MAX_BUDGET_TIME) {
+      next = now;
+    }
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    // 送信レート (bytes/s)
+    double rate =
+        (audio_bitrate_ + video_bitrate_).count() / 8.0 * pacing_factor_;
+    if (rate <= 0.0) {
+      // 目標ビットレートが分からないので、そのまま全部送る
+      budget_ = 0.0;
+      packets.assign(std::make_move_iterator(retransmission_queue_.begin()),
+                     std::make_move_iterator(retransmission_queue_.end()));
+      packets.insert(packets.end(),
+                     std::make_move_iterator(video_queue_.begin()),
+                     std::make_move_iterator(video_queue_.end()));
+      retransmission_queue_.clear();
+      video_queue_.clear();
+      video_queue_bytes_ = 0;
+    } else {
+      double drain_rate =
+          video_queue_bytes_ /
+          std::chrono::duration<double>(MAX_QUEUE_TIME).count();
+      rate = std::max(rate, drain_rate);
+      budget_ = std::min(
+          budget_ + rate * elapsed,
+          rate * std::chrono::duration<double>(MAX_BUDGET_TIME).count());
+      while (budget_ > 0.0 &&
+             (!retransmission_queue_.empty() || !video_queue_.empty())) {
+        auto& queue = !retransmission_queue_.empty() ? retransmission_queue_
+                                                     : video_queue_;
+        auto& packet = queue.front();
+        budget_ -= packet.message->size();
+        video_queue_bytes_ -= packet.message->size();
+        packets.push_back(std::move(packet));
+        queue.pop_front();
+      }
+    }
+
+    if (packets.empty()) {
+      continue;
+    }
+    // 送信中は他のスレッドから Enqueue できるようにロックを外しておく
+    lock.unlock();
+    for (auto& packet : packets) {
+      packet.send(packet.message);
+    }
+    packets.clear();
+    lock.lock();
+  }
+}
+
+PacingMediaHandler::PacingMediaHandler(std::weak_ptr<PacedSender> pacer,
+                                       PacedSender::Priority priority)
+    : pacer_(pacer), priority_(priority) {}
+
+void PacingMediaHandler::outgoing(rtc::message_vector& messages,
+                                  const rtc::message_callback& send) {
+  auto pacer = pacer_.lock();
+  if (pacer == nullptr) {
+    return;
+  }
+  // 送り出す時に、このハンドラより後ろにつながっている MediaHandler を通してから送信する
+  rtc::message_callback paced_send =
+      [wself = weak_from_this(), send](rtc::message_ptr message) {
+        auto self = wself.lock();
+        auto next = self != nullptr ? self->next() : nullptr;
+        if (next == nullptr) {
+          send(message);
+          return;
+        }
+        rtc::message_vector messages{message};
+        next->outgoingChain(messages, send);
+        for (auto& m : messages) {
+          send(m);
+        }
+      };
+
+  // RTCP はそのまま送って、RTP だけ PacedSender に渡す
+  rtc::message_vector rest;
+  for (auto& message : messages) {
+    if (message->type == rtc::Message::Control) {
+      rest.push_back(std::move(message));
+      continue;
+    }
+    pacer->Enqueue(priority_, std::move(message), paced_send);
+  }
+  messages.swap(rest);
+}
+
+}  // namespace sorac
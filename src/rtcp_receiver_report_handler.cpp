@@ -0,0 +1,64 @@
+#include "sorac/rtcp_receiver_report_handler.hpp"
+
+// plog
+#include <plog/Log.h>
+
+#include "rtp_util.hpp"
+
+namespace sorac {
+
+static const size_t RTCP_SENDER_INFO_SIZE = 20;
+static const size_t RTCP_REPORT_BLOCK_SIZE = 24;
+
+RtcpReceiverReportHandler::RtcpReceiverReportHandler(
+    rtc::SSRC ssrc,
+    std::function<void(const RtcpReportBlock&)> on_report)
+    : ssrc_(ssrc), on_report_(on_report) {}
+
+void RtcpReceiverReportHandler::incoming(rtc::message_vector& messages,
+                                         const rtc::message_callback& send) {
+  for (const auto& message : messages) {
+    if (message->type != rtc::Message::Control) {
+      continue;
+    }
+    Parse((const uint8_t*)message->data(), message->size());
+  }
+}
+
+void RtcpReceiverReportHandler::Parse(const uint8_t* buf, size_t size) {
+  for_each_rtcp_packet(buf, size, [this](const uint8_t* p, size_t length) {
+    int count = p[0] & 0x1f;
+    uint8_t pt = p[1];
+    size_t blocks_offset;
+    if (pt == RTCP_PT_SR) {
+      blocks_offset = RTCP_HEADER_SIZE + 4 + RTCP_SENDER_INFO_SIZE;
+    } else if (pt == RTCP_PT_RR) {
+      blocks_offset = RTCP_HEADER_SIZE + 4;
+    } else {
+      return;
+    }
+    if (blocks_offset + count * RTCP_REPORT_BLOCK_SIZE > length) {
+      PLOG_WARNING << "Invalid RTCP report block count: " << count;
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      const uint8_t* b = p + blocks_offset + i * RTCP_REPORT_BLOCK_SIZE;
+      RtcpReportBlock block;
+      block.ssrc = read_u32(b);
+      if (block.ssrc != ssrc_) {
+        continue;
+      }
+      block.fraction_lost = b[4];
+      // 24 bit の符号付き整数
+      int32_t lost = (b[5] << 16) | (b[6] << 8) | b[7];
+      block.cumulative_lost = (lost & 0x800000) ? lost - 0x1000000 : lost;
+      block.highest_sequence = read_u32(b + 8);
+      block.jitter = read_u32(b + 12);
+      block.last_sr = read_u32(b + 16);
+      block.delay_since_last_sr = read_u32(b + 20);
+      on_report_(block);
+    }
+  });
+}
+
+}  // namespace sorac
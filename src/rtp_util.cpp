@@ -0,0 +1,77 @@
+#include "rtp_util.hpp"
+
+// plog
+#include <plog/Log.h>
+
+namespace sorac {
+
+uint16_t read_u16(const uint8_t* p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+uint32_t read_u32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+void write_u16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)(v >> 8);
+  p[1] = (uint8_t)v;
+}
+void write_u32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+size_t get_rtp_header_size(const uint8_t* buf, size_t size) {
+  if (size < RTP_FIXED_HEADER_SIZE || (buf[0] >> 6) != 2) {
+    return 0;
+  }
+  int csrc_count = buf[0] & 0x0f;
+  bool extension = (buf[0] & 0x10) != 0;
+  size_t header_size = RTP_FIXED_HEADER_SIZE + csrc_count * 4;
+  if (extension) {
+    if (header_size + 4 > size) {
+      return 0;
+    }
+    header_size += 4 + read_u16(buf + header_size + 2) * 4;
+  }
+  if (header_size > size) {
+    return 0;
+  }
+  return header_size;
+}
+
+size_t get_rtp_padding_size(const uint8_t* buf, size_t size) {
+  if ((buf[0] & 0x20) == 0 || size == 0) {
+    return 0;
+  }
+  return buf[size - 1];
+}
+
+uint16_t get_rtp_sequence_number(const uint8_t* buf) {
+  return read_u16(buf + 2);
+}
+
+uint32_t get_rtp_ssrc(const uint8_t* buf) {
+  return read_u32(buf + 8);
+}
+
+void for_each_rtcp_packet(
+    const uint8_t* buf,
+    size_t size,
+    const std::function<void(const uint8_t* p, size_t size)>& f) {
+  size_t offset = 0;
+  while (offset + RTCP_HEADER_SIZE <= size) {
+    const uint8_t* p = buf + offset;
+    size_t length = ((size_t)read_u16(p + 2) + 1) * 4;
+    if ((p[0] >> 6) != 2 || offset + length > size) {
+      PLOG_WARNING << "Invalid RTCP packet";
+      return;
+    }
+    f(p, length);
+    offset += length;
+  }
+}
+
+}  // namespace sorac
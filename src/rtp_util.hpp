@@ -0,0 +1,42 @@
+#ifndef SORAC_RTP_UTIL_HPP_
+#define SORAC_RTP_UTIL_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+namespace sorac {
+
+static const uint8_t RTCP_PT_SR = 200;
+static const uint8_t RTCP_PT_RR = 201;
+// Transport layer feedback (RFC 4585)
+static const uint8_t RTCP_PT_RTPFB = 205;
+// Payload-specific feedback (RFC 4585)
+static const uint8_t RTCP_PT_PSFB = 206;
+
+static const size_t RTP_FIXED_HEADER_SIZE = 12;
+static const size_t RTCP_HEADER_SIZE = 4;
+
+uint16_t read_u16(const uint8_t* p);
+uint32_t read_u32(const uint8_t* p);
+void write_u16(uint8_t* p, uint16_t v);
+void write_u32(uint8_t* p, uint32_t v);
+
+// CSRC と拡張ヘッダを含めた RTP ヘッダのサイズを返す。
+// 不正なパケットの場合は 0 を返す。
+size_t get_rtp_header_size(const uint8_t* buf, size_t size);
+// RTP パケットの末尾にあるパディングのサイズを返す
+size_t get_rtp_padding_size(const uint8_t* buf, size_t size);
+uint16_t get_rtp_sequence_number(const uint8_t* buf);
+uint32_t get_rtp_ssrc(const uint8_t* buf);
+
+// compound RTCP packet を個々の RTCP パケットに分けて f を呼ぶ。
+// 不正なパケットがあった場合はそこで打ち切る。
+void for_each_rtcp_packet(
+    const uint8_t* buf,
+    size_t size,
+    const std::function<void(const uint8_t* p, size_t size)>& f);
+
+}  // namespace sorac
+
+#endif
@@ -0,0 +1,183 @@
+#include "sorac/rtx_nack_responder.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+// plog
+#include <plog/Log.h>
+
+#include "rtp_util.hpp"
+#include "sorac/current_time.hpp"
+#include "util.hpp"
+
+namespace sorac {
+
+// Generic NACK の FMT
+static const int RTCP_RTPFB_FMT_NACK = 1;
+// 保持するパケット数を計算する時に想定するパケットの平均サイズ
+static const size_t AVERAGE_PACKET_SIZE = 600;
+static const size_t MIN_HISTORY_PACKETS = 128;
+
+RtxNackResponder::RtxNackResponder(const RtxNackResponderConfig& config)
+    : config_(config),
+      rtx_sequence_number_((uint16_t)generate_random_number(UINT16_MAX)) {
+  // 保持時間内に送られる最大のパケット数
+  max_packets_ = std::max(
+      MIN_HISTORY_PACKETS,
+      (size_t)(config_.max_bitrate.count() / 8 * config_.history_time.count() /
+               1000 / AVERAGE_PACKET_SIZE));
+}
+
+void RtxNackResponder::outgoing(rtc::message_vector& messages,
+                                const rtc::message_callback& send) {
+  auto now = get_current_time();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& message : messages) {
+    if (message->type == rtc::Message::Control) {
+      continue;
+    }
+    const uint8_t* buf = (const uint8_t*)message->data();
+    if (get_rtp_header_size(buf, message->size()) == 0) {
+      continue;
+    }
+    stats_.packets_sent += 1;
+    stats_.bytes_sent += message->size();
+    // 後続の MediaHandler やトランスポートでパケットが書き換えられる可能性があるのでコピーしておく
+    history_.push_back(
+        Entry{rtc::make_message(message->begin(), message->end()), now});
+  }
+  while (!history_.empty() &&
+         (history_.size() > max_packets_ ||
+          now - history_.front().timestamp > config_.history_time)) {
+    history_.pop_front();
+  }
+}
+
+void RtxNackResponder::incoming(rtc::message_vector& messages,
+                                const rtc::message_callback& send) {
+  for (const auto& message : messages) {
+    if (message->type != rtc::Message::Control) {
+      continue;
+    }
+    for_each_rtcp_packet(
+        (const uint8_t*)message->data(), message->size(),
+        [this, &send](const uint8_t* p, size_t size) {
+          int fmt = p[0] & 0x1f;
+          if (p[1] != RTCP_PT_RTPFB || fmt != RTCP_RTPFB_FMT_NACK ||
+              size < RTCP_HEADER_SIZE + 8) {
+            return;
+          }
+          uint32_t media_ssrc = read_u32(p + 8);
+          if (media_ssrc != config_.ssrc) {
+            return;
+          }
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.nack_count += 1;
+          }
+          // FCI は PID (16bit) と BLP (16bit) の組が並んでいる
+          for (size_t offset = RTCP_HEADER_SIZE + 8; offset + 4 <= size;
+               offset += 4) {
+            uint16_t pid = read_u16(p + offset);
+            uint16_t blp = read_u16(p + offset + 2);
+            OnNack(pid, send);
+            for (int i = 0; i < 16; i++) {
+              if (blp & (1 << i)) {
+                OnNack((uint16_t)(pid + i + 1), send);
+              }
+            }
+          }
+        });
+  }
+}
+
+RtxNackResponderStats RtxNackResponder::GetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void RtxNackResponder::OnNack(uint16_t seq, const rtc::message_callback& send) {
+  rtc::message_ptr packet;
+  bool unrecoverable = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (history_.empty()) {
+      return;
+    }
+    // history_ はシーケンス番号順に並んでいるので、先頭からの差分で引ける
+    uint16_t first = get_rtp_sequence_number(
+        (const uint8_t*)history_.front().packet->data());
+    uint16_t index = seq - first;
+    if (index >= history_.size()) {
+      PLOG_DEBUG << "NACK for unknown packet: seq=" << seq;
+      // 保持期間を過ぎたパケットは再送できないので回復を要求する。
+      // 前回の要求より前に送ったパケットは、その要求で回復するので何もしない。
+      if ((int16_t)(seq - first) < 0 &&
+          (!recovery_sequence_number_ ||
+           (int16_t)(seq - *recovery_sequence_number_) > 0)) {
+        recovery_sequence_number_ = get_rtp_sequence_number(
+            (const uint8_t*)history_.back().packet->data());
+        unrecoverable = true;
+      }
+    } else {
+      const auto& entry = history_[index];
+      packet = config_.rtx_ssrc ? CreateRtxPacket(*entry.packet)
+                                : rtc::make_message(entry.packet->begin(),
+                                                    entry.packet->end());
+      if (packet == nullptr) {
+        return;
+      }
+      stats_.retransmitted_packets_sent += 1;
+      stats_.retransmitted_bytes_sent += packet->size();
+    }
+  }
+  if (unrecoverable && config_.on_unrecoverable_loss) {
+    config_.on_unrecoverable_loss();
+  }
+  if (packet == nullptr) {
+    return;
+  }
+
+  // 再送も通常のパケットと同じように、ペーサーを通して送信レートに含めて、
+  // 送り出す直前に transport-wide sequence number を振って帯域推定に含める
+  rtc::message_callback paced_send = send;
+  if (config_.transport_cc != nullptr) {
+    paced_send = [transport_cc = config_.transport_cc,
+                  send](rtc::message_ptr message) {
+      transport_cc->Stamp(*message);
+      send(message);
+    };
+  }
+  auto pacer = config_.pacer.lock();
+  if (pacer == nullptr) {
+    paced_send(packet);
+    return;
+  }
+  pacer->Enqueue(PacedSender::Priority::kRetransmission, std::move(packet),
+                 paced_send);
+}
+
+rtc::message_ptr RtxNackResponder::CreateRtxPacket(const rtc::Message& packet) {
+  const uint8_t* src = (const uint8_t*)packet.data();
+  size_t header_size = get_rtp_header_size(src, packet.size());
+  size_t padding_size = get_rtp_padding_size(src, packet.size());
+  if (header_size == 0 || header_size + padding_size > packet.size()) {
+    return nullptr;
+  }
+  size_t payload_size = packet.size() - header_size - padding_size;
+
+  // RTX のパケットは、ヘッダの SSRC, payload type, シーケンス番号を差し替えて、
+  // ペイロードの先頭に元のシーケンス番号 (OSN) を入れる。パディングは外しておく。
+  auto rtx = rtc::make_message(header_size + 2 + payload_size);
+  uint8_t* dst = (uint8_t*)rtx->data();
+  memcpy(dst, src, header_size);
+  dst[0] &= ~0x20;
+  dst[1] = (dst[1] & 0x80) | (uint8_t)(config_.rtx_payload_type & 0x7f);
+  write_u16(dst + 2, rtx_sequence_number_++);
+  write_u32(dst + 8, *config_.rtx_ssrc);
+  memcpy(dst + header_size, src + 2, 2);
+  memcpy(dst + header_size + 2, src + header_size, payload_size);
+  return rtx;
+}
+
+}  // namespace sorac
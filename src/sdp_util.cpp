@@ -0,0 +1,141 @@
+#include "sdp_util.hpp"
+
+#include <charconv>
+
+namespace sorac {
+
+ParsedSdp parse_sdp(std::string_view sdp) {
+  ParsedSdp r;
+  size_t pos = 0;
+  while (pos < sdp.size()) {
+    size_t eol = sdp.find('\n', pos);
+    if (eol == std::string_view::npos) {
+      eol = sdp.size();
+    }
+    std::string_view line = sdp.substr(pos, eol - pos);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (line.size() >= 2 && line[1] == '=') {
+      std::string_view content = line.substr(2);
+      if (line[0] == 'm') {
+        if (!r.media.empty()) {
+          r.media.back().end = pos;
+        }
+        SdpMediaSection media;
+        media.type = split_first(content, ' ').first;
+        media.begin = pos;
+        media.end = sdp.size();
+        r.media.push_back(media);
+      } else if (line[0] == 'a') {
+        auto [name, value] = split_first(content, ':');
+        SdpAttribute attr{name, value};
+        if (r.media.empty()) {
+          r.session_attributes.push_back(attr);
+        } else {
+          if (name == "mid") {
+            r.media.back().mid = value;
+          }
+          r.media.back().attributes.push_back(attr);
+        }
+      }
+    }
+    pos = eol + 1;
+  }
+  return r;
+}
+
+const SdpMediaSection* find_sdp_media(const ParsedSdp& sdp,
+                                      std::string_view type) {
+  for (const auto& media : sdp.media) {
+    if (media.type == type) {
+      return &media;
+    }
+  }
+  return nullptr;
+}
+
+std::optional<std::string_view> find_sdp_attribute(
+    const SdpMediaSection& media,
+    std::string_view name) {
+  for (const auto& attr : media.attributes) {
+    if (attr.name == name) {
+      return attr.value;
+    }
+  }
+  return std::nullopt;
+}
+
+std::optional<SdpRtpMap> parse_sdp_rtpmap(std::string_view value) {
+  auto [pt, rest] = split_first(value, ' ');
+  auto [encoding_name, params] = split_first(rest, '/');
+  auto payload_type = parse_int(pt);
+  auto clock_rate = parse_int(split_first(params, '/').first);
+  if (!payload_type || !clock_rate || encoding_name.empty()) {
+    return std::nullopt;
+  }
+  return SdpRtpMap{*payload_type, encoding_name, *clock_rate};
+}
+
+std::optional<SdpFmtp> parse_sdp_fmtp(std::string_view value) {
+  auto [pt, parameters] = split_first(value, ' ');
+  auto payload_type = parse_int(pt);
+  if (!payload_type) {
+    return std::nullopt;
+  }
+  return SdpFmtp{*payload_type, parameters};
+}
+
+std::optional<SdpExtMap> parse_sdp_extmap(std::string_view value) {
+  auto [id_dir, uri] = split_first(value, ' ');
+  auto id = parse_int(split_first(id_dir, '/').first);
+  if (!id || uri.empty()) {
+    return std::nullopt;
+  }
+  // uri の後ろに拡張属性が付いている場合は取り除く
+  return SdpExtMap{*id, split_first(uri, ' ').first};
+}
+
+std::pair<std::string_view, std::string_view> split_first(std::string_view s,
+                                                          char sep) {
+  size_t n = s.find(sep);
+  if (n == std::string_view::npos) {
+    return std::make_pair(s, std::string_view());
+  }
+  return std::make_pair(s.substr(0, n), s.substr(n + 1));
+}
+
+std::optional<int> parse_int(std::string_view s) {
+  int v;
+  auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (r.ec != std::errc() || r.ptr != s.data() + s.size()) {
+    return std::nullopt;
+  }
+  return v;
+}
+
+std::string insert_sdp_attributes(std::string_view sdp,
+                                  std::string_view type,
+                                  const std::vector<std::string>& attributes) {
+  auto parsed = parse_sdp(sdp);
+  auto media = find_sdp_media(parsed, type);
+  size_t pos = media != nullptr ? media->end : sdp.size();
+
+  std::string lines;
+  for (const auto& attr : attributes) {
+    lines += "a=";
+    lines += attr;
+    lines += "\r\n";
+  }
+  std::string r;
+  r.reserve(sdp.size() + lines.size() + 2);
+  r.append(sdp.substr(0, pos));
+  if (!r.empty() && r.back() != '\n') {
+    r.append("\r\n");
+  }
+  r.append(lines);
+  r.append(sdp.substr(pos));
+  return r;
+}
+
+}  // namespace sorac
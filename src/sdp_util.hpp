@@ -0,0 +1,84 @@
+#ifndef SORAC_SDP_UTIL_HPP_
+#define SORAC_SDP_UTIL_HPP_
+
+#include <stddef.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace sorac {
+
+// SDP を 1 回だけ走査して、メディアセクションと属性の位置を覚えておいたもの。
+// string_view は全て元の SDP 文字列を指しているので、元の文字列より長く使わないこと。
+
+// a=<name>:<value> の行。値が無い属性の場合 value は空になる
+struct SdpAttribute {
+  std::string_view name;
+  std::string_view value;
+};
+
+struct SdpMediaSection {
+  // m=<type> ... の type (video, audio, application など)
+  std::string_view type;
+  // a=mid の値
+  std::string_view mid;
+  // m= 行の先頭から、次の m= 行の先頭（最後のセクションなら SDP の末尾）までの範囲
+  size_t begin;
+  size_t end;
+  std::vector<SdpAttribute> attributes;
+};
+
+struct ParsedSdp {
+  // 最初の m= 行より前にある属性
+  std::vector<SdpAttribute> session_attributes;
+  std::vector<SdpMediaSection> media;
+};
+
+ParsedSdp parse_sdp(std::string_view sdp);
+
+// 最初に見つかった type のメディアセクションを返す。無ければ nullptr
+const SdpMediaSection* find_sdp_media(const ParsedSdp& sdp,
+                                      std::string_view type);
+// 最初に見つかった name の属性の値を返す
+std::optional<std::string_view> find_sdp_attribute(
+    const SdpMediaSection& media,
+    std::string_view name);
+
+// a=rtpmap:<payload type> <encoding name>/<clock rate>[/<channels>]
+struct SdpRtpMap {
+  int payload_type;
+  std::string_view encoding_name;
+  int clock_rate;
+};
+std::optional<SdpRtpMap> parse_sdp_rtpmap(std::string_view value);
+
+// a=fmtp:<payload type> <parameters>
+struct SdpFmtp {
+  int payload_type;
+  std::string_view parameters;
+};
+std::optional<SdpFmtp> parse_sdp_fmtp(std::string_view value);
+
+// a=extmap:<id>[/<direction>] <uri>
+struct SdpExtMap {
+  int id;
+  std::string_view uri;
+};
+std::optional<SdpExtMap> parse_sdp_extmap(std::string_view value);
+
+// s を最初の sep で 2 つに分ける。sep が無い場合、2 つ目は空になる
+std::pair<std::string_view, std::string_view> split_first(std::string_view s,
+                                                          char sep);
+std::optional<int> parse_int(std::string_view s);
+
+// 最初に見つかった type のメディアセクションの末尾に a=<attribute> の行を追加した SDP を返す。
+// type のセクションが無い場合は SDP の末尾に追加する。
+std::string insert_sdp_attributes(std::string_view sdp,
+                                  std::string_view type,
+                                  const std::vector<std::string>& attributes);
+
+}  // namespace sorac
+
+#endif
@@ -1,7 +1,13 @@
 #include "sorac/signaling.hpp"
 
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <optional>
 #include <random>
+#include <thread>
 #include <vector>
 
 // libdatachannel
@@ -14,30 +20,123 @@
 #include <plog/Log.h>
 
 #include "sorac/current_time.hpp"
+#include "sorac/delay_based_bwe.hpp"
+#include "sorac/flexfec_media_handler.hpp"
+#include "sorac/keyframe_request_handler.hpp"
 #include "sorac/open_h264_video_encoder.hpp"
 #include "sorac/opus_audio_encoder.hpp"
+#include "sorac/paced_sender.hpp"
+#include "sorac/rtcp_receiver_report_handler.hpp"
+#include "sorac/rtx_nack_responder.hpp"
 #include "sorac/simulcast_encoder_adapter.hpp"
 #include "sorac/simulcast_media_handler.hpp"
+#include "sorac/transport_cc_handler.hpp"
 #include "sorac/version.hpp"
 
 #if defined(__APPLE__)
 #include "sorac/vt_h26x_video_encoder.hpp"
 #endif
 
+#include "h264_util.hpp"
+#include "rtp_util.hpp"
+#include "sdp_util.hpp"
 #include "sorac/bitrate.hpp"
 #include "util.hpp"
 
 namespace sorac {
 
+// 音声エンコーダの設定。SignalingConfig で指定されていない場合はこの値を使う
 static const int ENCODING_SAMPLE_RATE = 48000;
 static const int ENCODING_CHANNELS = 2;
 static const int ENCODING_FRAME_DURATION_MS = 20;
 static const int ENCODING_BITRATE_KBPS = 128;
 
+// SignalingConfig::pacing_factor が指定されていない場合の値
+static const double DEFAULT_PACING_FACTOR = 2.5;
+// SignalingConfig::flexfec_protection_percent が指定されていない場合の値
+static const int DEFAULT_FLEXFEC_PROTECTION_PERCENT = 10;
+static const int DEFAULT_KEYFRAME_REQUEST_MIN_INTERVAL_MS = 500;
+// 帯域推定の下限と、SoraConnectConfig::video_bit_rate が指定されていない場合の上限
+static const int MIN_BANDWIDTH_ESTIMATE_KBPS = 50;
+static const int MAX_BANDWIDTH_ESTIMATE_KBPS = 15000;
+// シグナリング URL の候補に接続する間隔と、1 つの候補のタイムアウト
+static const int DEFAULT_SIGNALING_CONNECT_STAGGER_MS = 250;
+static const int DEFAULT_SIGNALING_CONNECT_TIMEOUT_MS = 10000;
+// サイマルキャストで扱うレイヤー数の上限
+static const size_t MAX_SIMULCAST_LAYERS = 4;
+// 再接続するまでの待ち時間の初期値と上限
+static const int DEFAULT_RECONNECT_INITIAL_BACKOFF_MS = 500;
+static const int DEFAULT_RECONNECT_MAX_BACKOFF_MS = 30000;
+// PeerConnection が Disconnected のままこの時間が経ったら再接続する
+static const int RECONNECT_DISCONNECTED_TIMEOUT_MS = 5000;
+
+static bool EqualsRtpEncodingParameters(
+    const soracp::RtpEncodingParameters& a,
+    const soracp::RtpEncodingParameters& b) {
+  if (a.enable_parameters != b.enable_parameters ||
+      a.parameters.size() != b.parameters.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.parameters.size(); i++) {
+    const auto& x = a.parameters[i];
+    const auto& y = b.parameters[i];
+    if (x.rid != y.rid || x.active != y.active ||
+        x.has_scale_resolution_down_by() != y.has_scale_resolution_down_by() ||
+        x.scale_resolution_down_by != y.scale_resolution_down_by ||
+        x.has_max_bitrate_bps() != y.has_max_bitrate_bps() ||
+        x.max_bitrate_bps != y.max_bitrate_bps) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// スタートコードで区切られた EncodedImage を、4 バイトの長さで区切った形式に変換する
+static std::vector<std::byte> ToLengthSeparatedNalUnits(
+    const EncodedImage& image) {
+  std::vector<EncodedImage::NalUnitPosition> nal_units = image.nal_units;
+  if (nal_units.empty()) {
+    // エンコーダが NAL ユニットの位置を返さない場合は自分で探す
+    for_each_h264_nal(image.buf.get(), image.size,
+                      [&image, &nal_units](const uint8_t* nal, size_t size) {
+                        nal_units.push_back(
+                            {(int)(nal - image.buf.get()), (int)size});
+                      });
+  }
+  size_t size = 0;
+  for (const auto& n : nal_units) {
+    size += 4 + n.size;
+  }
+  std::vector<std::byte> buf(size);
+  uint8_t* dst = (uint8_t*)buf.data();
+  for (const auto& n : nal_units) {
+    write_u32(dst, (uint32_t)n.size);
+    memcpy(dst + 4, image.buf.get() + n.offset, n.size);
+    dst += 4 + n.size;
+  }
+  return buf;
+}
+
+// stats-req で返すエンコード結果の統計情報
+struct EncodedFrameStats {
+  uint64_t frames_encoded = 0;
+  uint64_t key_frames_encoded = 0;
+  // エンコーダがレート制御などで出力しなかったフレームの数
+  uint64_t frames_skipped = 0;
+  // QP が分かったフレームの QP の合計
+  std::optional<uint64_t> qp_sum;
+};
+
 struct Track {
   std::shared_ptr<rtc::Track> track;
   std::map<std::optional<std::string>, std::shared_ptr<rtc::RtcpSrReporter>>
       senders;
+  std::map<std::optional<std::string>, std::shared_ptr<RtxNackResponder>>
+      nack_responders;
+  std::map<std::optional<std::string>,
+           std::shared_ptr<KeyframeRequestHandler>>
+      keyframe_request_handlers;
+  std::map<std::optional<std::string>, EncodedFrameStats> encoded_stats;
   std::shared_ptr<SimulcastMediaHandler> simulcast_handler;
 };
 
@@ -45,94 +144,95 @@ struct Client {
   std::shared_ptr<rtc::PeerConnection> pc;
 
   std::shared_ptr<Track> video;
-  std::shared_ptr<VideoEncoder> video_encoder;
+  std::shared_ptr<SimulcastEncoderAdapter> video_encoder;
   std::optional<VideoEncoder::Settings> video_encoder_settings;
+  // video_encoder を作った時のコーデックとエンコーディングパラメータ。
+  // 再接続した時に同じであればエンコーダを使い回す。
+  std::string video_encoder_codec;
+  soracp::RtpEncodingParameters video_encoder_params;
 
   std::shared_ptr<Track> audio;
   std::shared_ptr<OpusAudioEncoder> opus_encoder;
 
   nlohmann::json data_channel_metadata;
   std::map<std::string, std::shared_ptr<sorac::DataChannel>> dcs;
+
+  // 次に作る local description を送る時の type と送信先。
+  // 最初の offer は WebSocket に "answer" を返し、
+  // re-offer や update は受け取った経路に "re-answer" や "update" を返す。
+  std::string answer_type = "answer";
+  // nullptr の場合は WebSocket に送る
+  std::shared_ptr<sorac::DataChannel> answer_dc;
+
+  // transport-cc がネゴシエーションされた場合の送信側の処理
+  std::shared_ptr<TransportCcSender> transport_cc;
+  // transport-cc のフィードバックから推定した送信可能なビットレート
+  std::shared_ptr<std::atomic<int64_t>> bandwidth_estimate_bps;
+
+  // 各トラックの MediaHandler からは weak_ptr で参照しているので、
+  // ここで破棄すればキューに残っているパケットも含めて送信が止まる。
+  // トラックより先に破棄されるように最後に置いておくこと。
+  std::shared_ptr<PacedSender> pacer;
 };
 
 class SignalingImpl : public Signaling {
  public:
-  SignalingImpl(const soracp::SignalingConfig& config) : config_(config) {}
-
-  void Connect(const soracp::SoraConnectConfig& sora_config) override {
-    sora_config_ = sora_config;
+  SignalingImpl(const soracp::SignalingConfig& config)
+      : state_notifier_(std::make_shared<StateNotifier>()), config_(config) {
+    state_notify_thread_ = std::thread(
+        [notifier = state_notifier_]() { RunStateNotify(notifier); });
+  }
 
-    // ランダムに並び替える
-    auto urls = config_.signaling_url_candidates;
+  ~SignalingImpl() override {
     {
-      std::random_device seed_gen;
-      std::mt19937 engine(seed_gen());
-      std::shuffle(urls.begin(), urls.end(), engine);
+      std::lock_guard<std::mutex> lock(state_notifier_->mutex);
+      state_notifier_->stopped = true;
     }
-
-    for (const auto& url : urls) {
-      // TODO(melpon): Proxy 対応
-
-      rtc::WebSocket::Configuration ws_config;
-      if (!config_.ca_certificate.empty()) {
-        ws_config.caCertificatePemFile = config_.ca_certificate;
-      }
-      auto ws = std::make_shared<rtc::WebSocket>(ws_config);
-      ws->onOpen([this, url, wws = std::weak_ptr<rtc::WebSocket>(ws)]() {
-        PLOG_DEBUG << "onOpen: url=" << url;
-        {
-          std::unique_lock<std::mutex> lock(ws_mutex_, std::try_to_lock);
-          if (!lock) {
-            PLOG_DEBUG << "Maybe WebSocket is already connected";
-            return;
-          }
-          {
-            auto ws = wws.lock();
-            if (ws_ != nullptr || ws == nullptr) {
-              PLOG_DEBUG << "WebSocket is already connected";
-              return;
-            }
-            ws_ = ws;
-          }
-          //for (auto& ws : connecting_wss_) {
-          //  if (ws == ws_) {
-          //    continue;
-          //  }
-          //  ws->close();
-          //}
-          connecting_wss_.clear();
-        }
-        OnOpen(false);
-      });
-      ws->onError([this](std::string s) {
-        PLOG_DEBUG << "WebSocket error: " << s;
-        OnError(s);
-      });
-      ws->onClosed([this]() {
-        PLOG_DEBUG << "WebSocket closed";
-        OnClosed();
-      });
-      ws->onMessage([this](rtc::message_variant data) { OnMessage(data); });
-
-      {
-        std::lock_guard<std::mutex> lock(ws_mutex_);
-        connecting_wss_.push_back(ws);
-      }
+    state_notifier_->cv.notify_all();
+    // 状態変化のコールバックの中で破棄された場合は自分自身を join できないので切り離す。
+    // 通知スレッドは state_notifier_ しか参照しないので、this が破棄されても問題ない。
+    if (std::this_thread::get_id() == state_notify_thread_.get_id()) {
+      state_notify_thread_.detach();
+    } else if (state_notify_thread_.joinable()) {
+      state_notify_thread_.join();
     }
+    {
+      std::lock_guard<std::mutex> lock(reconnect_mutex_);
+      reconnect_stopped_ = true;
+    }
+    reconnect_cv_.notify_all();
+    if (reconnect_thread_.joinable()) {
+      reconnect_thread_.join();
+    }
+    // ws_ や PeerConnection を閉じてコールバックを外しておかないと、
+    // 破棄した this をコールバックから参照してしまう
+    ResetClient(false);
+  }
 
-    for (int i = 0; i < urls.size(); i++) {
-      PLOG_DEBUG << "Connect to: " << urls[i];
-      std::shared_ptr<rtc::WebSocket> ws;
-      {
-        std::lock_guard<std::mutex> lock(ws_mutex_);
-        ws = connecting_wss_[i];
+  void Connect(const soracp::SoraConnectConfig& sora_config) override {
+    {
+      std::lock_guard<std::mutex> lock(reconnect_mutex_);
+      reconnect_attempts_ = 0;
+      reconnect_at_ = std::nullopt;
+      disconnected_since_ = std::nullopt;
+      if (!reconnect_thread_.joinable()) {
+        reconnect_thread_ = std::thread([this]() { RunReconnect(); });
       }
-
-      ws->open(urls[i]);
     }
+    SetState(soracp::SIGNALING_STATE_CONNECTING);
+
+    std::lock_guard<std::mutex> lock(connect_mutex_);
+    ResetClient(false);
+    sora_config_ = sora_config;
+    StartConnect();
   }
 
   void SendVideoFrame(const VideoFrame& frame) override {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+    // 再接続中はトラックが無いので捨てる
+    if (client_.video_encoder == nullptr || client_.video == nullptr) {
+      return;
+    }
     if (!client_.video_encoder_settings ||
         frame.base_width != client_.video_encoder_settings->width ||
         frame.base_height != client_.video_encoder_settings->height) {
@@ -141,14 +241,31 @@ class SignalingImpl : public Signaling {
       settings.width = frame.base_width;
       settings.height = frame.base_height;
       settings.bitrate = Kbps(config_.video_encoder_initial_bitrate_kbps);
+      settings.loss_recovery =
+          config_.video_loss_recovery == soracp::VIDEO_LOSS_RECOVERY_LTR
+              ? VideoEncoder::Settings::LossRecovery::kLongTermReference
+              : VideoEncoder::Settings::LossRecovery::kIdr;
       if (!client_.video_encoder->InitEncode(settings)) {
         PLOG_ERROR << "Failed to InitEncode()";
         return;
       }
       client_.video_encoder_settings = settings;
+      if (client_.pacer != nullptr) {
+        client_.pacer->SetBitrate(PacedSender::Priority::kVideo,
+                                  settings.bitrate);
+      }
       client_.video_encoder->SetEncodeCallback([this, initial_timestamp =
                                                           get_current_time()](
                                                    const EncodedImage& image) {
+        std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+        if (client_.video == nullptr) {
+          return;
+        }
+        if (image.frame_type == EncodedImage::FrameType::kSkip) {
+          // 送るデータは無いので数えるだけ
+          client_.video->encoded_stats[image.rid].frames_skipped += 1;
+          return;
+        }
         auto sender = client_.video->senders[image.rid];
         auto rtp_config = sender->rtpConfig;
         auto elapsed_seconds =
@@ -161,8 +278,22 @@ class SignalingImpl : public Signaling {
         if (rtp_config->timestampToSeconds(report_elapsed_timestamp) > 0.2) {
           sender->setNeedsToReport();
         }
-        std::vector<std::byte> buf((std::byte*)image.buf.get(),
-                                   (std::byte*)image.buf.get() + image.size);
+        auto& stats = client_.video->encoded_stats[image.rid];
+        stats.frames_encoded += 1;
+        if (image.frame_type == EncodedImage::FrameType::kKey) {
+          stats.key_frames_encoded += 1;
+        }
+        if (image.qp) {
+          stats.qp_sum = stats.qp_sum.value_or(0) + *image.qp;
+        }
+        // パケタイザは NAL ユニットの長さで区切る設定にしているので、
+        // スタートコードで区切られている場合は変換する
+        std::vector<std::byte> buf =
+            image.nal_separator == EncodedImage::NalSeparator::kLength
+                ? std::vector<std::byte>(
+                      (std::byte*)image.buf.get(),
+                      (std::byte*)image.buf.get() + image.size)
+                : ToLengthSeparatedNalUnits(image);
         client_.video->simulcast_handler->config()->rid = image.rid;
         client_.video->track->send(buf);
       });
@@ -171,6 +302,10 @@ class SignalingImpl : public Signaling {
   }
 
   void SendAudioFrame(const AudioFrame& frame) override {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+    if (client_.opus_encoder == nullptr || client_.audio == nullptr) {
+      return;
+    }
     client_.opus_encoder->Encode(frame);
   }
 
@@ -194,10 +329,62 @@ class SignalingImpl : public Signaling {
     on_push_ = on_push;
   }
 
+  void SetOnStateChange(std::function<void(soracp::SignalingState)>
+                            on_state_change) override {
+    std::lock_guard<std::mutex> lock(state_notifier_->mutex);
+    state_notifier_->on_state_change = on_state_change;
+  }
+
   soracp::RtpEncodingParameters GetRtpEncodingParameters() const override {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
     return rtp_encoding_params_;
   }
 
+  void SetRtpEncodingActive(const std::string& rid, bool active) override {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+    nlohmann::json enc = {{"rid", rid}, {"active", active}};
+    UpdateRtpEncodingParameters(nlohmann::json::array({enc}));
+  }
+
+  void SetVideoEncoderFactory(
+      std::function<std::shared_ptr<VideoEncoder>(const std::string& codec)>
+          factory) override {
+    video_encoder_factory_ = factory;
+  }
+
+  SignalingStats GetStats() const override {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+    SignalingStats stats;
+    if (client_.bandwidth_estimate_bps != nullptr) {
+      stats.available_outgoing_bitrate_bps =
+          client_.bandwidth_estimate_bps->load();
+    }
+    if (client_.video == nullptr) {
+      return stats;
+    }
+    for (const auto& [rid, nack_responder] : client_.video->nack_responders) {
+      auto s = nack_responder->GetStats();
+      stats.video_packets_sent += s.packets_sent;
+      stats.video_bytes_sent += s.bytes_sent;
+      stats.video_nack_count += s.nack_count;
+    }
+    for (const auto& [rid, handler] :
+         client_.video->keyframe_request_handlers) {
+      auto s = handler->GetStats();
+      stats.video_pli_count += s.pli_count;
+      stats.video_fir_count += s.fir_count;
+      stats.video_keyframe_requests_forwarded += s.keyframe_request_count;
+      stats.video_keyframe_requests_dropped +=
+          s.keyframe_request_dropped_count;
+    }
+    for (const auto& [rid, s] : client_.video->encoded_stats) {
+      stats.video_frames_encoded += s.frames_encoded;
+      stats.video_key_frames_encoded += s.key_frames_encoded;
+      stats.video_frames_skipped += s.frames_skipped;
+    }
+    return stats;
+  }
+
  private:
   void OnMessage(rtc::message_variant data) {
     if (!std::holds_alternative<std::string>(data)) {
@@ -211,28 +398,48 @@ class SignalingImpl : public Signaling {
     if (js["type"] == "redirect") {
       const std::string location = js["location"].get<std::string>();
       // location に繋ぎ直す
-      GetWebSocket()->close();
       rtc::WebSocket::Configuration ws_config;
       if (!config_.ca_certificate.empty()) {
         ws_config.caCertificatePemFile = config_.ca_certificate;
       }
       auto ws = std::make_shared<rtc::WebSocket>(ws_config);
+      auto wws = std::weak_ptr<rtc::WebSocket>(ws);
       ws->onOpen([this, ws, location]() {
         PLOG_DEBUG << "onOpen (redirected): url=" << location;
         OnOpen(true);
       });
-      ws->onError([this](std::string s) {
+      ws->onError([this, wws](std::string s) {
         PLOG_DEBUG << "WebSocket error: " << s;
+        if (wws.lock() != GetWebSocket()) {
+          return;
+        }
         OnError(s);
       });
-      ws->onClosed([this]() {
+      ws->onClosed([this, wws]() {
         PLOG_DEBUG << "WebSocket closed";
+        if (wws.lock() != GetWebSocket()) {
+          return;
+        }
         OnClosed();
       });
-      ws->onMessage([this](rtc::message_variant data) { OnMessage(data); });
+      ws->onMessage([this, wws](rtc::message_variant data) {
+        if (wws.lock() != GetWebSocket()) {
+          return;
+        }
+        OnMessage(data);
+      });
+      // 先に ws_ を差し替えて、古い接続の onClosed を無視させる
+      std::shared_ptr<rtc::WebSocket> old_ws;
+      {
+        std::lock_guard<std::mutex> lock(ws_mutex_);
+        old_ws = ws_;
+        ws_ = ws;
+      }
+      old_ws->close();
       ws->open(location);
-      ws_ = ws;
     } else if (js["type"] == "offer") {
+      // トラックの準備が終わるまでは映像や音声を送らないようにする
+      std::unique_lock<std::recursive_mutex> client_lock(client_mutex_);
       rtc::Configuration config;
       for (auto& ice_server : js["config"]["iceServers"]) {
         rtc::IceServer s(ice_server["urls"][0].get<std::string>());
@@ -241,6 +448,7 @@ class SignalingImpl : public Signaling {
         config.iceServers.push_back(s);
       }
 
+      rtp_encoding_params_ = soracp::RtpEncodingParameters();
       if (js["simulcast"].get<bool>()) {
         rtp_encoding_params_.enable_parameters = true;
         for (auto& enc : js["encodings"]) {
@@ -268,24 +476,71 @@ class SignalingImpl : public Signaling {
           }
           rtp_encoding_params_.parameters.push_back(p);
         }
+        auto& params = rtp_encoding_params_.parameters;
+        if (params.size() > MAX_SIMULCAST_LAYERS) {
+          PLOG_WARNING << "Too many simulcast encodings: " << params.size()
+                       << ", use first " << MAX_SIMULCAST_LAYERS;
+          params.resize(MAX_SIMULCAST_LAYERS);
+        }
+        // 解像度の指定が無いレイヤーは、最後のレイヤーを元の解像度として
+        // 1 つ前に行くごとに半分にする
+        for (size_t i = 0; i < params.size(); i++) {
+          if (!params[i].has_scale_resolution_down_by()) {
+            params[i].set_scale_resolution_down_by(
+                (double)(1 << (params.size() - 1 - i)));
+          }
+        }
       }
 
       client_.data_channel_metadata = js["data_channels"];
+      if (!config_.disable_pacer) {
+        client_.pacer = std::make_shared<PacedSender>(
+            config_.pacing_factor > 0 ? config_.pacing_factor
+                                      : DEFAULT_PACING_FACTOR);
+      }
       client_.pc = std::make_shared<rtc::PeerConnection>(config);
       client_.pc->onLocalDescription([this](rtc::Description desc) {
-        auto sdp = desc.generateSdp();
-        sdp += "a=rid:r0 send\r\n";
-        sdp += "a=rid:r1 send\r\n";
-        sdp += "a=rid:r2 send\r\n";
-        sdp += "a=simulcast:send r0;r1;r2\r\n";
+        // rtp_encoding_params_ は re-offer や SetRtpEncodingActive() で
+        // 他のスレッドから書き換えられるので、ロックを取ってコピーしておく
+        soracp::RtpEncodingParameters params;
+        std::string type;
+        std::shared_ptr<sorac::DataChannel> dc;
+        {
+          std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+          params = rtp_encoding_params_;
+          type = client_.answer_type;
+          dc = client_.answer_dc;
+        }
+        // サイマルキャストの場合は、offer の encodings に合わせて rid を追加する
+        std::vector<std::string> attributes;
+        if (params.enable_parameters) {
+          std::string rids;
+          for (const auto& p : params.parameters) {
+            attributes.push_back("rid:" + p.rid + " send");
+            rids += (rids.empty() ? "" : ";") + p.rid;
+          }
+          attributes.push_back("simulcast:send " + rids);
+        }
+        auto sdp =
+            insert_sdp_attributes(desc.generateSdp(), "video", attributes);
         PLOG_DEBUG << "answer sdp:" << sdp;
         nlohmann::json js = {
-            {"type", desc.typeString()},
+            {"type", type},
             {"sdp", sdp},
         };
         PLOG_DEBUG << "onLocalDescription: send=" << js.dump();
 
-        GetWebSocket()->send(js.dump());
+        std::string str = js.dump();
+        if (dc != nullptr) {
+          dc->Send((const uint8_t*)str.data(), str.size());
+          return;
+        }
+        auto ws = GetWebSocket();
+        if (ws == nullptr) {
+          PLOG_WARNING << "WebSocket is already closed";
+          return;
+        }
+        ws->send(str);
       });
       client_.pc->onLocalCandidate([this](rtc::Candidate candidate) {
         nlohmann::json js = {
@@ -294,16 +549,24 @@ class SignalingImpl : public Signaling {
         };
         PLOG_DEBUG << "onLocalCandidate: send=" << js.dump();
 
-        GetWebSocket()->send(js.dump());
+        auto ws = GetWebSocket();
+        if (ws == nullptr) {
+          PLOG_WARNING << "WebSocket is already closed";
+          return;
+        }
+        ws->send(js.dump());
       });
       client_.pc->onDataChannel([this](std::shared_ptr<rtc::DataChannel> rdc) {
         auto label = rdc->label();
         PLOG_DEBUG << "onDataChannel: label=" << label;
         bool compress = false;
-        for (const auto& d : client_.data_channel_metadata) {
-          if (d["label"] == label) {
-            compress = d["compress"].get<bool>();
-            break;
+        {
+          std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+          for (const auto& d : client_.data_channel_metadata) {
+            if (d["label"] == label) {
+              compress = d["compress"].get<bool>();
+              break;
+            }
           }
         }
         std::shared_ptr<DataChannel> dc = CreateDataChannel(rdc, compress);
@@ -326,7 +589,7 @@ class SignalingImpl : public Signaling {
             nlohmann::json js = nlohmann::json::parse(buf, buf + size);
             if (js["type"] == "stats-req") {
               nlohmann::json js = {{"type", "stats"},
-                                   {"reports", nlohmann::json::array()}};
+                                   {"reports", CollectStats()}};
               PLOG_DEBUG << "stats: " << js.dump();
               std::string str = js.dump();
               dc->Send((const uint8_t*)str.data(), str.size());
@@ -346,6 +609,19 @@ class SignalingImpl : public Signaling {
               on_notify_(message);
             }
           });
+        } else if (label == "signaling") {
+          dc->SetOnMessage([this, wdc](const uint8_t* buf, size_t size) {
+            auto dc = wdc.lock();
+            if (dc == nullptr) {
+              return;
+            }
+            PLOG_DEBUG << "onMessage: label=" << dc->GetLabel()
+                       << ", message=" << std::string((const char*)buf, size);
+            nlohmann::json js = nlohmann::json::parse(buf, buf + size);
+            if (js["type"] == "re-offer" || js["type"] == "update") {
+              OnReOffer(js, dc);
+            }
+          });
         } else if (label == "push") {
           dc->SetOnMessage([this, wdc](const uint8_t* buf, size_t size) {
             auto dc = wdc.lock();
@@ -361,6 +637,7 @@ class SignalingImpl : public Signaling {
             }
           });
         }
+        std::lock_guard<std::recursive_mutex> lock(client_mutex_);
         client_.dcs[label] = dc;
       });
       client_.pc->onGatheringStateChange(
@@ -374,9 +651,12 @@ class SignalingImpl : public Signaling {
           [](rtc::PeerConnection::SignalingState state) {
             PLOG_DEBUG << "onSignalingStateChange: " << state;
           });
-      client_.pc->onStateChange([](rtc::PeerConnection::State state) {
-        PLOG_DEBUG << "onStateChange: " << state;
-      });
+      client_.pc->onStateChange(
+          [this, wpc = std::weak_ptr<rtc::PeerConnection>(client_.pc)](
+              rtc::PeerConnection::State state) {
+            PLOG_DEBUG << "onStateChange: " << state;
+            OnPeerConnectionStateChange(wpc.lock(), state);
+          });
       client_.pc->onTrack([](std::shared_ptr<rtc::Track> track) {
         PLOG_DEBUG << "onTrack: " << track->mid();
       });
@@ -386,69 +666,137 @@ class SignalingImpl : public Signaling {
       PLOG_DEBUG << "---------- offer sdp ----------";
       PLOG_DEBUG << sdp;
       PLOG_DEBUG << "-------------------------------";
-      auto lines = split_with(sdp, "\r\n");
+      // ここで取り出した string_view は sdp を指しているので、sdp より長く使わないこと
+      auto parsed_sdp = parse_sdp(sdp);
       auto cname = "cname-" + generate_random_string(24);
       auto msid = "msid-" + generate_random_string(24);
       auto track_id = "trackid-" + generate_random_string(24);
+      // transport-cc の拡張ヘッダの ID を調べる。
+      // BUNDLE しているので、どのメディアでも同じ ID になっている。
+      std::optional<int> transport_cc_id;
+      for (const auto& media : parsed_sdp.media) {
+        for (const auto& attr : media.attributes) {
+          if (attr.name != "extmap") {
+            continue;
+          }
+          auto extmap = parse_sdp_extmap(attr.value);
+          if (extmap && extmap->uri == TRANSPORT_CC_EXTENSION_URI) {
+            transport_cc_id = extmap->id;
+            break;
+          }
+        }
+        if (transport_cc_id) {
+          break;
+        }
+      }
+      if (transport_cc_id) {
+        PLOG_DEBUG << "transport_cc_id=" << *transport_cc_id;
+        client_.transport_cc =
+            std::make_shared<TransportCcSender>(*transport_cc_id);
+        auto bwe = std::make_shared<DelayBasedBwe>(
+            Kbps(config_.video_encoder_initial_bitrate_kbps),
+            Kbps(MIN_BANDWIDTH_ESTIMATE_KBPS),
+            Kbps(sora_config_.video_bit_rate != 0
+                     ? sora_config_.video_bit_rate
+                     : MAX_BANDWIDTH_ESTIMATE_KBPS));
+        client_.bandwidth_estimate_bps =
+            std::make_shared<std::atomic<int64_t>>(bwe->GetEstimate().count());
+        client_.transport_cc->SetOnFeedback(
+            [bwe, estimate = client_.bandwidth_estimate_bps](
+                const std::vector<TransportCcPacketResult>& results) {
+              *estimate = bwe->OnFeedback(results).count();
+            });
+      }
       // video
       {
-        // m=video から他の m= が出てくるまでの間のデータを取得する
-        std::vector<std::string> video_lines;
-        {
-          auto it = std::find_if(
-              lines.begin(), lines.end(),
-              [](const std::string& s) { return starts_with(s, "m=video"); });
-          if (it != lines.end()) {
-            auto it2 = std::find_if(
-                it + 1, lines.end(),
-                [](const std::string& s) { return starts_with(s, "m="); });
-            video_lines.assign(it, it2);
-          }
+        const SdpMediaSection* video_section =
+            find_sdp_media(parsed_sdp, "video");
+        if (video_section == nullptr) {
+          PLOG_ERROR << "m=video not found";
+          return;
         }
         // mid, payload_type, codec
-        std::string mid;
+        std::string mid(video_section->mid);
+        PLOG_DEBUG << "mid=" << mid;
         int payload_type;
         std::string codec;
         {
-          auto get_value =
-              [&video_lines](const std::string& search) -> std::string {
-            auto it = std::find_if(video_lines.begin(), video_lines.end(),
-                                   [&search](const std::string& s) {
-                                     return starts_with(s, search);
-                                   });
-            if (it == video_lines.end()) {
-              return "";
-            }
-            return it->substr(search.size());
-          };
-          mid = get_value("a=mid:");
-          PLOG_DEBUG << "mid=" << mid;
-          auto xs = split_with(get_value("a=msid:"), " ");
-          auto rtpmap = get_value("a=rtpmap:");
-          auto ys = split_with(rtpmap, " ");
-          payload_type = std::stoi(ys[0]);
-          codec = split_with(ys[1], "/")[0];
+          auto rtpmap =
+              parse_sdp_rtpmap(find_sdp_attribute(*video_section, "rtpmap")
+                                   .value_or(std::string_view()));
+          if (!rtpmap) {
+            PLOG_ERROR << "Invalid rtpmap for video";
+            return;
+          }
+          payload_type = rtpmap->payload_type;
+          codec = std::string(rtpmap->encoding_name);
           PLOG_DEBUG << "payload_type=" << payload_type << ", codec=" << codec;
         }
-        // サイマルキャストの場合、拡張ヘッダーのどの ID を使えば良いか調べる
-        if (IsSimulcast()) {
-          auto it = std::find_if(
-              video_lines.begin(), video_lines.end(), [](const std::string& s) {
-                return starts_with(s, "a=extmap:") &&
-                       s.find(
-                           "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id") !=
-                           std::string::npos;
-              });
-          auto xs = split_with(*it, " ");
-          auto ys = split_with(xs[0], ":");
-          rtp_stream_id_ = std::stoi(ys[1]);
-          PLOG_DEBUG << "rtp_stream_id=" << rtp_stream_id_;
+        // RTX と FlexFEC の payload type と、
+        // サイマルキャストの場合に拡張ヘッダーのどの ID を使えば良いかを調べる。
+        // RTX は a=fmtp:<rtx_payload_type> apt=<payload_type> を探して、
+        // FlexFEC は有効で、offer に含まれている場合だけ使う。
+        std::optional<int> rtx_payload_type;
+        std::optional<int> flexfec_payload_type;
+        // apt が payload_type を指している payload type と、rtx の payload type
+        std::vector<int> rtx_candidates;
+        std::vector<int> rtx_payload_types;
+        for (const auto& attr : video_section->attributes) {
+          if (attr.name == "extmap") {
+            auto extmap = parse_sdp_extmap(attr.value);
+            if (IsSimulcast() && extmap &&
+                extmap->uri ==
+                    "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id") {
+              rtp_stream_id_ = extmap->id;
+              PLOG_DEBUG << "rtp_stream_id=" << rtp_stream_id_;
+            }
+          } else if (attr.name == "fmtp") {
+            auto fmtp = parse_sdp_fmtp(attr.value);
+            if (!fmtp) {
+              continue;
+            }
+            auto [key, value] =
+                split_first(split_first(fmtp->parameters, ';').first, '=');
+            if (key == "apt" && parse_int(value) == payload_type) {
+              rtx_candidates.push_back(fmtp->payload_type);
+            }
+          } else if (attr.name == "rtpmap") {
+            auto rtpmap = parse_sdp_rtpmap(attr.value);
+            if (!rtpmap) {
+              continue;
+            }
+            if (rtpmap->encoding_name == "rtx") {
+              rtx_payload_types.push_back(rtpmap->payload_type);
+            } else if (config_.enable_flexfec &&
+                       rtpmap->encoding_name == "flexfec-03" &&
+                       !flexfec_payload_type) {
+              flexfec_payload_type = rtpmap->payload_type;
+              PLOG_DEBUG << "flexfec_payload_type=" << *flexfec_payload_type;
+            }
+          }
+        }
+        for (int pt : rtx_candidates) {
+          if (std::find(rtx_payload_types.begin(), rtx_payload_types.end(),
+                        pt) != rtx_payload_types.end()) {
+            rtx_payload_type = pt;
+            PLOG_DEBUG << "rtx_payload_type=" << *rtx_payload_type;
+            break;
+          }
+        }
+        if (config_.enable_flexfec && !flexfec_payload_type) {
+          PLOG_WARNING << "FlexFEC is not offered";
         }
 
         std::shared_ptr<rtc::Track> track;
         std::map<std::optional<std::string>,
                  std::shared_ptr<rtc::RtcpSrReporter>>
             sr_reporters;
+        std::map<std::optional<std::string>, std::shared_ptr<RtxNackResponder>>
+            nack_responders;
+        std::map<std::optional<std::string>,
+                 std::shared_ptr<KeyframeRequestHandler>>
+            keyframe_request_handlers;
+        std::vector<std::shared_ptr<FlexfecMediaHandler>> fec_handlers;
 
         auto video = rtc::Description::Video(mid);
         if (codec == "H264") {
@@ -456,16 +804,48 @@ class SignalingImpl : public Signaling {
         } else {
           video.addH265Codec(payload_type);
         }
+        if (rtx_payload_type) {
+          video.addRtxCodec(*rtx_payload_type, payload_type,
+                            rtc::H264RtpPacketizer::defaultClockRate);
+        }
+        if (flexfec_payload_type) {
+          video.addVideoCodec(*flexfec_payload_type, "flexfec-03",
+                              "repair-window=10000000");
+        }
+        if (transport_cc_id) {
+          video.addExtMap(rtc::Description::Entry::ExtMap(
+              *transport_cc_id, TRANSPORT_CC_EXTENSION_URI));
+          video.addAttribute("rtcp-fb:" + std::to_string(payload_type) +
+                             " transport-cc");
+        }
         std::map<std::optional<std::string>, uint32_t> ssrcs;
-        if (!IsSimulcast()) {
+        std::map<std::optional<std::string>, uint32_t> rtx_ssrcs;
+        std::map<std::optional<std::string>, uint32_t> fec_ssrcs;
+        auto add_ssrc = [&](std::optional<std::string> rid) {
           uint32_t ssrc = generate_random_number();
           video.addSSRC(ssrc, cname, msid, track_id);
-          ssrcs.insert(std::make_pair(std::nullopt, ssrc));
+          ssrcs.insert(std::make_pair(rid, ssrc));
+          if (rtx_payload_type) {
+            // 再送は元の SSRC とは別の SSRC で送る
+            uint32_t rtx_ssrc = generate_random_number();
+            video.addSSRC(rtx_ssrc, cname, msid, track_id);
+            video.addAttribute("ssrc-group:FID " + std::to_string(ssrc) + " " +
+                               std::to_string(rtx_ssrc));
+            rtx_ssrcs.insert(std::make_pair(rid, rtx_ssrc));
+          }
+          if (flexfec_payload_type) {
+            uint32_t fec_ssrc = generate_random_number();
+            video.addSSRC(fec_ssrc, cname, msid, track_id);
+            video.addAttribute("ssrc-group:FEC-FR " + std::to_string(ssrc) +
+                               " " + std::to_string(fec_ssrc));
+            fec_ssrcs.insert(std::make_pair(rid, fec_ssrc));
+          }
+        };
+        if (!IsSimulcast()) {
+          add_ssrc(std::nullopt);
         } else {
           for (const auto& p : rtp_encoding_params_.parameters) {
-            uint32_t ssrc = generate_random_number();
-            video.addSSRC(ssrc, cname, msid, track_id);
-            ssrcs.insert(std::make_pair(p.rid, ssrc));
+            add_ssrc(p.rid);
           }
         }
         track = client_.pc->addTrack(video);
@@ -489,20 +869,99 @@ class SignalingImpl : public Signaling {
           std::shared_ptr<rtc::RtpPacketizer> packetizer;
           if (codec == "H264") {
             packetizer = std::make_shared<rtc::H264RtpPacketizer>(
-                rtc::NalUnit::Separator::LongStartSequence, rtp_config);
+                rtc::NalUnit::Separator::Length, rtp_config);
           } else {
             packetizer = std::make_shared<rtc::H265RtpPacketizer>(
-                rtc::NalUnit::Separator::LongStartSequence, rtp_config);
+                rtc::NalUnit::Separator::Length, rtp_config);
           }
           auto sr_reporter = std::make_shared<rtc::RtcpSrReporter>(rtp_config);
           packetizer->addToChain(sr_reporter);
-          auto nack_responder = std::make_shared<rtc::RtcpNackResponder>();
+          RtxNackResponderConfig nack_config;
+          nack_config.ssrc = ssrc;
+          if (rtx_payload_type) {
+            nack_config.rtx_ssrc = rtx_ssrcs[rid];
+            nack_config.rtx_payload_type = *rtx_payload_type;
+          }
+          nack_config.max_bitrate =
+              Kbps(config_.video_encoder_initial_bitrate_kbps);
+          if (IsSimulcast() &&
+              rtp_encoding_params_.parameters[i].has_max_bitrate_bps()) {
+            nack_config.max_bitrate =
+                Bps(rtp_encoding_params_.parameters[i].max_bitrate_bps);
+          }
+          nack_config.pacer = client_.pacer;
+          nack_config.transport_cc = client_.transport_cc;
+          // LTR で回復する場合は、再送できないパケットロスだけを LTR で回復させる。
+          // PLI や FIR は LTR を持っていない受信者 (SFU に後から参加した受信者など) からも
+          // 来るので、そちらは常に IDR にする。
+          if (config_.video_loss_recovery == soracp::VIDEO_LOSS_RECOVERY_LTR) {
+            nack_config.on_unrecoverable_loss = [this, rid]() {
+              auto video_encoder = GetVideoEncoderRef();
+              if (video_encoder == nullptr) {
+                return;
+              }
+              if (rid) {
+                video_encoder->RequestLossRecovery(*rid);
+              } else {
+                video_encoder->RequestLossRecovery();
+              }
+            };
+          }
+          auto nack_responder =
+              std::make_shared<RtxNackResponder>(nack_config);
           packetizer->addToChain(nack_responder);
-          auto pli_handler = std::make_shared<rtc::PliHandler>([this]() {
-            PLOG_DEBUG << "PLI or FIR received";
-            client_.video_encoder->ForceIntraNextFrame();
-          });
-          packetizer->addToChain(pli_handler);
+          nack_responders[rid] = nack_responder;
+          // PLI や FIR は対象の SSRC のレイヤーだけキーフレームにする
+          KeyframeRequestHandlerConfig keyframe_config;
+          keyframe_config.ssrc = ssrc;
+          keyframe_config.coalesce_window =
+              std::chrono::milliseconds(config_.keyframe_request_coalesce_ms);
+          keyframe_config.min_interval = std::chrono::milliseconds(
+              config_.has_keyframe_request_min_interval_ms()
+                  ? config_.keyframe_request_min_interval_ms
+                  : DEFAULT_KEYFRAME_REQUEST_MIN_INTERVAL_MS);
+          // RTCP を受信したスレッドから呼ばれるので、エンコード中に取られている
+          // client_mutex_ は取らずに、フラグを立てるだけの ForceIntraNextFrame() を呼ぶ
+          keyframe_config.on_keyframe_request = [this, rid]() {
+            auto video_encoder = GetVideoEncoderRef();
+            if (video_encoder == nullptr) {
+              return;
+            }
+            if (rid) {
+              video_encoder->ForceIntraNextFrame(*rid);
+            } else {
+              video_encoder->ForceIntraNextFrame();
+            }
+          };
+          auto keyframe_handler =
+              std::make_shared<KeyframeRequestHandler>(keyframe_config);
+          packetizer->addToChain(keyframe_handler);
+          keyframe_request_handlers[rid] = keyframe_handler;
+          if (flexfec_payload_type) {
+            FlexfecMediaHandlerConfig fec_config;
+            fec_config.ssrc = ssrc;
+            fec_config.fec_ssrc = fec_ssrcs[rid];
+            fec_config.payload_type = *flexfec_payload_type;
+            fec_config.protection_percent =
+                config_.flexfec_protection_percent > 0
+                    ? config_.flexfec_protection_percent
+                    : DEFAULT_FLEXFEC_PROTECTION_PERCENT;
+            fec_config.transport_cc = client_.transport_cc;
+            auto fec_handler =
+                std::make_shared<FlexfecMediaHandler>(fec_config);
+            // FEC はペーサーと transport-cc の後ろで生成するので、ここではつながない
+            fec_handlers.push_back(fec_handler);
+            // 受信側のパケットロス率に応じて FEC パケットの割合を変える
+            packetizer->addToChain(std::make_shared<RtcpReceiverReportHandler>(
+                ssrc, [wfec_handler = std::weak_ptr<FlexfecMediaHandler>(
+                           fec_handler)](const RtcpReportBlock& block) {
+                  auto fec_handler = wfec_handler.lock();
+                  if (fec_handler == nullptr) {
+                    return;
+                  }
+                  fec_handler->SetPacketLossRate(block.fraction_lost / 256.0f);
+                }));
+          }
 
           if (!IsSimulcast()) {
             simulcast_handler->addToChain(packetizer);
@@ -517,6 +976,21 @@ class SignalingImpl : public Signaling {
 
           sr_reporters[rid] = sr_reporter;
         }
+        if (client_.pacer != nullptr) {
+          // 全てのパケタイザの後ろにつながるように最後に追加する
+          simulcast_handler->addToChain(std::make_shared<PacingMediaHandler>(
+              client_.pacer, PacedSender::Priority::kVideo));
+        }
+        if (client_.transport_cc != nullptr) {
+          // 送信する直前に振る必要があるのでペーサーより後ろに追加する
+          simulcast_handler->addToChain(
+              std::make_shared<TransportCcMediaHandler>(client_.transport_cc));
+        }
+        for (const auto& fec_handler : fec_handlers) {
+          // transport-wide sequence number を書き込んだ後のパケットから FEC を生成する。
+          // FEC パケットには FlexfecMediaHandler が自分で sequence number を振る
+          simulcast_handler->addToChain(fec_handler);
+        }
         track->setMediaHandler(simulcast_handler);
 
         track->onOpen([this, wtrack = std::weak_ptr<rtc::Track>(track),
@@ -529,7 +1003,11 @@ class SignalingImpl : public Signaling {
 
           std::function<std::shared_ptr<VideoEncoder>()> create_encoder;
 
-          if (codec == "H264") {
+          if (video_encoder_factory_) {
+            create_encoder = [factory = video_encoder_factory_, codec]() {
+              return factory(codec);
+            };
+          } else if (codec == "H264") {
             if (config_.h264_encoder_type ==
                 soracp::H264_ENCODER_TYPE_OPEN_H264) {
               create_encoder = [openh264 = config_.openh264]() {
@@ -566,8 +1044,29 @@ class SignalingImpl : public Signaling {
             }
           }
           if (create_encoder) {
-            client_.video_encoder = CreateSimulcastEncoderAdapter(
-                rtp_encoding_params_, create_encoder);
+            std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+            if (client_.video_encoder != nullptr &&
+                client_.video_encoder_codec == codec &&
+                EqualsRtpEncodingParameters(client_.video_encoder_params,
+                                            rtp_encoding_params_)) {
+              // 再接続した場合は前のエンコーダを使い回す。
+              // 受信側はデコードできる状態ではないので、次はキーフレームにする。
+              client_.video_encoder->ForceIntraNextFrame();
+              // ペーサーは接続ごとに作り直しているが、InitEncode() は呼ばれないので
+              // ここで映像のビットレートを設定しておく
+              if (client_.pacer != nullptr && client_.video_encoder_settings) {
+                client_.pacer->SetBitrate(
+                    PacedSender::Priority::kVideo,
+                    client_.video_encoder_settings->bitrate);
+              }
+            } else {
+              client_.video_encoder = CreateSimulcastEncoderAdapter(
+                  rtp_encoding_params_, create_encoder);
+              client_.video_encoder_settings = std::nullopt;
+              client_.video_encoder_codec = codec;
+              client_.video_encoder_params = rtp_encoding_params_;
+              UpdateEncoderRefs();
+            }
           }
 
           on_track_(track);
@@ -575,49 +1074,85 @@ class SignalingImpl : public Signaling {
         client_.video = std::make_shared<Track>();
         client_.video->track = track;
         client_.video->senders = sr_reporters;
+        client_.video->nack_responders = nack_responders;
+        client_.video->keyframe_request_handlers = keyframe_request_handlers;
         client_.video->simulcast_handler = simulcast_handler;
       }
       // audio
       {
         uint32_t ssrc = generate_random_number();
-        // m=audio から他の m= が出てくるまでの間のデータを取得する
-        std::vector<std::string> audio_lines;
-        {
-          auto it = std::find_if(
-              lines.begin(), lines.end(),
-              [](const std::string& s) { return starts_with(s, "m=audio"); });
-          if (it != lines.end()) {
-            auto it2 = std::find_if(
-                it + 1, lines.end(),
-                [](const std::string& s) { return starts_with(s, "m="); });
-            audio_lines.assign(it, it2);
-          }
+        const SdpMediaSection* audio_section =
+            find_sdp_media(parsed_sdp, "audio");
+        if (audio_section == nullptr) {
+          PLOG_ERROR << "m=audio not found";
+          return;
         }
         // mid, payload_type
-        std::string mid;
-        int payload_type;
-        {
-          auto get_value =
-              [&audio_lines](const std::string& search) -> std::string {
-            auto it = std::find_if(audio_lines.begin(), audio_lines.end(),
-                                   [&search](const std::string& s) {
-                                     return starts_with(s, search);
-                                   });
-            if (it == audio_lines.end()) {
-              return "";
-            }
-            return it->substr(search.size());
-          };
-          mid = get_value("a=mid:");
-          PLOG_DEBUG << "mid=" << mid;
-          auto xs = split_with(get_value("a=msid:"), " ");
-          auto rtpmap = get_value("a=rtpmap:");
-          payload_type = std::stoi(split_with(rtpmap, " ")[0]);
-          PLOG_DEBUG << "payload_type=" << payload_type;
+        std::string mid(audio_section->mid);
+        PLOG_DEBUG << "mid=" << mid;
+        auto rtpmap = parse_sdp_rtpmap(find_sdp_attribute(*audio_section, "rtpmap")
+                                           .value_or(std::string_view()));
+        if (!rtpmap) {
+          PLOG_ERROR << "Invalid rtpmap for audio";
+          return;
+        }
+        int payload_type = rtpmap->payload_type;
+        PLOG_DEBUG << "payload_type=" << payload_type;
+
+        OpusAudioEncoder::Settings settings;
+        settings.sample_rate = ENCODING_SAMPLE_RATE;
+        settings.channels = config_.audio_channels != 0
+                                ? config_.audio_channels
+                                : ENCODING_CHANNELS;
+        settings.frame_duration_ms = config_.audio_frame_duration_ms != 0
+                                         ? config_.audio_frame_duration_ms
+                                         : ENCODING_FRAME_DURATION_MS;
+        settings.bitrate_kbps = sora_config_.audio_bit_rate != 0
+                                    ? sora_config_.audio_bit_rate
+                                    : ENCODING_BITRATE_KBPS;
+        if (config_.has_audio_complexity()) {
+          settings.complexity = config_.audio_complexity;
+        }
+        settings.dtx = config_.audio_dtx;
+        settings.application =
+            config_.audio_application_type ==
+                    soracp::OPUS_APPLICATION_TYPE_AUDIO
+                ? OpusAudioEncoder::Application::kAudio
+            : config_.audio_application_type ==
+                    soracp::OPUS_APPLICATION_TYPE_RESTRICTED_LOWDELAY
+                ? OpusAudioEncoder::Application::kRestrictedLowDelay
+                : OpusAudioEncoder::Application::kVoip;
+        settings.resampler_quality =
+            config_.audio_resampler_quality ==
+                    soracp::AUDIO_RESAMPLER_QUALITY_LOW
+                ? AudioResamplerQuality::kLow
+            : config_.audio_resampler_quality ==
+                    soracp::AUDIO_RESAMPLER_QUALITY_HIGH
+                ? AudioResamplerQuality::kHigh
+                : AudioResamplerQuality::kMedium;
+        settings.holdback_ms = config_.audio_holdback_ms;
+
+        // エンコーダの設定に合わせた fmtp
+        std::string profile = "minptime=10;useinbandfec=1";
+        profile += ";maxaveragebitrate=" +
+                   std::to_string(settings.bitrate_kbps * 1000);
+        if (settings.channels == 2) {
+          profile += ";stereo=1;sprop-stereo=1";
+        }
+        if (settings.dtx) {
+          profile += ";usedtx=1";
         }
 
         auto audio = rtc::Description::Audio(mid);
-        audio.addOpusCodec(payload_type);
+        audio.addOpusCodec(payload_type, profile);
+        audio.addAttribute("ptime:" +
+                           std::to_string(settings.frame_duration_ms));
+        if (transport_cc_id) {
+          audio.addExtMap(rtc::Description::Entry::ExtMap(
+              *transport_cc_id, TRANSPORT_CC_EXTENSION_URI));
+          audio.addAttribute("rtcp-fb:" + std::to_string(payload_type) +
+                             " transport-cc");
+        }
         audio.addSSRC(ssrc, cname, msid, track_id);
         auto track = client_.pc->addTrack(audio);
         auto rtp_config = std::make_shared<rtc::RtpPacketizationConfig>(
@@ -628,43 +1163,70 @@ class SignalingImpl : public Signaling {
         packetizer->addToChain(sr_reporter);
         auto nack_responder = std::make_shared<rtc::RtcpNackResponder>();
         packetizer->addToChain(nack_responder);
+        // 受信側のパケットロス率をエンコーダに反映する
+        auto rr_handler = std::make_shared<RtcpReceiverReportHandler>(
+            ssrc, [this](const RtcpReportBlock& block) {
+              // エンコード中に取られている client_mutex_ は取らない
+              auto opus_encoder = GetOpusEncoderRef();
+              if (opus_encoder == nullptr) {
+                return;
+              }
+              opus_encoder->SetPacketLossRate(block.fraction_lost / 256.0f);
+            });
+        packetizer->addToChain(rr_handler);
+        if (client_.pacer != nullptr) {
+          client_.pacer->SetBitrate(PacedSender::Priority::kAudio,
+                                    Kbps(settings.bitrate_kbps));
+          packetizer->addToChain(std::make_shared<PacingMediaHandler>(
+              client_.pacer, PacedSender::Priority::kAudio));
+        }
+        if (client_.transport_cc != nullptr) {
+          packetizer->addToChain(
+              std::make_shared<TransportCcMediaHandler>(client_.transport_cc));
+        }
         track->setMediaHandler(packetizer);
-        track->onOpen([this, wtrack = std::weak_ptr<rtc::Track>(track)]() {
+        track->onOpen([this, wtrack = std::weak_ptr<rtc::Track>(track),
+                       settings]() {
           PLOG_DEBUG << "Audio Track Opened";
           auto track = wtrack.lock();
           if (track == nullptr) {
             return;
           }
 
-          client_.opus_encoder = CreateOpusAudioEncoder();
-          if (!client_.opus_encoder->InitEncode(
-                  ENCODING_SAMPLE_RATE, ENCODING_CHANNELS,
-                  ENCODING_FRAME_DURATION_MS, ENCODING_BITRATE_KBPS)) {
-            PLOG_ERROR << "Failed to InitEncode()";
-            return;
+          {
+            std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+            // 再接続した場合は前のエンコーダを使い回す
+            if (client_.opus_encoder == nullptr) {
+              auto opus_encoder = CreateOpusAudioEncoder();
+              if (!opus_encoder->InitEncode(settings)) {
+                PLOG_ERROR << "Failed to InitEncode()";
+                return;
+              }
+              client_.opus_encoder = opus_encoder;
+              UpdateEncoderRefs();
+            }
+            client_.opus_encoder->SetEncodeCallback(
+                [this](const EncodedAudio& audio) {
+                  std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+                  if (client_.audio == nullptr) {
+                    return;
+                  }
+                  auto sender = client_.audio->senders[std::nullopt];
+                  auto rtp_config = sender->rtpConfig;
+                  rtp_config->timestamp =
+                      rtp_config->startTimestamp + audio.rtp_timestamp;
+                  auto report_elapsed_timestamp =
+                      rtp_config->timestamp - sender->lastReportedTimestamp();
+                  if (rtp_config->timestampToSeconds(
+                          report_elapsed_timestamp) > 5) {
+                    sender->setNeedsToReport();
+                  }
+                  std::vector<std::byte> buf(
+                      (std::byte*)audio.buf.get(),
+                      (std::byte*)audio.buf.get() + audio.size);
+                  client_.audio->track->send(buf);
+                });
           }
-          client_.opus_encoder->SetEncodeCallback(
-              [this, initial_timestamp =
-                         get_current_time()](const EncodedAudio& audio) {
-                auto sender = client_.audio->senders[std::nullopt];
-                auto rtp_config = sender->rtpConfig;
-                auto elapsed_seconds =
-                    double((audio.timestamp - initial_timestamp).count()) /
-                    (1000 * 1000);
-                rtp_config->timestamp =
-                    rtp_config->startTimestamp +
-                    rtp_config->secondsToTimestamp(elapsed_seconds);
-                auto report_elapsed_timestamp =
-                    rtp_config->timestamp - sender->lastReportedTimestamp();
-                if (rtp_config->timestampToSeconds(report_elapsed_timestamp) >
-                    5) {
-                  sender->setNeedsToReport();
-                }
-                std::vector<std::byte> buf(
-                    (std::byte*)audio.buf.get(),
-                    (std::byte*)audio.buf.get() + audio.size);
-                client_.audio->track->send(buf);
-              });
           on_track_(track);
         });
         client_.audio = std::make_shared<Track>();
@@ -676,23 +1238,44 @@ class SignalingImpl : public Signaling {
         client_.audio->senders = sr_reporters;
       }
 
-      client_.pc->setRemoteDescription(rtc::Description(sdp, "offer"));
+      auto pc = client_.pc;
+      client_lock.unlock();
+      pc->setRemoteDescription(rtc::Description(sdp, "offer"));
+    } else if (js["type"] == "re-offer" || js["type"] == "update") {
+      OnReOffer(js, nullptr);
     } else if (js["type"] == "switched") {
       auto v = js["ignore_disconnect_websocket"];
       if (v.is_boolean() && v.get<bool>()) {
-        GetWebSocket()->close();
-        ws_ = nullptr;
+        // 先に ws_ を外して、この切断で再接続しないようにする
+        std::shared_ptr<rtc::WebSocket> ws;
+        {
+          std::lock_guard<std::mutex> lock(ws_mutex_);
+          ws.swap(ws_);
+        }
+        if (ws != nullptr) {
+          ws->close();
+        }
       }
     } else if (js["type"] == "stats-req") {
       nlohmann::json js = {{"type", "stats"},
-                           {"reports", nlohmann::json::array()}};
+                           {"reports", CollectStats()}};
       PLOG_DEBUG << "stats: " << js.dump();
-      GetWebSocket()->send(js.dump());
+      auto ws = GetWebSocket();
+      if (ws == nullptr) {
+        PLOG_WARNING << "WebSocket is already closed";
+        return;
+      }
+      ws->send(js.dump());
     } else if (js["type"] == "ping") {
       nlohmann::json js = {{"type", "pong"},
                            {"stats", nlohmann::json::array()}};
       PLOG_DEBUG << "pong: " << js.dump();
-      GetWebSocket()->send(js.dump());
+      auto ws = GetWebSocket();
+      if (ws == nullptr) {
+        PLOG_WARNING << "WebSocket is already closed";
+        return;
+      }
+      ws->send(js.dump());
     } else if (js["type"] == "notify") {
       if (on_notify_) {
         on_notify_(message);
@@ -704,6 +1287,67 @@ class SignalingImpl : public Signaling {
     }
   }
 
+  // 既存の PeerConnection に対して再ネゴシエーションする。
+  // PeerConnection やトラック、MediaHandler、エンコーダは作り直さずに、
+  // encodings が変わったレイヤーの active と maxBitrate だけをエンコーダに反映する。
+  void OnReOffer(const nlohmann::json& js,
+                 std::shared_ptr<sorac::DataChannel> dc) {
+    std::unique_lock<std::recursive_mutex> client_lock(client_mutex_);
+    if (client_.pc == nullptr) {
+      PLOG_WARNING << "Received " << js["type"].get<std::string>()
+                   << " before offer";
+      return;
+    }
+
+    if (js.contains("encodings")) {
+      UpdateRtpEncodingParameters(js["encodings"]);
+    }
+
+    client_.answer_type = js["type"] == "update" ? "update" : "re-answer";
+    client_.answer_dc = dc;
+
+    std::string sdp = js["sdp"].get<std::string>();
+    auto pc = client_.pc;
+    client_lock.unlock();
+    pc->setRemoteDescription(rtc::Description(sdp, "offer"));
+  }
+
+  // encodings の rid が一致するレイヤーの active と maxBitrate を反映する。
+  // エンコーダは作り直さずに、止めたレイヤーのエンコーダだけを止めて、再開したレイヤーはキーフレームから始める。
+  // client_mutex_ のロックを取ってから呼ぶこと。
+  void UpdateRtpEncodingParameters(const nlohmann::json& encodings) {
+    if (!IsSimulcast()) {
+      return;
+    }
+    bool changed = false;
+    for (auto& enc : encodings) {
+      if (!enc.contains("rid")) {
+        continue;
+      }
+      auto rid = enc["rid"].get<std::string>();
+      for (auto& p : rtp_encoding_params_.parameters) {
+        if (p.rid != rid) {
+          continue;
+        }
+        if (enc.contains("active") && p.active != enc["active"].get<bool>()) {
+          p.active = enc["active"].get<bool>();
+          PLOG_INFO << "Change active: rid=" << rid << " active=" << p.active;
+          changed = true;
+        }
+        if (enc.contains("maxBitrate") &&
+            (!p.has_max_bitrate_bps() ||
+             p.max_bitrate_bps != enc["maxBitrate"].get<int>())) {
+          p.set_max_bitrate_bps(enc["maxBitrate"].get<int>());
+          changed = true;
+        }
+      }
+    }
+    if (changed && client_.video_encoder != nullptr) {
+      client_.video_encoder->SetRtpEncodingParameters(rtp_encoding_params_);
+      client_.video_encoder_params = rtp_encoding_params_;
+    }
+  }
+
   void OnOpen(bool redirect) {
     const auto& sc = sora_config_;
     nlohmann::json js = {
@@ -822,30 +1466,579 @@ class SignalingImpl : public Signaling {
     }
 
     PLOG_DEBUG << "connect: " << js.dump();
-    GetWebSocket()->send(js.dump());
+    auto ws = GetWebSocket();
+    if (ws == nullptr) {
+      PLOG_WARNING << "WebSocket is already closed";
+      return;
+    }
+    ws->send(js.dump());
+  }
+
+  // stats-req に返す統計情報
+  nlohmann::json CollectStats() {
+    std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+    nlohmann::json reports = nlohmann::json::array();
+    double timestamp = get_current_time().count() / 1000.0;
+    if (client_.bandwidth_estimate_bps != nullptr) {
+      reports.push_back({
+          {"type", "candidate-pair"},
+          {"id", "RTCIceCandidatePair"},
+          {"timestamp", timestamp},
+          {"availableOutgoingBitrate", client_.bandwidth_estimate_bps->load()},
+      });
+    }
+    if (client_.video == nullptr) {
+      return reports;
+    }
+    for (const auto& [rid, nack_responder] : client_.video->nack_responders) {
+      auto stats = nack_responder->GetStats();
+      auto ssrc = client_.video->senders[rid]->rtpConfig->ssrc;
+      nlohmann::json report = {
+          {"type", "outbound-rtp"},
+          {"id", "RTCOutboundRTPVideoStream_" + std::to_string(ssrc)},
+          {"timestamp", timestamp},
+          {"kind", "video"},
+          {"ssrc", ssrc},
+          {"packetsSent", stats.packets_sent},
+          {"bytesSent", stats.bytes_sent},
+          {"nackCount", stats.nack_count},
+          {"retransmittedPacketsSent", stats.retransmitted_packets_sent},
+          {"retransmittedBytesSent", stats.retransmitted_bytes_sent},
+      };
+      auto it = client_.video->keyframe_request_handlers.find(rid);
+      if (it != client_.video->keyframe_request_handlers.end()) {
+        auto keyframe_stats = it->second->GetStats();
+        report["pliCount"] = keyframe_stats.pli_count;
+        report["firCount"] = keyframe_stats.fir_count;
+        // 標準の統計情報には無いが、PLI や FIR のうちどれだけキーフレームにしたかを確認するために返す
+        report["keyframeRequestsForwarded"] =
+            keyframe_stats.keyframe_request_count;
+        report["keyframeRequestsDropped"] =
+            keyframe_stats.keyframe_request_dropped_count;
+      }
+      auto encoded_it = client_.video->encoded_stats.find(rid);
+      if (encoded_it != client_.video->encoded_stats.end()) {
+        const auto& encoded_stats = encoded_it->second;
+        report["framesEncoded"] = encoded_stats.frames_encoded;
+        report["keyFramesEncoded"] = encoded_stats.key_frames_encoded;
+        // 標準の統計情報には無いが、キャプチャの問題とレート制御によるスキップを区別するために返す
+        report["framesSkipped"] = encoded_stats.frames_skipped;
+        if (encoded_stats.qp_sum) {
+          report["qpSum"] = *encoded_stats.qp_sum;
+        }
+      }
+      if (rid) {
+        report["rid"] = *rid;
+      }
+      reports.push_back(report);
+    }
+    return reports;
+  }
+
+  void StartConnect() {
+    // ランダムに並び替えてから、以前の接続で速かったものから順に試す
+    auto urls = config_.signaling_url_candidates;
+    {
+      std::random_device seed_gen;
+      std::mt19937 engine(seed_gen());
+      std::shuffle(urls.begin(), urls.end(), engine);
+    }
+    {
+      std::lock_guard<std::mutex> lock(ws_mutex_);
+      std::stable_sort(urls.begin(), urls.end(),
+                       [this](const std::string& a, const std::string& b) {
+                         return GetConnectLatency(a) < GetConnectLatency(b);
+                       });
+    }
+
+    std::vector<ConnectAttempt> attempts;
+    for (const auto& url : urls) {
+      // TODO(melpon): Proxy 対応
+
+      rtc::WebSocket::Configuration ws_config;
+      if (!config_.ca_certificate.empty()) {
+        ws_config.caCertificatePemFile = config_.ca_certificate;
+      }
+      auto ws = std::make_shared<rtc::WebSocket>(ws_config);
+      ws->onOpen([this, url, wws = std::weak_ptr<rtc::WebSocket>(ws)]() {
+        PLOG_DEBUG << "onOpen: url=" << url;
+        auto ws = wws.lock();
+        if (ws == nullptr) {
+          return;
+        }
+        std::vector<std::shared_ptr<rtc::WebSocket>> losers;
+        {
+          std::lock_guard<std::mutex> lock(ws_mutex_);
+          if (ws_ != nullptr) {
+            PLOG_DEBUG << "WebSocket is already connected: url=" << url;
+            losers.push_back(ws);
+          } else {
+            ws_ = ws;
+            for (auto& attempt : connecting_wss_) {
+              if (attempt.ws == ws) {
+                auto latency = get_current_time() - attempt.start_time;
+                connect_latencies_[url] = latency;
+                PLOG_INFO << "Connected: url=" << url
+                          << ", latency=" << latency.count() / 1000 << "ms";
+              } else if (attempt.started) {
+                losers.push_back(attempt.ws);
+              }
+            }
+            connecting_wss_.clear();
+          }
+        }
+        connect_cv_.notify_all();
+        // 負けた接続は明示的に閉じる
+        for (auto& loser : losers) {
+          loser->close();
+        }
+        if (losers.empty() || losers[0] != ws) {
+          OnOpen(false);
+        }
+      });
+      ws->onError([this, url, wws = std::weak_ptr<rtc::WebSocket>(ws)](
+                      std::string s) {
+        PLOG_DEBUG << "WebSocket error: url=" << url << ", error=" << s;
+        if (OnConnectAttemptFailed(wws.lock())) {
+          return;
+        }
+        OnError(s);
+      });
+      ws->onClosed([this, url, wws = std::weak_ptr<rtc::WebSocket>(ws)]() {
+        PLOG_DEBUG << "WebSocket closed: url=" << url;
+        if (OnConnectAttemptFailed(wws.lock())) {
+          return;
+        }
+        OnClosed();
+      });
+      ws->onMessage([this, wws = std::weak_ptr<rtc::WebSocket>(ws)](
+                        rtc::message_variant data) {
+        if (wws.lock() != GetWebSocket()) {
+          return;
+        }
+        OnMessage(data);
+      });
+
+      ConnectAttempt attempt;
+      attempt.url = url;
+      attempt.ws = ws;
+      attempts.push_back(attempt);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(ws_mutex_);
+      connecting_wss_ = attempts;
+      connect_canceled_ = false;
+    }
+    connect_thread_ = std::thread([this]() { RunConnect(); });
+  }
+
+  // 接続する候補を少しずつずらしながら開いていって、タイムアウトしたものは閉じる。
+  // どれかが繋がるか、全て失敗するか、キャンセルされたら終わる。
+  void RunConnect() {
+    auto stagger = std::chrono::milliseconds(
+        config_.signaling_connect_stagger_ms > 0
+            ? config_.signaling_connect_stagger_ms
+            : DEFAULT_SIGNALING_CONNECT_STAGGER_MS);
+    auto timeout = std::chrono::milliseconds(
+        config_.signaling_connect_timeout_ms > 0
+            ? config_.signaling_connect_timeout_ms
+            : DEFAULT_SIGNALING_CONNECT_TIMEOUT_MS);
+
+    std::unique_lock<std::mutex> lock(ws_mutex_);
+    size_t next = 0;
+    auto next_start = get_current_time();
+    while (!connect_canceled_ && ws_ == nullptr) {
+      auto now = get_current_time();
+      std::vector<std::pair<std::string, std::shared_ptr<rtc::WebSocket>>>
+          to_open;
+      std::vector<std::shared_ptr<rtc::WebSocket>> to_close;
+      // 開いている途中の候補が無ければ、待たずに次の候補を開く
+      bool pending = std::any_of(
+          connecting_wss_.begin(), connecting_wss_.end(),
+          [](const ConnectAttempt& a) { return a.started && !a.failed; });
+      if (next < connecting_wss_.size() && (now >= next_start || !pending)) {
+        auto& attempt = connecting_wss_[next++];
+        attempt.started = true;
+        attempt.start_time = now;
+        to_open.push_back(std::make_pair(attempt.url, attempt.ws));
+        next_start = now + stagger;
+      }
+      auto deadline = next < connecting_wss_.size()
+                          ? next_start
+                          : now + std::chrono::hours(1);
+      for (auto& attempt : connecting_wss_) {
+        if (!attempt.started || attempt.failed) {
+          continue;
+        }
+        if (now - attempt.start_time >= timeout) {
+          PLOG_WARNING << "Connect timeout: url=" << attempt.url;
+          attempt.failed = true;
+          to_close.push_back(attempt.ws);
+        } else {
+          deadline = std::min(deadline, attempt.start_time + timeout);
+        }
+      }
+      bool all_failed =
+          next == connecting_wss_.size() &&
+          std::all_of(connecting_wss_.begin(), connecting_wss_.end(),
+                      [](const ConnectAttempt& a) { return a.failed; });
+
+      if (!to_open.empty() || !to_close.empty() || all_failed) {
+        // WebSocket のコールバックは ws_mutex_ を取るので、ロックを外してから呼ぶ
+        lock.unlock();
+        for (auto& [url, ws] : to_open) {
+          PLOG_DEBUG << "Connect to: " << url;
+          try {
+            ws->open(url);
+          } catch (const std::exception& e) {
+            PLOG_WARNING << "Failed to open: url=" << url
+                         << ", error=" << e.what();
+            OnConnectAttemptFailed(ws);
+          }
+        }
+        for (auto& ws : to_close) {
+          ws->close();
+        }
+        if (all_failed) {
+          PLOG_ERROR << "Failed to connect to all signaling URLs";
+          OnError("Failed to connect to all signaling URLs");
+          return;
+        }
+        lock.lock();
+        continue;
+      }
+      connect_cv_.wait_until(
+          lock, std::chrono::steady_clock::now() + (deadline - now));
+    }
+  }
+
+  // 接続中の候補が失敗した場合は true を返す
+  bool OnConnectAttemptFailed(std::shared_ptr<rtc::WebSocket> ws) {
+    {
+      std::lock_guard<std::mutex> lock(ws_mutex_);
+      auto it = std::find_if(
+          connecting_wss_.begin(), connecting_wss_.end(),
+          [&ws](const ConnectAttempt& a) { return a.ws == ws; });
+      if (it == connecting_wss_.end()) {
+        // 接続済みのものか、既に負けて閉じたもの
+        return ws != ws_;
+      }
+      it->failed = true;
+      // 失敗した候補は次の接続では後回しにする
+      connect_latencies_[it->url] = std::chrono::microseconds::max();
+    }
+    connect_cv_.notify_all();
+    return true;
+  }
+
+  void CancelConnect() {
+    std::vector<ConnectAttempt> attempts;
+    {
+      std::lock_guard<std::mutex> lock(ws_mutex_);
+      connect_canceled_ = true;
+      attempts.swap(connecting_wss_);
+    }
+    connect_cv_.notify_all();
+    if (connect_thread_.joinable()) {
+      connect_thread_.join();
+    }
+    for (auto& attempt : attempts) {
+      // 閉じた後にコールバックが呼ばれないように、先にコールバックを外しておく
+      attempt.ws->resetCallbacks();
+      if (attempt.started) {
+        attempt.ws->close();
+      }
+    }
+  }
+
+  // ws_mutex_ のロックを取った状態で呼ぶこと
+  std::chrono::microseconds GetConnectLatency(const std::string& url) const {
+    auto it = connect_latencies_.find(url);
+    // まだ繋いだことが無い場合は、失敗したものよりは優先する
+    return it != connect_latencies_.end() ? it->second
+                                          : std::chrono::hours(1);
   }
 
   void OnError(const std::string& s) {
-    // client_ = Client();
-    // ws_ = nullptr;
+    PLOG_ERROR << "Signaling error: " << s;
+    ScheduleReconnect(s);
+  }
+
+  void OnClosed() { ScheduleReconnect("WebSocket closed"); }
+
+  void OnPeerConnectionStateChange(std::shared_ptr<rtc::PeerConnection> pc,
+                                   rtc::PeerConnection::State state) {
+    {
+      // 破棄した PeerConnection からの通知は無視する
+      std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+      if (pc == nullptr || pc != client_.pc) {
+        return;
+      }
+    }
+    if (state == rtc::PeerConnection::State::Connected) {
+      {
+        std::lock_guard<std::mutex> lock(reconnect_mutex_);
+        reconnect_attempts_ = 0;
+        disconnected_since_ = std::nullopt;
+      }
+      SetState(soracp::SIGNALING_STATE_CONNECTED);
+    } else if (state == rtc::PeerConnection::State::Disconnected) {
+      // 一時的な切断であれば ICE が自分で復帰するので、しばらく待つ
+      {
+        std::lock_guard<std::mutex> lock(reconnect_mutex_);
+        if (!disconnected_since_) {
+          disconnected_since_ = get_current_time();
+        }
+      }
+      reconnect_cv_.notify_all();
+    } else if (state == rtc::PeerConnection::State::Failed ||
+               state == rtc::PeerConnection::State::Closed) {
+      ScheduleReconnect("PeerConnection failed");
+    }
   }
 
-  void OnClosed() {
-    // ws_ = nullptr;
+  // 状態を変えて、通知スレッドからコールバックを呼ぶ。
+  // SetState() は libdatachannel のスレッドや再接続のスレッドから呼ばれるので、
+  // そこでコールバックを呼ぶと、コールバックの中で Signaling を破棄した時に
+  // 自分自身を待つことになってしまう。
+  void SetState(soracp::SignalingState state) {
+    {
+      std::lock_guard<std::mutex> lock(reconnect_mutex_);
+      if (state_ == state) {
+        return;
+      }
+      state_ = state;
+      // 通知の順序が入れ替わらないように reconnect_mutex_ を取ったまま積む
+      std::lock_guard<std::mutex> notifier_lock(state_notifier_->mutex);
+      state_notifier_->states.push_back(state);
+    }
+    PLOG_INFO << "Signaling state changed: state=" << state;
+    state_notifier_->cv.notify_all();
+  }
+
+  // 状態変化のコールバックを呼ぶスレッドと共有するデータ。
+  // コールバックの中で Signaling が破棄されても参照できるように shared_ptr で持つ。
+  struct StateNotifier {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<soracp::SignalingState> states;
+    std::function<void(soracp::SignalingState)> on_state_change;
+    bool stopped = false;
+  };
+
+  static void RunStateNotify(std::shared_ptr<StateNotifier> notifier) {
+    std::unique_lock<std::mutex> lock(notifier->mutex);
+    while (true) {
+      notifier->cv.wait(lock, [&notifier]() {
+        return notifier->stopped || !notifier->states.empty();
+      });
+      if (notifier->stopped) {
+        return;
+      }
+      auto state = notifier->states.front();
+      notifier->states.pop_front();
+      auto on_state_change = notifier->on_state_change;
+      lock.unlock();
+      if (on_state_change) {
+        on_state_change(state);
+      }
+      lock.lock();
+    }
+  }
+
+  // バックオフしてから再接続するように予約する。
+  // 既に予約済みの場合や、再接続を諦めた場合は何もしない。
+  void ScheduleReconnect(const std::string& reason) {
+    soracp::SignalingState state;
+    {
+      std::lock_guard<std::mutex> lock(reconnect_mutex_);
+      if (state_ == soracp::SIGNALING_STATE_IDLE ||
+          state_ == soracp::SIGNALING_STATE_FAILED || reconnect_at_) {
+        return;
+      }
+      disconnected_since_ = std::nullopt;
+      if (config_.disable_reconnect ||
+          (config_.reconnect_max_attempts > 0 &&
+           reconnect_attempts_ >= config_.reconnect_max_attempts)) {
+        PLOG_ERROR << "Give up reconnecting: reason=" << reason
+                   << ", attempts=" << reconnect_attempts_;
+        state = soracp::SIGNALING_STATE_FAILED;
+      } else {
+        auto initial = std::chrono::milliseconds(
+            config_.reconnect_initial_backoff_ms > 0
+                ? config_.reconnect_initial_backoff_ms
+                : DEFAULT_RECONNECT_INITIAL_BACKOFF_MS);
+        auto max = std::chrono::milliseconds(
+            config_.reconnect_max_backoff_ms > 0
+                ? config_.reconnect_max_backoff_ms
+                : DEFAULT_RECONNECT_MAX_BACKOFF_MS);
+        auto backoff =
+            std::min(initial * (int64_t(1) << std::min(reconnect_attempts_, 20)),
+                     max);
+        // 同時に切断された端末が一斉に繋ぎ直さないように、後半分をランダムにずらす
+        std::random_device seed_gen;
+        std::mt19937 engine(seed_gen());
+        std::uniform_int_distribution<int64_t> dist(0, backoff.count() / 2);
+        auto delay = backoff / 2 + std::chrono::milliseconds(dist(engine));
+        reconnect_attempts_ += 1;
+        reconnect_at_ = get_current_time() + delay;
+        PLOG_WARNING << "Reconnect after " << delay.count()
+                     << "ms: reason=" << reason
+                     << ", attempts=" << reconnect_attempts_;
+        state = soracp::SIGNALING_STATE_RECONNECTING;
+      }
+    }
+    reconnect_cv_.notify_all();
+    SetState(state);
+  }
+
+  // 予約された再接続や、Disconnected のタイムアウトを処理するスレッド
+  void RunReconnect() {
+    std::chrono::microseconds disconnected_timeout =
+        std::chrono::milliseconds(RECONNECT_DISCONNECTED_TIMEOUT_MS);
+
+    std::unique_lock<std::mutex> lock(reconnect_mutex_);
+    while (!reconnect_stopped_) {
+      auto now = get_current_time();
+      if (disconnected_since_ &&
+          now - *disconnected_since_ >= disconnected_timeout) {
+        lock.unlock();
+        ScheduleReconnect("PeerConnection disconnected");
+        lock.lock();
+        continue;
+      }
+      if (reconnect_at_ && now >= *reconnect_at_) {
+        reconnect_at_ = std::nullopt;
+        lock.unlock();
+        {
+          std::lock_guard<std::mutex> connect_lock(connect_mutex_);
+          ResetClient(true);
+          StartConnect();
+        }
+        lock.lock();
+        continue;
+      }
+      auto deadline = now + std::chrono::hours(1);
+      if (disconnected_since_) {
+        deadline =
+            std::min(deadline, *disconnected_since_ + disconnected_timeout);
+      }
+      if (reconnect_at_) {
+        deadline = std::min(deadline, *reconnect_at_);
+      }
+      reconnect_cv_.wait_until(
+          lock, std::chrono::steady_clock::now() + (deadline - now));
+    }
+  }
+
+  // 今の接続を破棄する。
+  // keep_encoders が true の場合、エンコーダは次の接続で使い回せるように残しておく。
+  void ResetClient(bool keep_encoders) {
+    CancelConnect();
+    std::shared_ptr<rtc::WebSocket> ws;
+    {
+      std::lock_guard<std::mutex> lock(ws_mutex_);
+      ws.swap(ws_);
+    }
+    // 破棄した接続のコールバックが後から呼ばれないように、閉じる前に外しておく。
+    // resetCallbacks() は実行中のコールバックが終わるのを待つので、
+    // 戻った後は this を参照されることは無い。
+    if (ws != nullptr) {
+      ws->resetCallbacks();
+      ws->close();
+    }
+    Client client;
+    {
+      std::lock_guard<std::recursive_mutex> lock(client_mutex_);
+      std::swap(client, client_);
+      if (keep_encoders) {
+        client_.video_encoder = client.video_encoder;
+        client_.video_encoder_settings = client.video_encoder_settings;
+        client_.video_encoder_codec = client.video_encoder_codec;
+        client_.video_encoder_params = client.video_encoder_params;
+        client_.opus_encoder = client.opus_encoder;
+      }
+      UpdateEncoderRefs();
+    }
+    for (const auto& t : {client.video, client.audio}) {
+      if (t != nullptr && t->track != nullptr) {
+        t->track->resetCallbacks();
+      }
+    }
+    if (client.pc != nullptr) {
+      client.pc->resetCallbacks();
+      client.pc->close();
+    }
   }
 
   bool IsSimulcast() const { return rtp_encoding_params_.enable_parameters; }
 
+  // client_mutex_ を取った状態で呼ぶ
+  void UpdateEncoderRefs() {
+    std::lock_guard<std::mutex> lock(encoder_ref_mutex_);
+    video_encoder_ref_ = client_.video_encoder;
+    opus_encoder_ref_ = client_.opus_encoder;
+  }
+  std::shared_ptr<SimulcastEncoderAdapter> GetVideoEncoderRef() const {
+    std::lock_guard<std::mutex> lock(encoder_ref_mutex_);
+    return video_encoder_ref_;
+  }
+  std::shared_ptr<OpusAudioEncoder> GetOpusEncoderRef() const {
+    std::lock_guard<std::mutex> lock(encoder_ref_mutex_);
+    return opus_encoder_ref_;
+  }
+
   std::shared_ptr<rtc::WebSocket> GetWebSocket() const {
     std::lock_guard<std::mutex> lock(ws_mutex_);
     return ws_;
   }
 
  private:
+  struct ConnectAttempt {
+    std::string url;
+    std::shared_ptr<rtc::WebSocket> ws;
+    bool started = false;
+    bool failed = false;
+    std::chrono::microseconds start_time;
+  };
+
   std::shared_ptr<rtc::WebSocket> ws_;
-  std::vector<std::shared_ptr<rtc::WebSocket>> connecting_wss_;
+  std::vector<ConnectAttempt> connecting_wss_;
+  bool connect_canceled_ = false;
+  // URL ごとの、前回接続した時にかかった時間
+  std::map<std::string, std::chrono::microseconds> connect_latencies_;
+  std::condition_variable connect_cv_;
+  std::thread connect_thread_;
   mutable std::mutex ws_mutex_;
+  // Connect() と再接続が同時に走らないようにする
+  std::mutex connect_mutex_;
+
+  // 再接続の状態
+  std::mutex reconnect_mutex_;
+  std::condition_variable reconnect_cv_;
+  std::thread reconnect_thread_;
+  bool reconnect_stopped_ = false;
+  int reconnect_attempts_ = 0;
+  std::optional<std::chrono::microseconds> reconnect_at_;
+  std::optional<std::chrono::microseconds> disconnected_since_;
+  soracp::SignalingState state_ = soracp::SIGNALING_STATE_IDLE;
+
+  std::shared_ptr<StateNotifier> state_notifier_;
+  std::thread state_notify_thread_;
+
+  // 映像や音声を送るスレッドと、接続や再接続をするスレッドで client_ を共有するので、
+  // client_ に触る時はロックを取る。
+  // エンコード結果のコールバックは Encode() の中から呼ばれることがあるので再帰ロックにしている。
+  mutable std::recursive_mutex client_mutex_;
   Client client_;
+  // client_ のエンコーダと同じもの。
+  // client_mutex_ はエンコードの間ずっと取られているので、RTCP を受信したスレッドからは
+  // こちらを参照して、エンコードを待たずにエンコーダへ通知する。
+  // ロックはポインタをコピーする間だけ取る。
+  mutable std::mutex encoder_ref_mutex_;
+  std::shared_ptr<SimulcastEncoderAdapter> video_encoder_ref_;
+  std::shared_ptr<OpusAudioEncoder> opus_encoder_ref_;
   soracp::SignalingConfig config_;
   soracp::SoraConnectConfig sora_config_;
   soracp::RtpEncodingParameters rtp_encoding_params_;
@@ -855,6 +2048,8 @@ class SignalingImpl : public Signaling {
   std::function<void(std::shared_ptr<sorac::DataChannel>)> on_data_channel_;
   std::function<void(const std::string&)> on_notify_;
   std::function<void(const std::string&)> on_push_;
+  std::function<std::shared_ptr<VideoEncoder>(const std::string& codec)>
+      video_encoder_factory_;
 };
 
 std::shared_ptr<Signaling> CreateSignaling(
@@ -1,8 +1,10 @@
 #include "sorac/simulcast_encoder_adapter.hpp"
 
 #include <string.h>
+#include <algorithm>
 #include <atomic>
 #include <exception>
+#include <mutex>
 
 // plog
 #include <plog/Log.h>
@@ -50,9 +52,18 @@ static Bps GetMaxBitrate(int width, int height) {
              a.max_bitrate.count());
 }
 
-class SimulcastEncoderAdapter : public VideoEncoder {
+static Bps GetLayerMaxBitrate(const soracp::RtpEncodingParameter& param,
+                              int width,
+                              int height) {
+  if (param.has_max_bitrate_bps() && param.max_bitrate_bps > 0) {
+    return Bps(param.max_bitrate_bps);
+  }
+  return GetMaxBitrate(width, height);
+}
+
+class SimulcastEncoderAdapterImpl : public SimulcastEncoderAdapter {
  public:
-  SimulcastEncoderAdapter(
+  SimulcastEncoderAdapterImpl(
       const soracp::RtpEncodingParameters& params,
       std::function<std::shared_ptr<VideoEncoder>()> create_encoder)
       : create_encoder_(create_encoder) {
@@ -66,13 +77,38 @@ class SimulcastEncoderAdapter : public VideoEncoder {
       }
       simulcast_ = true;
     }
+    for (const auto& e : encoders_) {
+      rids_.push_back(e.param.rid);
+    }
+    force_intra_ = std::vector<std::atomic<bool>>(encoders_.size());
+    loss_recovery_ = std::vector<std::atomic<bool>>(encoders_.size());
   }
-  ~SimulcastEncoderAdapter() override { Release(); }
+  ~SimulcastEncoderAdapterImpl() override { Release(); }
 
   void ForceIntraNextFrame() override {
-    for (auto& e : encoders_) {
-      if (e.encoder != nullptr) {
-        e.encoder->ForceIntraNextFrame();
+    for (auto& f : force_intra_) {
+      f = true;
+    }
+  }
+
+  void ForceIntraNextFrame(const std::string& rid) override {
+    for (size_t i = 0; i < rids_.size(); i++) {
+      if (!simulcast_ || rids_[i] == rid) {
+        force_intra_[i] = true;
+      }
+    }
+  }
+
+  void RequestLossRecovery() override {
+    for (auto& f : loss_recovery_) {
+      f = true;
+    }
+  }
+
+  void RequestLossRecovery(const std::string& rid) override {
+    for (size_t i = 0; i < rids_.size(); i++) {
+      if (!simulcast_ || rids_[i] == rid) {
+        loss_recovery_[i] = true;
       }
     }
   }
@@ -83,41 +119,12 @@ class SimulcastEncoderAdapter : public VideoEncoder {
     PLOG_INFO << "InitEncode: width=" << settings.width
               << " height=" << settings.height
               << " bitrate=" << settings.bitrate.count();
-    // 各サイズの最大ビットレートを計算して、その割合でビットレートを分配する
-    Bps sum_bitrate;
-    for (const auto& e : encoders_) {
-      const auto& p = e.param;
-      if (!p.active) {
-        continue;
-      }
-      int width = settings.width;
-      int height = settings.height;
-      if (p.has_scale_resolution_down_by()) {
-        width = (int)(settings.width / p.scale_resolution_down_by);
-        height = (int)(settings.height / p.scale_resolution_down_by);
-      }
-      sum_bitrate += GetMaxBitrate(width, height);
-    }
-
+    settings_ = settings;
+    CalcLayerSettings();
     for (auto& e : encoders_) {
-      if (!e.param.active) {
-        continue;
-      }
-      Settings s = settings;
-      if (e.param.has_scale_resolution_down_by()) {
-        s.width = (int)(settings.width / e.param.scale_resolution_down_by);
-        s.height = (int)(settings.height / e.param.scale_resolution_down_by);
-      }
-      double rate = (double)GetMaxBitrate(s.width, s.height).count() /
-                    sum_bitrate.count();
-      s.bitrate = Bps((int64_t)(settings.bitrate.count() * rate));
-      e.encoder = create_encoder_();
-      PLOG_INFO << "InitEncode(Layerd): width=" << s.width
-                << " height=" << s.height << " bitrate=" << s.bitrate.count();
-      if (!e.encoder->InitEncode(s)) {
+      if (e.param.active && !StartLayer(e)) {
         return false;
       }
-      e.settings = s;
     }
 
     return true;
@@ -125,30 +132,35 @@ class SimulcastEncoderAdapter : public VideoEncoder {
 
   void SetEncodeCallback(
       std::function<void(const EncodedImage&)> callback) override {
+    callback_ = callback;
     for (auto& e : encoders_) {
       if (e.encoder != nullptr) {
-        std::optional<std::string> rid;
-        if (simulcast_) {
-          rid = e.param.rid;
-        }
-        e.encoder->SetEncodeCallback(
-            [rid, callback](const sorac::EncodedImage& image) {
-              sorac::EncodedImage img = image;
-              img.rid = rid;
-              callback(img);
-            });
+        SetLayerCallback(e);
       }
     }
   }
 
   void Encode(const VideoFrame& frame) override {
+    ApplyPendingChanges();
+    for (size_t i = 0; i < encoders_.size(); i++) {
+      if (force_intra_[i].exchange(false) && encoders_[i].encoder != nullptr) {
+        encoders_[i].encoder->ForceIntraNextFrame();
+      }
+      if (loss_recovery_[i].exchange(false) &&
+          encoders_[i].encoder != nullptr) {
+        encoders_[i].encoder->RequestLossRecovery();
+      }
+    }
+
     // 適切なエンコーダーに送る
     if (!simulcast_) {
       // 非サイマルキャストなのに rid が設定されてる
       if (frame.rid != std::nullopt) {
         return;
       }
-      encoders_[0].encoder->Encode(frame);
+      if (encoders_[0].encoder != nullptr) {
+        encoders_[0].encoder->Encode(frame);
+      }
     } else {
       // サイマルキャストなのに rid が設定されてない
       if (frame.rid == std::nullopt) {
@@ -165,6 +177,17 @@ class SimulcastEncoderAdapter : public VideoEncoder {
     }
   }
 
+  void SetBitrate(Bps bitrate) override {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_bitrate_ = bitrate;
+  }
+
+  void SetRtpEncodingParameters(
+      const soracp::RtpEncodingParameters& params) override {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_params_ = params;
+  }
+
   void Release() override {
     for (auto& e : encoders_) {
       if (e.encoder != nullptr) {
@@ -172,6 +195,7 @@ class SimulcastEncoderAdapter : public VideoEncoder {
         e.encoder = nullptr;
       }
     }
+    settings_ = std::nullopt;
   }
 
  private:
@@ -180,15 +204,148 @@ class SimulcastEncoderAdapter : public VideoEncoder {
     soracp::RtpEncodingParameter param;
     Settings settings;
   };
+
+  // settings_ から各レイヤーの解像度とビットレートを計算する
+  void CalcLayerSettings() {
+    // 各レイヤーの最大ビットレートを計算して、その割合でビットレートを分配する。
+    // encodings に maxBitrate が指定されている場合はそれを最大ビットレートにする。
+    Bps sum_bitrate;
+    for (auto& e : encoders_) {
+      const auto& p = e.param;
+      Settings s = *settings_;
+      if (p.has_scale_resolution_down_by()) {
+        s.width = (int)(settings_->width / p.scale_resolution_down_by);
+        s.height = (int)(settings_->height / p.scale_resolution_down_by);
+      }
+      e.settings = s;
+      if (p.active) {
+        sum_bitrate += GetLayerMaxBitrate(p, s.width, s.height);
+      }
+    }
+
+    for (auto& e : encoders_) {
+      if (!e.param.active) {
+        continue;
+      }
+      Settings& s = e.settings;
+      double rate =
+          (double)GetLayerMaxBitrate(e.param, s.width, s.height).count() /
+          sum_bitrate.count();
+      s.bitrate = Bps((int64_t)(settings_->bitrate.count() * rate));
+      if (e.param.has_max_bitrate_bps() && e.param.max_bitrate_bps > 0) {
+        s.bitrate = std::min(s.bitrate, Bps(e.param.max_bitrate_bps));
+      }
+    }
+  }
+
+  bool StartLayer(Encoder& e) {
+    e.encoder = create_encoder_();
+    const auto& s = e.settings;
+    PLOG_INFO << "InitEncode(Layerd): width=" << s.width
+              << " height=" << s.height << " bitrate=" << s.bitrate.count();
+    if (!e.encoder->InitEncode(s)) {
+      e.encoder = nullptr;
+      return false;
+    }
+    if (callback_) {
+      SetLayerCallback(e);
+    }
+    return true;
+  }
+
+  void SetLayerCallback(Encoder& e) {
+    std::optional<std::string> rid;
+    if (simulcast_) {
+      rid = e.param.rid;
+    }
+    e.encoder->SetEncodeCallback(
+        [rid, callback = callback_](const sorac::EncodedImage& image) {
+          sorac::EncodedImage img = image;
+          img.rid = rid;
+          callback(img);
+        });
+  }
+
+  // SetBitrate() と SetRtpEncodingParameters() で設定された値を反映する。
+  // エンコーダは作り直さずに、止めたレイヤーのエンコーダだけを解放して、
+  // 新しく有効になったレイヤーのエンコーダだけを作る。
+  void ApplyPendingChanges() {
+    std::optional<Bps> bitrate;
+    std::optional<soracp::RtpEncodingParameters> params;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      bitrate.swap(pending_bitrate_);
+      params.swap(pending_params_);
+    }
+    if (!bitrate && !params) {
+      return;
+    }
+    if (params && simulcast_) {
+      for (const auto& p : params->parameters) {
+        for (auto& e : encoders_) {
+          if (e.param.rid != p.rid) {
+            continue;
+          }
+          e.param.active = p.active;
+          if (p.has_max_bitrate_bps()) {
+            e.param.set_max_bitrate_bps(p.max_bitrate_bps);
+          }
+        }
+      }
+    }
+    if (!settings_) {
+      // まだ InitEncode() されていないので、次の InitEncode() で反映される
+      return;
+    }
+    if (bitrate) {
+      settings_->bitrate = *bitrate;
+    }
+    CalcLayerSettings();
+    for (auto& e : encoders_) {
+      if (!e.param.active) {
+        if (e.encoder != nullptr) {
+          PLOG_INFO << "Stop layer: rid=" << e.param.rid;
+          e.encoder->Release();
+          e.encoder = nullptr;
+        }
+      } else if (e.encoder == nullptr) {
+        PLOG_INFO << "Start layer: rid=" << e.param.rid;
+        if (!StartLayer(e)) {
+          PLOG_ERROR << "Failed to start layer: rid=" << e.param.rid;
+          continue;
+        }
+        // 受信側はこのレイヤーをデコードできる状態ではないのでキーフレームから始める
+        e.encoder->ForceIntraNextFrame();
+      } else {
+        e.encoder->SetBitrate(e.settings.bitrate);
+      }
+    }
+  }
+
+ private:
   std::vector<Encoder> encoders_;
+  // encoders_ と同じ順序の rid。作った後は変わらないので、ロックを取らずに参照して良い
+  std::vector<std::string> rids_;
+  // ForceIntraNextFrame() で要求されたレイヤー。
+  // RTCP を受信したスレッドから呼ばれるので、フラグだけ立てて次の Encode() で反映する
+  std::vector<std::atomic<bool>> force_intra_;
+  // RequestLossRecovery() で要求されたレイヤー
+  std::vector<std::atomic<bool>> loss_recovery_;
   bool simulcast_;
   std::function<std::shared_ptr<VideoEncoder>()> create_encoder_;
+  std::function<void(const EncodedImage&)> callback_;
+  // InitEncode() で渡された設定。Release() 済みの場合は nullopt
+  std::optional<Settings> settings_;
+
+  std::mutex pending_mutex_;
+  std::optional<Bps> pending_bitrate_;
+  std::optional<soracp::RtpEncodingParameters> pending_params_;
 };
 
-std::shared_ptr<VideoEncoder> CreateSimulcastEncoderAdapter(
+std::shared_ptr<SimulcastEncoderAdapter> CreateSimulcastEncoderAdapter(
     const soracp::RtpEncodingParameters& params,
     std::function<std::shared_ptr<VideoEncoder>()> create_encoder) {
-  return std::make_shared<SimulcastEncoderAdapter>(params, create_encoder);
+  return std::make_shared<SimulcastEncoderAdapterImpl>(params, create_encoder);
 }
 
 }  // namespace sorac
@@ -509,6 +509,16 @@ void sorac_signaling_set_on_push(SoracSignaling* p,
     on_push(message.c_str(), (int)message.size(), userdata);
   });
 }
+void sorac_signaling_set_on_state_change(
+    SoracSignaling* p,
+    sorac_signaling_on_state_change_func on_state_change,
+    void* userdata) {
+  auto signaling = g_cptr.Get(p, g_signaling_map);
+  signaling->SetOnStateChange(
+      [on_state_change, userdata](soracp::SignalingState state) {
+        on_state_change((soracp_SignalingState)state, userdata);
+      });
+}
 void sorac_signaling_get_rtp_encoding_parameters(
     SoracSignaling* p,
     soracp_RtpEncodingParameters* params) {
@@ -516,4 +526,10 @@ void sorac_signaling_get_rtp_encoding_parameters(
   auto u = signaling->GetRtpEncodingParameters();
   soracp_RtpEncodingParameters_from_cpp(u, params);
 }
+void sorac_signaling_set_rtp_encoding_active(SoracSignaling* p,
+                                            const char* rid,
+                                            bool active) {
+  auto signaling = g_cptr.Get(p, g_signaling_map);
+  signaling->SetRtpEncodingActive(rid, active);
+}
 }
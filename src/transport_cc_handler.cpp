@@ -0,0 +1,227 @@
+#include "sorac/transport_cc_handler.hpp"
+
+#include <string.h>
+
+// plog
+#include <plog/Log.h>
+
+#include "rtp_util.hpp"
+#include "sorac/current_time.hpp"
+
+namespace sorac {
+
+// transport-cc フィードバックの FMT
+static const int RTCP_RTPFB_FMT_TRANSPORT_CC = 15;
+// フィードバックを待つ送信済みパケットの最大数
+static const size_t MAX_HISTORY_PACKETS = 8192;
+// ヘッダ拡張の one-byte header 形式 (RFC 8285)
+static const uint16_t ONE_BYTE_HEADER_PROFILE = 0xbede;
+
+TransportCcSender::TransportCcSender(int extension_id)
+    : extension_id_(extension_id) {}
+
+void TransportCcSender::SetOnFeedback(
+    std::function<void(const std::vector<TransportCcPacketResult>&)>
+        on_feedback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  on_feedback_ = on_feedback;
+}
+
+// ヘッダ拡張に 2 バイトの要素を書き込める場所を確保して、その位置を返す。
+// 確保できなかった場合は 0 を返す。
+static size_t ReserveExtension(rtc::Message& packet, int id) {
+  uint8_t* buf = (uint8_t*)packet.data();
+  size_t header_size = get_rtp_header_size(buf, packet.size());
+  if (header_size == 0) {
+    return 0;
+  }
+  size_t ext_offset = RTP_FIXED_HEADER_SIZE + (buf[0] & 0x0f) * 4;
+  if ((buf[0] & 0x10) == 0) {
+    // ヘッダ拡張が無いので新しく追加する
+    static const uint8_t ext[8] = {0xbe, 0xde, 0x00, 0x01, 0, 0, 0, 0};
+    packet.insert(packet.begin() + ext_offset, (const std::byte*)ext,
+                  (const std::byte*)ext + sizeof(ext));
+    buf = (uint8_t*)packet.data();
+    buf[0] |= 0x10;
+    buf[ext_offset + 4] = (uint8_t)((id << 4) | 1);
+    return ext_offset + 5;
+  }
+
+  if (read_u16(buf + ext_offset) != ONE_BYTE_HEADER_PROFILE) {
+    PLOG_WARNING << "Unsupported RTP header extension profile";
+    return 0;
+  }
+  // 既存の要素の後ろに空きがあればそこを使う
+  size_t begin = ext_offset + 4;
+  size_t end = header_size;
+  size_t used = begin;
+  for (size_t i = begin; i < end;) {
+    if (buf[i] == 0) {
+      // パディング
+      i++;
+      continue;
+    }
+    if ((buf[i] >> 4) == 15) {
+      break;
+    }
+    i += 1 + (buf[i] & 0x0f) + 1;
+    used = i;
+  }
+  if (used + 3 > end) {
+    // 空きが無いので 4 バイト増やす
+    static const uint8_t zeros[4] = {0, 0, 0, 0};
+    packet.insert(packet.begin() + end, (const std::byte*)zeros,
+                  (const std::byte*)zeros + sizeof(zeros));
+    buf = (uint8_t*)packet.data();
+    write_u16(buf + ext_offset + 2, read_u16(buf + ext_offset + 2) + 1);
+  }
+  buf[used] = (uint8_t)((id << 4) | 1);
+  return used + 1;
+}
+
+void TransportCcSender::Stamp(rtc::Message& packet) {
+  size_t offset = ReserveExtension(packet, extension_id_);
+  if (offset == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64_t seq = next_sequence_number_++;
+  write_u16((uint8_t*)packet.data() + offset, (uint16_t)seq);
+  if (history_.empty()) {
+    first_sequence_number_ = seq;
+  }
+  history_.push_back(SentPacket{get_current_time(), packet.size()});
+  if (history_.size() > MAX_HISTORY_PACKETS) {
+    history_.pop_front();
+    first_sequence_number_ += 1;
+  }
+}
+
+void TransportCcSender::OnRtcp(const uint8_t* buf, size_t size) {
+  for_each_rtcp_packet(buf, size, [this](const uint8_t* p, size_t size) {
+    int fmt = p[0] & 0x1f;
+    if (p[1] == RTCP_PT_RTPFB && fmt == RTCP_RTPFB_FMT_TRANSPORT_CC) {
+      OnFeedback(p, size);
+    }
+  });
+}
+
+void TransportCcSender::OnFeedback(const uint8_t* p, size_t size) {
+  // header(4) + sender SSRC(4) + media SSRC(4) + base sequence number(2) +
+  // packet status count(2) + reference time(3) + feedback packet count(1)
+  if (size < 20) {
+    return;
+  }
+  uint16_t base_seq = read_u16(p + 12);
+  uint16_t status_count = read_u16(p + 14);
+  // 24 bit の符号付き整数で、64ms 単位
+  int32_t reference_time = (p[16] << 16) | (p[17] << 8) | p[18];
+  if (reference_time & 0x800000) {
+    reference_time -= 0x1000000;
+  }
+  uint8_t feedback_count = p[19];
+
+  // 各パケットの状態
+  // 0: 受信してない, 1: 受信した (delta 1 byte), 2: 受信した (delta 2 bytes)
+  std::vector<uint8_t> statuses;
+  statuses.reserve(status_count);
+  size_t offset = 20;
+  while (statuses.size() < status_count) {
+    if (offset + 2 > size) {
+      PLOG_WARNING << "Invalid transport-cc feedback";
+      return;
+    }
+    uint16_t chunk = read_u16(p + offset);
+    offset += 2;
+    if ((chunk & 0x8000) == 0) {
+      // run length chunk
+      uint8_t symbol = (chunk >> 13) & 0x03;
+      int length = chunk & 0x1fff;
+      for (int i = 0; i < length && statuses.size() < status_count; i++) {
+        statuses.push_back(symbol);
+      }
+    } else if ((chunk & 0x4000) == 0) {
+      // status vector chunk (1 bit x 14)
+      for (int i = 13; i >= 0 && statuses.size() < status_count; i--) {
+        statuses.push_back((chunk >> i) & 0x01);
+      }
+    } else {
+      // status vector chunk (2 bit x 7)
+      for (int i = 6; i >= 0 && statuses.size() < status_count; i--) {
+        statuses.push_back((chunk >> (i * 2)) & 0x03);
+      }
+    }
+  }
+
+  std::vector<TransportCcPacketResult> results;
+  std::function<void(const std::vector<TransportCcPacketResult>&)> on_feedback;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 同じ RTCP が複数のトラックに届くことがあるので、処理済みのフィードバックは無視する
+    if (last_feedback_count_ == feedback_count) {
+      return;
+    }
+    last_feedback_count_ = feedback_count;
+
+    // 送信した sequence number の中で base_seq に最も近いものを探す
+    int64_t base = next_sequence_number_ +
+                   (int16_t)(base_seq - (uint16_t)next_sequence_number_);
+    auto arrival = std::chrono::microseconds(int64_t(reference_time) * 64000);
+    results.reserve(status_count);
+    for (int i = 0; i < status_count; i++) {
+      std::optional<std::chrono::microseconds> arrival_time;
+      if (statuses[i] == 1) {
+        if (offset + 1 > size) {
+          break;
+        }
+        arrival += std::chrono::microseconds(p[offset] * 250);
+        offset += 1;
+        arrival_time = arrival;
+      } else if (statuses[i] == 2) {
+        if (offset + 2 > size) {
+          break;
+        }
+        arrival +=
+            std::chrono::microseconds((int16_t)read_u16(p + offset) * 250);
+        offset += 2;
+        arrival_time = arrival;
+      }
+      int64_t seq = base + i;
+      int64_t index = seq - first_sequence_number_;
+      if (index < 0 || index >= (int64_t)history_.size()) {
+        continue;
+      }
+      const auto& sent = history_[index];
+      results.push_back(TransportCcPacketResult{seq, sent.send_time,
+                                                arrival_time, sent.size});
+    }
+    on_feedback = on_feedback_;
+  }
+  if (on_feedback && !results.empty()) {
+    on_feedback(results);
+  }
+}
+
+TransportCcMediaHandler::TransportCcMediaHandler(
+    std::shared_ptr<TransportCcSender> sender)
+    : sender_(sender) {}
+
+void TransportCcMediaHandler::incoming(rtc::message_vector& messages,
+                                       const rtc::message_callback& send) {
+  for (const auto& message : messages) {
+    if (message->type == rtc::Message::Control) {
+      sender_->OnRtcp((const uint8_t*)message->data(), message->size());
+    }
+  }
+}
+
+void TransportCcMediaHandler::outgoing(rtc::message_vector& messages,
+                                       const rtc::message_callback& send) {
+  for (const auto& message : messages) {
+    if (message->type != rtc::Message::Control) {
+      sender_->Stamp(*message);
+    }
+  }
+}
+
+}  // namespace sorac
@@ -212,6 +212,19 @@ class VTH26xVideoEncoder : public VideoEncoder {
       return;
     }
 
+    int64_t bitrate = next_bitrate_bps_.exchange(0);
+    if (bitrate > 0) {
+      int value = (int)bitrate;
+      CFNumberRef cfnum =
+          CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+      Resource cfnum_resource([cfnum]() { CFRelease(cfnum); });
+      OSStatus err = VTSessionSetProperty(
+          vtref_, kVTCompressionPropertyKey_AverageBitRate, cfnum);
+      if (err != noErr) {
+        PLOG_WARNING << "Failed to set average-bitrate property: err=" << err;
+      }
+    }
+
     CFDictionaryRef frame_properties = nullptr;
     Resource frame_properties_resource([&frame_properties]() {
       if (frame_properties != nullptr) {
@@ -243,6 +256,10 @@ class VTH26xVideoEncoder : public VideoEncoder {
     }
   }
 
+  void SetBitrate(Bps bitrate) override {
+    next_bitrate_bps_ = bitrate.count();
+  }
+
   void Release() override {
     if (vtref_ != nullptr) {
       VTCompressionSessionInvalidate(vtref_);
@@ -274,6 +291,12 @@ class VTH26xVideoEncoder : public VideoEncoder {
     }
     if (flags & kVTEncodeInfo_FrameDropped) {
       PLOG_INFO << "H26x encode dropped frame.";
+      EncodedImage skipped;
+      skipped.buf = nullptr;
+      skipped.size = 0;
+      skipped.timestamp = timestamp;
+      skipped.frame_type = EncodedImage::FrameType::kSkip;
+      callback_(skipped);
       return;
     }
 
@@ -288,10 +311,14 @@ class VTH26xVideoEncoder : public VideoEncoder {
 
     EncodedImage encoded;
     encoded.timestamp = timestamp;
-    // CMSampleBufferRef を encoded.buf に詰める
+    encoded.frame_type = key_frame ? EncodedImage::FrameType::kKey
+                                   : EncodedImage::FrameType::kDelta;
+    // CMSampleBufferRef を encoded.buf に詰める。
+    // Video Toolbox の出力は NAL ユニットの長さが 4 バイトで入った AVCC 形式なので、
+    // Annex B に変換せずにそのままパケタイザに渡す。
+    encoded.nal_separator = EncodedImage::NalSeparator::kLength;
     {
-      const char NAL_BYTES[4] = {0, 0, 0, 1};
-      const size_t NAL_SIZE = sizeof(NAL_BYTES);
+      const size_t NAL_SIZE = 4;
 
       CMBlockBufferRef buf = CMSampleBufferGetDataBuffer(buffer);
       size_t block_buffer_size = CMBlockBufferGetDataLength(buf);
@@ -364,9 +391,14 @@ class VTH26xVideoEncoder : public VideoEncoder {
             return;
           }
 
-          memcpy(dst, NAL_BYTES, NAL_SIZE);
+          dst[0] = (uint8_t)(param_set_size >> 24);
+          dst[1] = (uint8_t)(param_set_size >> 16);
+          dst[2] = (uint8_t)(param_set_size >> 8);
+          dst[3] = (uint8_t)param_set_size;
           dst += NAL_SIZE;
 
+          encoded.nal_units.push_back(
+              {(int)(dst - encoded.buf.get()), (int)param_set_size});
           memcpy(dst, param_set, param_set_size);
           dst += param_set_size;
         }
@@ -376,29 +408,27 @@ class VTH26xVideoEncoder : public VideoEncoder {
         dst = encoded.buf.get();
       }
 
+      if (OSStatus err =
+              CMBlockBufferCopyDataBytes(buf, 0, block_buffer_size, dst);
+          err != noErr) {
+        PLOG_ERROR << "Failed to copy data bytes: err=" << err;
+        return;
+      }
+      // NAL ユニットの位置を記録する
       size_t buf_pos = 0;
-      while (buf_pos < block_buffer_size) {
-        uint32_t size_buf = 0;
-        if (OSStatus err = CMBlockBufferCopyDataBytes(
-                buf, buf_pos, sizeof(uint32_t), &size_buf);
-            err != noErr) {
-          PLOG_ERROR << "Failed to copy data bytes: err=" << err;
-          return;
-        }
-        buf_pos += sizeof(uint32_t);
-
-        uint32_t size = CFSwapInt32BigToHost(size_buf);
-
-        memcpy(dst, NAL_BYTES, NAL_SIZE);
-        dst += NAL_SIZE;
-
-        if (OSStatus err = CMBlockBufferCopyDataBytes(buf, buf_pos, size, dst);
-            err != noErr) {
-          PLOG_ERROR << "Failed to copy data bytes: err=" << err;
+      while (buf_pos + NAL_SIZE <= block_buffer_size) {
+        uint32_t size = ((uint32_t)dst[buf_pos] << 24) |
+                        ((uint32_t)dst[buf_pos + 1] << 16) |
+                        ((uint32_t)dst[buf_pos + 2] << 8) |
+                        (uint32_t)dst[buf_pos + 3];
+        buf_pos += NAL_SIZE;
+        if (buf_pos + size > block_buffer_size) {
+          PLOG_ERROR << "Invalid NAL unit size: " << size;
           return;
         }
+        encoded.nal_units.push_back(
+            {(int)(dst + buf_pos - encoded.buf.get()), (int)size});
         buf_pos += size;
-        dst += size;
       }
     }
 
@@ -417,6 +447,8 @@ class VTH26xVideoEncoder : public VideoEncoder {
   std::function<void(const EncodedImage&)> callback_;
 
   std::atomic<bool> next_iframe_;
+  // 0 の場合は変更なし
+  std::atomic<int64_t> next_bitrate_bps_{0};
 };
 
 std::shared_ptr<VideoEncoder> CreateVTH26xVideoEncoder(